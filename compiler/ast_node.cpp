@@ -16,6 +16,7 @@
 
 #include "bamql-compiler.hpp"
 #include "compiler.hpp"
+#include <llvm/IR/Intrinsics.h>
 
 namespace bamql {
 llvm::Value *AstNode::generateIndex(GenerateState &state,
@@ -27,18 +28,51 @@ llvm::Value *AstNode::generateIndex(GenerateState &state,
 }
 
 bool AstNode::usesIndex() { return false; }
+bool AstNode::constantInt(int &value) { return false; }
+bool AstNode::constantStr(std::string &value) { return false; }
+bool AstNode::equalityOperands(bool &equal,
+                               std::shared_ptr<AstNode> &left,
+                               std::shared_ptr<AstNode> &right) {
+  return false;
+}
+bool AstNode::regexOperands(std::shared_ptr<AstNode> &operand,
+                            const RegularExpression *&pattern) {
+  return false;
+}
+bool AstNode::structuralKey(std::string &key) { return false; }
+bool AstNode::coreOnly() { return false; }
+llvm::Value *AstNode::generateCore(GenerateState &state,
+                                   llvm::Value *read,
+                                   llvm::Value *header,
+                                   llvm::Value *error_fn,
+                                   llvm::Value *error_ctx) {
+  return coreOnly() ? generate(state, read, header, error_fn, error_ctx)
+                    : nullptr;
+}
+bool AstNode::readGroup() { return false; }
+void AstNode::explain(QueryPlan &plan) { plan.add(this, "(opaque term)", 4); }
+llvm::Value *AstNode::generateHeader(GenerateState &state,
+                                     llvm::Value *header,
+                                     llvm::Value *error_fn,
+                                     llvm::Value *error_ctx) {
+  return nullptr;
+}
 
 llvm::Function *AstNode::createFunction(std::shared_ptr<Generator> &generator,
                                         llvm::StringRef name,
                                         llvm::StringRef param_name,
                                         llvm::Type *param_type,
                                         GenerateMember member) {
-  llvm::Type *func_args_ty[] = {
-    llvm::PointerType::get(getBamHeaderType(generator->module()), 0),
-    param_type, getErrorHandlerType(generator->module()),
-    llvm::PointerType::get(
-        llvm::Type::getInt8Ty(generator->module()->getContext()), 0)
-  };
+  // Without a parameter type, the function only takes the header.
+  std::vector<llvm::Type *> func_args_ty;
+  func_args_ty.push_back(
+      llvm::PointerType::get(getBamHeaderType(generator->module()), 0));
+  if (param_type != nullptr) {
+    func_args_ty.push_back(param_type);
+  }
+  func_args_ty.push_back(getErrorHandlerType(generator->module()));
+  func_args_ty.push_back(llvm::PointerType::get(
+      llvm::Type::getInt8Ty(generator->module()->getContext()), 0));
   auto func_ty = llvm::FunctionType::get(
       llvm::Type::getInt1Ty(generator->module()->getContext()), func_args_ty,
       false);
@@ -54,9 +88,12 @@ llvm::Function *AstNode::createFunction(std::shared_ptr<Generator> &generator,
   auto header_value = &*args;
   args++;
   header_value->setName("header");
-  auto param_value = &*args;
-  args++;
-  param_value->setName(param_name);
+  llvm::Value *param_value = nullptr;
+  if (param_type != nullptr) {
+    param_value = &*args;
+    args++;
+    param_value->setName(param_name);
+  }
   auto error_fn_value = &*args;
   args++;
   error_fn_value->setName("error_fn");
@@ -90,8 +127,215 @@ llvm::Function *AstNode::createIndexFunction(
       this->usesIndex() ? &AstNode::generateIndex : nullptr);
 }
 
+llvm::Function *AstNode::createBatchFunction(
+    std::shared_ptr<Generator> &generator,
+    llvm::StringRef name,
+    llvm::Function *filter) {
+  type_check(this, BOOL);
+  auto module = generator->module();
+  auto &context = module->getContext();
+  auto base_bool = llvm::Type::getInt1Ty(context);
+  auto base_uint8 = llvm::Type::getInt8Ty(context);
+  auto base_size = llvm::IntegerType::get(context, sizeof(size_t) * 8);
+  auto ptr_bam1_t = llvm::PointerType::get(getBamType(module), 0);
+  llvm::Type *func_args_ty[] = {
+    llvm::PointerType::get(getBamHeaderType(module), 0),
+    llvm::PointerType::get(ptr_bam1_t, 0),
+    llvm::PointerType::get(base_uint8, 0),
+    base_size,
+    getErrorHandlerType(module),
+    llvm::PointerType::get(base_uint8, 0)
+  };
+  auto func = llvm::Function::Create(
+      llvm::FunctionType::get(base_bool, func_args_ty, false),
+      llvm::Function::ExternalLinkage, name, module);
+  func->addRetAttr(llvm::Attribute::ZExt);
+  // Nothing else refers to the list of reads or the results, so the loads in
+  // the first loop can be reordered around the stores.
+  func->addParamAttr(1, llvm::Attribute::NoAlias);
+  func->addParamAttr(2, llvm::Attribute::NoAlias);
+
+  auto args = func->arg_begin();
+  auto header_value = &*args++;
+  header_value->setName("header");
+  auto reads_value = &*args++;
+  reads_value->setName("reads");
+  auto matches_value = &*args++;
+  matches_value->setName("matches");
+  auto count_value = &*args++;
+  count_value->setName("count");
+  auto error_fn_value = &*args++;
+  error_fn_value->setName("error_fn");
+  auto error_ctx_value = &*args++;
+  error_ctx_value->setName("error_ctx");
+
+  auto entry = llvm::BasicBlock::Create(context, "entry", func);
+  auto core_block = llvm::BasicBlock::Create(context, "core", func);
+  auto filter_block = llvm::BasicBlock::Create(context, "filter", func);
+  auto call_block = llvm::BasicBlock::Create(context, "call", func);
+  auto next_block = llvm::BasicBlock::Create(context, "next", func);
+  auto exit_block = llvm::BasicBlock::Create(context, "exit", func);
+  auto zero = llvm::ConstantInt::get(base_size, 0);
+  auto one = llvm::ConstantInt::get(base_size, 1);
+
+  GenerateState state(generator, entry);
+  this->writeDebug(state);
+  state->CreateCondBr(state->CreateICmpEQ(count_value, zero), exit_block,
+                      core_block);
+
+  /* Check the fixed-size fields of every read. Reads that fail are marked
+   * as not matching and the rest are left for the full query. */
+  state->SetInsertPoint(core_block);
+  auto core_index = state->CreatePHI(base_size, 2);
+  core_index->addIncoming(zero, entry);
+  auto core_read = state->CreateLoad(
+      ptr_bam1_t, state->CreateGEP(ptr_bam1_t, reads_value, core_index));
+  auto core = generateCore(state, core_read, header_value, error_fn_value,
+                           error_ctx_value);
+  state->CreateStore(core == nullptr ? llvm::ConstantInt::get(base_uint8, 1)
+                                     : state->CreateZExt(core, base_uint8),
+                     state->CreateGEP(base_uint8, matches_value, core_index));
+  auto core_next = state->CreateAdd(core_index, one);
+  core_index->addIncoming(core_next, state->GetInsertBlock());
+  auto core_end = state->GetInsertBlock();
+  state->CreateCondBr(state->CreateICmpEQ(core_next, count_value),
+                      filter_block, core_block);
+
+  /* Run the full query on the reads that are left. */
+  state->SetInsertPoint(filter_block);
+  auto index = state->CreatePHI(base_size, 2);
+  index->addIncoming(zero, core_end);
+  auto any = state->CreatePHI(base_bool, 2);
+  any->addIncoming(llvm::ConstantInt::getFalse(context), core_end);
+  auto match_ptr = state->CreateGEP(base_uint8, matches_value, index);
+  state->CreateCondBr(
+      state->CreateICmpNE(state->CreateLoad(base_uint8, match_ptr),
+                          llvm::ConstantInt::get(base_uint8, 0)),
+      call_block, next_block);
+
+  state->SetInsertPoint(call_block);
+  llvm::Value *filter_args[] = {
+    header_value,
+    state->CreateLoad(ptr_bam1_t,
+                      state->CreateGEP(ptr_bam1_t, reads_value, index)),
+    error_fn_value, error_ctx_value
+  };
+  auto result = state->CreateCall(filter, filter_args);
+  state->CreateStore(state->CreateZExt(result, base_uint8), match_ptr);
+  auto call_any = state->CreateOr(any, result);
+  auto call_end = state->GetInsertBlock();
+  state->CreateBr(next_block);
+
+  state->SetInsertPoint(next_block);
+  auto next_any = state->CreatePHI(base_bool, 2);
+  next_any->addIncoming(any, filter_block);
+  next_any->addIncoming(call_any, call_end);
+  auto next_index = state->CreateAdd(index, one);
+  index->addIncoming(next_index, next_block);
+  any->addIncoming(next_any, next_block);
+  state->CreateCondBr(state->CreateICmpEQ(next_index, count_value),
+                      exit_block, filter_block);
+
+  state->SetInsertPoint(exit_block);
+  auto matched = state->CreatePHI(base_bool, 2);
+  matched->addIncoming(llvm::ConstantInt::getFalse(context), entry);
+  matched->addIncoming(next_any, next_block);
+  state->CreateRet(matched);
+  return func;
+}
+
+llvm::Value *AstNode::generateRaw(GenerateState &state,
+                                  llvm::Value *record,
+                                  llvm::Value *header,
+                                  llvm::Value *error_fn,
+                                  llvm::Value *error_ctx) {
+  state.raw_record = true;
+  auto result = generateCore(state, record, header, error_fn, error_ctx);
+  return result == nullptr
+             ? llvm::ConstantInt::getTrue(state.module()->getContext())
+             : result;
+}
+
+llvm::Function *AstNode::createRawFilterFunction(
+    std::shared_ptr<Generator> &generator, llvm::StringRef name) {
+  type_check(this, BOOL);
+  getBamType(generator->module());
+  if (generator->module()->getFunction("bamql_flags_raw") == nullptr) {
+    return nullptr;
+  }
+  auto func = createFunction(
+      generator, name, "record",
+      llvm::PointerType::get(
+          llvm::Type::getInt8Ty(generator->module()->getContext()), 0),
+      &AstNode::generateRaw);
+  auto result = llvm::dyn_cast<llvm::ConstantInt>(
+      llvm::cast<llvm::ReturnInst>(func->back().getTerminator())
+          ->getReturnValue());
+  if (result != nullptr && result->isOne()) {
+    func->eraseFromParent();
+    return nullptr;
+  }
+  return func;
+}
+
+llvm::Value *AstNode::generateFile(GenerateState &state,
+                                   llvm::Value *unused,
+                                   llvm::Value *header,
+                                   llvm::Value *error_fn,
+                                   llvm::Value *error_ctx) {
+  auto result = generateHeader(state, header, error_fn, error_ctx);
+  return result == nullptr
+             ? llvm::ConstantInt::getTrue(state.module()->getContext())
+             : result;
+}
+
+llvm::Function *AstNode::createHeaderFunction(
+    std::shared_ptr<Generator> &generator, llvm::StringRef name) {
+  type_check(this, BOOL);
+  auto func = createFunction(generator, name, "", nullptr,
+                             &AstNode::generateFile);
+  auto result = llvm::dyn_cast<llvm::ConstantInt>(
+      llvm::cast<llvm::ReturnInst>(func->back().getTerminator())
+          ->getReturnValue());
+  if (result != nullptr && result->isOne()) {
+    func->eraseFromParent();
+    return nullptr;
+  }
+  return func;
+}
+
 DebuggableNode::DebuggableNode(ParseState &state)
     : line(state.currentLine()), column(state.currentColumn()) {}
+llvm::Value *DebuggableNode::generate(GenerateState &state,
+                                      llvm::Value *read,
+                                      llvm::Value *header,
+                                      llvm::Value *error_fn,
+                                      llvm::Value *error_ctx) {
+  auto profiling = state.getGenerator().profiling();
+  if ((profiling & PROFILE_NODES) == 0) {
+    return generateValue(state, read, header, error_fn, error_ctx);
+  }
+  auto probe = state.getGenerator().createProbe(this, line, column);
+  llvm::Function *cycle_counter = nullptr;
+  llvm::Value *start = nullptr;
+  if (profiling & PROFILE_CYCLES) {
+    cycle_counter = llvm::Intrinsic::getDeclaration(
+        state.module(), llvm::Intrinsic::readcyclecounter);
+    start = state->CreateCall(cycle_counter);
+  }
+  auto result = generateValue(state, read, header, error_fn, error_ctx);
+  state.addToProbe(probe, 0,
+                   llvm::ConstantInt::getTrue(state.module()->getContext()));
+  if (type() == BOOL) {
+    state.addToProbe(probe, 1, result);
+    state.addToProbe(probe, 2, state->CreateNot(result));
+  }
+  if (cycle_counter != nullptr) {
+    state.addToProbe(probe, 3,
+                     state->CreateSub(state->CreateCall(cycle_counter), start));
+  }
+  return result;
+}
 void DebuggableNode::writeDebug(GenerateState &state) {
   if (state.debugScope() != nullptr)
     state->SetCurrentDebugLocation(llvm::DILocation::get(
@@ -21,13 +21,15 @@ namespace bamql {
 
 class UseNode final : public DebuggableNode {
 public:
-  UseNode(ParseState &state, std::shared_ptr<AstNode> e)
-      : DebuggableNode(state), expr(e) {}
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx) {
+  UseNode(ParseState &state,
+          const std::string &name_,
+          std::shared_ptr<AstNode> e)
+      : DebuggableNode(state), expr(e), name(name_) {}
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx) {
     return state.definitions[this];
   }
   llvm::Value *generateIndex(GenerateState &state,
@@ -55,20 +57,34 @@ public:
     state.definitionsIndex[this] = result;
     return result;
   }
+  bool structuralKey(std::string &key) {
+    // Every use of a variable is this node, so it can be identified by its
+    // address.
+    key = "$" + std::to_string(reinterpret_cast<uintptr_t>(this));
+    return true;
+  }
   ExprType type() { return expr->type(); }
+  void explain(QueryPlan &plan) { plan.add(this, name); }
+  /**
+   * Describe the expression, which is evaluated once, where it is defined.
+   */
+  void explainDefinition(QueryPlan &plan) {
+    plan.add(this, name + " =", { expr });
+  }
 
 private:
   std::shared_ptr<AstNode> expr;
+  std::string name;
 };
 
 class BindingNode final : public DebuggableNode {
 public:
   BindingNode(ParseState &state) : DebuggableNode(state) {}
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx) {
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx) {
     for (auto &def : definitions) {
       def->writeDebug(state);
       def->generateAtDefinition(state, read, header, error_fn, error_ctx);
@@ -92,6 +108,15 @@ public:
   void parse(ParseState &state);
 
   ExprType type() { return body->type(); }
+  void explain(QueryPlan &plan) {
+    plan.add(this, "let");
+    plan.nest([&]() {
+      for (auto &def : definitions) {
+        def->explainDefinition(plan);
+      }
+      body->explain(plan);
+    });
+  }
 
 private:
   std::vector<std::shared_ptr<UseNode>> definitions;
@@ -112,7 +137,7 @@ std::shared_ptr<AstNode> parseBinding(ParseState &state) {
     auto name = state.parseStr(
         "ABCDEFGHIJLKLMNOPQRSTUVWXYZabcdefghijlklmnopqrstuvwxyz0123456789_");
     state.parseCharInSpace('=');
-    auto use = std::make_shared<UseNode>(state, AstNode::parse(state));
+    auto use = std::make_shared<UseNode>(state, name, AstNode::parse(state));
     let->definitions.push_back(use);
     childPredicates[name] = [=](ParseState &state) {
       return std::static_pointer_cast<AstNode>(use);
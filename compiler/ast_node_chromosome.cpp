@@ -52,11 +52,15 @@ CheckChromosomeNode::CheckChromosomeNode(const std::string &str,
                                          ParseState &state)
     : CheckChromosomeNode(chrStrToRegex(str), mate, state) {}
 
-llvm::Value *CheckChromosomeNode::generate(GenerateState &state,
-                                           llvm::Value *read,
-                                           llvm::Value *header,
-                                           llvm::Value *error_fn,
-                                           llvm::Value *error_ctx) {
+llvm::Value *CheckChromosomeNode::generateValue(GenerateState &state,
+                                                llvm::Value *read,
+                                                llvm::Value *header,
+                                                llvm::Value *error_fn,
+                                                llvm::Value *error_ctx) {
+  bool matches;
+  if (!mate && state.getGenerator().decideChromosome(name, matches)) {
+    return llvm::ConstantInt::getBool(state.module()->getContext(), matches);
+  }
   auto function = state.module()->getFunction("bamql_check_chromosome");
   llvm::Value *args[] = {
     header, read, name(state),
@@ -80,8 +84,35 @@ llvm::Value *CheckChromosomeNode::generateIndex(GenerateState &state,
 
 bool CheckChromosomeNode::usesIndex() { return !mate; }
 
+/**
+ * The read, or its mate, can only be on a chromosome named in the header.
+ */
+llvm::Value *CheckChromosomeNode::generateHeader(GenerateState &state,
+                                                 llvm::Value *header,
+                                                 llvm::Value *error_fn,
+                                                 llvm::Value *error_ctx) {
+  auto function = state.module()->getFunction("bamql_header_chromosome");
+  llvm::Value *args[] = { header, name(state) };
+  return state->CreateCall(function, args);
+}
+
 ExprType CheckChromosomeNode::type() { return BOOL; }
 
+/**
+ * The read's own chromosome is decided once per chromosome, by the index or
+ * the version of the query for that chromosome, but the mate's is matched
+ * using PCRE for every read.
+ */
+void CheckChromosomeNode::explain(QueryPlan &plan) {
+  plan.decode("fixed-size fields");
+  if (mate) {
+    plan.add(this, "mate_chr " + name.describe() + " (PCRE)", 32);
+  } else {
+    plan.add(this, "chr " + name.describe() + " (decided once per chromosome)",
+             1);
+  }
+}
+
 std::shared_ptr<AstNode> CheckChromosomeNode::parse(ParseState &state,
                                                     bool mate) {
   state.parseCharInSpace('(');
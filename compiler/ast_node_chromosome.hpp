@@ -32,11 +32,11 @@ public:
 
   CheckChromosomeNode(const std::string &str, bool mate, ParseState &state);
 
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
   llvm::Value *generateIndex(GenerateState &state,
                              llvm::Value *chromosome,
                              llvm::Value *header,
@@ -45,7 +45,13 @@ public:
 
   bool usesIndex();
 
+  llvm::Value *generateHeader(GenerateState &state,
+                              llvm::Value *header,
+                              llvm::Value *error_fn,
+                              llvm::Value *error_ctx);
+
   ExprType type();
+  void explain(QueryPlan &plan);
 
   static std::shared_ptr<AstNode> parse(ParseState &state, bool mate);
 
@@ -19,6 +19,56 @@
 #include "compiler.hpp"
 
 namespace bamql {
+static bool compareEquality(CreateICmp comparator,
+                            std::shared_ptr<AstNode> &left,
+                            std::shared_ptr<AstNode> &right,
+                            bool &equal,
+                            std::shared_ptr<AstNode> &left_out,
+                            std::shared_ptr<AstNode> &right_out) {
+  if (comparator == &llvm::IRBuilder<>::CreateICmpEQ) {
+    equal = true;
+  } else if (comparator == &llvm::IRBuilder<>::CreateICmpNE) {
+    equal = false;
+  } else {
+    return false;
+  }
+  left_out = left;
+  right_out = right;
+  return true;
+}
+/**
+ * The operator in the query for a comparison, for query plans.
+ */
+static std::string comparisonSymbol(CreateICmp comparator) {
+  if (comparator == &llvm::IRBuilder<>::CreateICmpEQ) {
+    return "==";
+  } else if (comparator == &llvm::IRBuilder<>::CreateICmpNE) {
+    return "!=";
+  } else if (comparator == &llvm::IRBuilder<>::CreateICmpSLE) {
+    return "<=";
+  } else if (comparator == &llvm::IRBuilder<>::CreateICmpSGE) {
+    return ">=";
+  } else if (comparator == &llvm::IRBuilder<>::CreateICmpSLT) {
+    return "<";
+  } else {
+    return ">";
+  }
+}
+static std::string comparisonSymbol(CreateFCmp comparator) {
+  if (comparator == &llvm::IRBuilder<>::CreateFCmpOEQ) {
+    return "==";
+  } else if (comparator == &llvm::IRBuilder<>::CreateFCmpONE) {
+    return "!=";
+  } else if (comparator == &llvm::IRBuilder<>::CreateFCmpOLE) {
+    return "<=";
+  } else if (comparator == &llvm::IRBuilder<>::CreateFCmpOGE) {
+    return ">=";
+  } else if (comparator == &llvm::IRBuilder<>::CreateFCmpOLT) {
+    return "<";
+  } else {
+    return ">";
+  }
+}
 CompareFPNode::CompareFPNode(CreateFCmp comparator_,
                              std::shared_ptr<AstNode> &left_,
                              std::shared_ptr<AstNode> &right_,
@@ -28,11 +78,11 @@ CompareFPNode::CompareFPNode(CreateFCmp comparator_,
   type_check(left, FP);
   type_check(right, FP);
 }
-llvm::Value *CompareFPNode::generate(GenerateState &state,
-                                     llvm::Value *read,
-                                     llvm::Value *header,
-                                     llvm::Value *error_fn,
-                                     llvm::Value *error_ctx) {
+llvm::Value *CompareFPNode::generateValue(GenerateState &state,
+                                          llvm::Value *read,
+                                          llvm::Value *header,
+                                          llvm::Value *error_fn,
+                                          llvm::Value *error_ctx) {
   left->writeDebug(state);
   auto left_value = left->generate(state, read, header, error_fn, error_ctx);
   right->writeDebug(state);
@@ -41,6 +91,9 @@ llvm::Value *CompareFPNode::generate(GenerateState &state,
   return ((*state)->*comparator)(left_value, right_value, "", nullptr);
 }
 ExprType CompareFPNode::type() { return BOOL; }
+void CompareFPNode::explain(QueryPlan &plan) {
+  plan.add(this, comparisonSymbol(comparator), { left, right }, 1);
+}
 
 CompareIntNode::CompareIntNode(CreateICmp comparator_,
                                std::shared_ptr<AstNode> &left_,
@@ -51,11 +104,11 @@ CompareIntNode::CompareIntNode(CreateICmp comparator_,
   type_check(left, INT);
   type_check(right, INT);
 }
-llvm::Value *CompareIntNode::generate(GenerateState &state,
-                                      llvm::Value *read,
-                                      llvm::Value *header,
-                                      llvm::Value *error_fn,
-                                      llvm::Value *error_ctx) {
+llvm::Value *CompareIntNode::generateValue(GenerateState &state,
+                                           llvm::Value *read,
+                                           llvm::Value *header,
+                                           llvm::Value *error_fn,
+                                           llvm::Value *error_ctx) {
   left->writeDebug(state);
   auto left_value = left->generate(state, read, header, error_fn, error_ctx);
   right->writeDebug(state);
@@ -63,7 +116,18 @@ llvm::Value *CompareIntNode::generate(GenerateState &state,
   this->writeDebug(state);
   return ((*state)->*comparator)(left_value, right_value, "");
 }
+bool CompareIntNode::equalityOperands(bool &equal,
+                                      std::shared_ptr<AstNode> &left_,
+                                      std::shared_ptr<AstNode> &right_) {
+  return compareEquality(comparator, left, right, equal, left_, right_);
+}
+bool CompareIntNode::coreOnly() {
+  return left->coreOnly() && right->coreOnly();
+}
 ExprType CompareIntNode::type() { return BOOL; }
+void CompareIntNode::explain(QueryPlan &plan) {
+  plan.add(this, comparisonSymbol(comparator), { left, right }, 1);
+}
 
 CompareStrNode::CompareStrNode(CreateICmp comparator_,
                                std::shared_ptr<AstNode> &left_,
@@ -74,16 +138,29 @@ CompareStrNode::CompareStrNode(CreateICmp comparator_,
   type_check(left, STR);
   type_check(right, STR);
 }
-llvm::Value *CompareStrNode::generate(GenerateState &state,
-                                      llvm::Value *read,
-                                      llvm::Value *header,
-                                      llvm::Value *error_fn,
-                                      llvm::Value *error_ctx) {
+llvm::Value *CompareStrNode::generateValue(GenerateState &state,
+                                           llvm::Value *read,
+                                           llvm::Value *header,
+                                           llvm::Value *error_fn,
+                                           llvm::Value *error_ctx) {
   left->writeDebug(state);
   auto left_value = left->generate(state, read, header, error_fn, error_ctx);
   right->writeDebug(state);
   auto right_value = right->generate(state, read, header, error_fn, error_ctx);
   this->writeDebug(state);
+  bool equal = comparator == &llvm::IRBuilder<>::CreateICmpEQ;
+  if (equal || comparator == &llvm::IRBuilder<>::CreateICmpNE) {
+    std::string literal;
+    llvm::Value *result = nullptr;
+    if (right->constantStr(literal)) {
+      result = generateStrEquals(state, left_value, literal);
+    } else if (left->constantStr(literal)) {
+      result = generateStrEquals(state, right_value, literal);
+    }
+    if (result != nullptr) {
+      return equal ? result : state->CreateNot(result);
+    }
+  }
   auto function = state.module()->getFunction("bamql_strcmp");
   llvm::Value *args[] = { left_value, right_value };
   auto result = state->CreateCall(function, args);
@@ -93,5 +170,41 @@ llvm::Value *CompareStrNode::generate(GenerateState &state,
           llvm::Type::getInt32Ty(state.module()->getContext()), 0),
       "");
 }
+llvm::Value *CompareStrNode::generateHeader(GenerateState &state,
+                                            llvm::Value *header,
+                                            llvm::Value *error_fn,
+                                            llvm::Value *error_ctx) {
+  if (comparator != &llvm::IRBuilder<>::CreateICmpEQ) {
+    return nullptr;
+  }
+  std::string literal;
+  if (!(left->readGroup() && right->constantStr(literal)) &&
+      !(right->readGroup() && left->constantStr(literal))) {
+    return nullptr;
+  }
+  auto function = state.module()->getFunction("bamql_header_read_group_id");
+  llvm::Value *args[] = { header, state.createString(literal) };
+  return state->CreateCall(function, args);
+}
+bool CompareStrNode::equalityOperands(bool &equal,
+                                      std::shared_ptr<AstNode> &left_,
+                                      std::shared_ptr<AstNode> &right_) {
+  return compareEquality(comparator, left, right, equal, left_, right_);
+}
 ExprType CompareStrNode::type() { return BOOL; }
+/**
+ * Equality with a constant is checked inline; everything else calls
+ * `bamql_strcmp`.
+ */
+void CompareStrNode::explain(QueryPlan &plan) {
+  std::string literal;
+  bool inline_equal =
+      (comparator == &llvm::IRBuilder<>::CreateICmpEQ ||
+       comparator == &llvm::IRBuilder<>::CreateICmpNE) &&
+      (left->constantStr(literal) || right->constantStr(literal));
+  plan.add(this,
+           comparisonSymbol(comparator) +
+               (inline_equal ? " (string comparison)" : " (strcmp)"),
+           { left, right }, inline_equal ? 2 : 4);
+}
 } // namespace bamql
@@ -33,12 +33,13 @@ public:
                 std::shared_ptr<AstNode> &left,
                 std::shared_ptr<AstNode> &right,
                 ParseState &state);
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
   ExprType type();
+  void explain(QueryPlan &plan);
 
 private:
   CreateFCmp comparator;
@@ -52,12 +53,17 @@ public:
                  std::shared_ptr<AstNode> &left,
                  std::shared_ptr<AstNode> &right,
                  ParseState &state);
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
+  bool equalityOperands(bool &equal,
+                        std::shared_ptr<AstNode> &left,
+                        std::shared_ptr<AstNode> &right);
+  bool coreOnly();
   ExprType type();
+  void explain(QueryPlan &plan);
 
 private:
   CreateICmp comparator;
@@ -71,12 +77,20 @@ public:
                  std::shared_ptr<AstNode> &left,
                  std::shared_ptr<AstNode> &right,
                  ParseState &state);
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
+  llvm::Value *generateHeader(GenerateState &state,
+                              llvm::Value *header,
+                              llvm::Value *error_fn,
+                              llvm::Value *error_ctx);
+  bool equalityOperands(bool &equal,
+                        std::shared_ptr<AstNode> &left,
+                        std::shared_ptr<AstNode> &right);
   ExprType type();
+  void explain(QueryPlan &plan);
 
 private:
   CreateICmp comparator;
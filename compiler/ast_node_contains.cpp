@@ -27,11 +27,11 @@ BitwiseContainsNode::BitwiseContainsNode(std::shared_ptr<AstNode> &haystack_,
   type_check(needle, INT);
 }
 
-llvm::Value *BitwiseContainsNode::generate(GenerateState &state,
-                                           llvm::Value *read,
-                                           llvm::Value *header,
-                                           llvm::Value *error_fn,
-                                           llvm::Value *error_ctx) {
+llvm::Value *BitwiseContainsNode::generateValue(GenerateState &state,
+                                                llvm::Value *read,
+                                                llvm::Value *header,
+                                                llvm::Value *error_fn,
+                                                llvm::Value *error_ctx) {
   haystack->writeDebug(state);
   auto haystack_value =
       haystack->generate(state, read, header, error_fn, error_ctx);
@@ -43,5 +43,13 @@ llvm::Value *BitwiseContainsNode::generate(GenerateState &state,
                              needle_value);
 }
 
+bool BitwiseContainsNode::coreOnly() {
+  return haystack->coreOnly() && needle->coreOnly();
+}
+
 ExprType BitwiseContainsNode::type() { return BOOL; }
+
+void BitwiseContainsNode::explain(QueryPlan &plan) {
+  plan.add(this, "contains bits", { haystack, needle }, 1);
+}
 } // namespace bamql
@@ -23,12 +23,14 @@ public:
   BitwiseContainsNode(std::shared_ptr<AstNode> &haystack,
                       std::shared_ptr<AstNode> &needle,
                       ParseState &state);
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
+  bool coreOnly();
   ExprType type();
+  void explain(QueryPlan &plan);
 
 private:
   std::shared_ptr<AstNode> haystack;
@@ -16,12 +16,41 @@
 
 #include "ast_node_function.hpp"
 #include "bamql-compiler.hpp"
+#include "compiler.hpp"
 #include <cassert>
 #include <iostream>
 #include <limits>
 #include <llvm/ADT/DenseMap.h>
 
 namespace bamql {
+/**
+ * The parts of a read each runtime function reads and the estimated cost of
+ * calling it, for query plans.
+ */
+struct FunctionCost {
+  std::vector<std::string> fields;
+  double cost;
+};
+static const std::map<std::string, FunctionCost> function_costs{
+  { "bamql_aux_fp", { { "auxiliary data" }, 8 } },
+  { "bamql_aux_int", { { "auxiliary data" }, 8 } },
+  { "bamql_aux_str", { { "auxiliary data" }, 8 } },
+  { "bamql_check_mapping_quality", { { "fixed-size fields" }, 1 } },
+  { "bamql_check_nt", { { "CIGAR", "sequence" }, 8 } },
+  { "bamql_check_position", { { "fixed-size fields", "CIGAR" }, 4 } },
+  { "bamql_check_split_pair", { { "fixed-size fields" }, 1 } },
+  { "bamql_chr", { { "fixed-size fields" }, 1 } },
+  { "bamql_flags", { { "fixed-size fields" }, 1 } },
+  { "bamql_header", { { "read name" }, 1 } },
+  { "bamql_insert_reversed", { { "fixed-size fields" }, 1 } },
+  { "bamql_insert_size", { { "fixed-size fields" }, 1 } },
+  { "bamql_mate_position_begin", { { "fixed-size fields" }, 1 } },
+  { "bamql_position_begin", { { "fixed-size fields" }, 1 } },
+  { "bamql_position_end", { { "fixed-size fields", "CIGAR" }, 4 } },
+  { "bamql_randomly", { { "read name" }, 4 } },
+  { "bamql_randomly_by_name", { { "read name" }, 4 } },
+};
+
 UserArg::UserArg(ExprType type_) : type(type_) {}
 void UserArg::nextArg(ParseState &state,
                       size_t &pos,
@@ -70,12 +99,13 @@ FunctionNode::FunctionNode(
     ParseState &state)
     : DebuggableNode(state), arguments(std::move(arguments_)),
       rawArguments(rawArguments_), name(name_) {}
-llvm::Value *FunctionNode::generate(GenerateState &state,
-                                    llvm::Value *read,
-                                    llvm::Value *header,
-                                    llvm::Value *error_fn,
-                                    llvm::Value *error_ctx) {
-  auto function = state.module()->getFunction(name);
+llvm::Value *FunctionNode::generateValue(GenerateState &state,
+                                         llvm::Value *read,
+                                         llvm::Value *header,
+                                         llvm::Value *error_fn,
+                                         llvm::Value *error_ctx) {
+  auto function =
+      state.module()->getFunction(state.raw_record ? name + "_raw" : name);
   std::vector<llvm::Value *> arg_values;
   for (auto raw_arg : rawArguments) {
     switch (raw_arg) {
@@ -98,6 +128,53 @@ llvm::Value *FunctionNode::generate(GenerateState &state,
   }
   return generateCall(state, function, arg_values, error_fn, error_ctx);
 }
+bool FunctionNode::structuralKey(std::string &key) {
+  key = name + "(";
+  for (auto &arg : arguments) {
+    std::string arg_key;
+    if (!arg->structuralKey(arg_key)) {
+      return false;
+    }
+    key += arg_key + ",";
+  }
+  key += ")";
+  return true;
+}
+bool FunctionNode::coreOnly() {
+  if (!isCoreAccessor(name)) {
+    return false;
+  }
+  for (auto raw_arg : rawArguments) {
+    if (raw_arg == ERROR) {
+      return false;
+    }
+  }
+  for (auto &arg : arguments) {
+    if (!arg->coreOnly()) {
+      return false;
+    }
+  }
+  return true;
+}
+bool FunctionNode::readGroup() {
+  int group1;
+  int group2;
+  return name == "bamql_aux_str" && arguments.size() == 2 &&
+         arguments[0]->constantInt(group1) && group1 == 'R' &&
+         arguments[1]->constantInt(group2) && group2 == 'G';
+}
+void FunctionNode::explain(QueryPlan &plan) {
+  double cost = 4;
+  auto known = function_costs.find(name);
+  if (known != function_costs.end()) {
+    for (auto &field : known->second.fields) {
+      plan.decode(field);
+    }
+    cost = known->second.cost;
+  }
+  auto description = name.compare(0, 6, "bamql_") == 0 ? name.substr(6) : name;
+  plan.add(this, description, arguments, cost);
+}
 BoolFunctionNode::BoolFunctionNode(
     const std::string &name_,
     const std::vector<std::shared_ptr<AstNode>> &&arguments_,
@@ -113,6 +190,10 @@ llvm::Value *BoolFunctionNode::generateCall(GenerateState &state,
   call->addRetAttr(llvm::Attribute::ZExt);
   return call;
 }
+bool BoolFunctionNode::structuralKey(std::string &key) {
+  // Some of these, like `random`, give a different answer on every call.
+  return false;
+}
 ExprType BoolFunctionNode::type() { return BOOL; }
 
 ConstIntFunctionNode::ConstIntFunctionNode(
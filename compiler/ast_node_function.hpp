@@ -89,11 +89,15 @@ public:
                                     std::vector<llvm::Value *> &args,
                                     llvm::Value *error_fun,
                                     llvm::Value *error_ctx) = 0;
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
+  bool structuralKey(std::string &key);
+  bool coreOnly();
+  bool readGroup();
+  void explain(QueryPlan &plan);
 
 private:
   const std::vector<std::shared_ptr<AstNode>> arguments;
@@ -112,6 +116,7 @@ public:
                             std::vector<llvm::Value *> &args,
                             llvm::Value *error_fun,
                             llvm::Value *error_ctx);
+  bool structuralKey(std::string &key);
   ExprType type();
 };
 class ConstIntFunctionNode final : public FunctionNode {
@@ -171,4 +171,7 @@ llvm::Value *ConditionalNode::generateIndex(GenerateState &state,
   return llvm::ConstantInt::getTrue(state.module()->getContext());
 }
 void ConditionalNode::writeDebug(GenerateState &) {}
+void ConditionalNode::explain(QueryPlan &plan) {
+  plan.add(this, "if", { condition, then_part, else_part });
+}
 } // namespace bamql
@@ -40,6 +40,7 @@ public:
   bool usesIndex();
   ExprType type();
   void writeDebug(GenerateState &state);
+  void explain(QueryPlan &plan);
 
 private:
   std::shared_ptr<AstNode> condition;
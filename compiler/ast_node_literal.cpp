@@ -34,4 +34,33 @@ llvm::Value *make_int(llvm::LLVMContext &context, int value) {
 llvm::Value *make_dbl(llvm::LLVMContext &context, double value) {
   return llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), value);
 }
+
+StrConst::StrConst(const std::string &value_) : value(value_) {}
+llvm::Value *StrConst::generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header,
+                                llvm::Value *error_fn,
+                                llvm::Value *error_ctx) {
+  return state.createString(value);
+}
+llvm::Value *StrConst::generateIndex(GenerateState &state,
+                                     llvm::Value *tid,
+                                     llvm::Value *header,
+                                     llvm::Value *error_fn,
+                                     llvm::Value *error_ctx) {
+  return state.createString(value);
+}
+bool StrConst::constantStr(std::string &out) {
+  out = value;
+  return true;
+}
+bool StrConst::structuralKey(std::string &key) {
+  key = std::to_string(value.length()) + "\"" + value;
+  return true;
+}
+ExprType StrConst::type() { return STR; }
+void StrConst::writeDebug(GenerateState &state) {}
+void StrConst::explain(QueryPlan &plan) {
+  plan.add(nullptr, "\"" + value + "\"");
+}
 } // namespace bamql
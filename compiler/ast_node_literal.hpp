@@ -16,6 +16,9 @@
 #pragma once
 
 #include "bamql-compiler.hpp"
+#include <cctype>
+#include <sstream>
+#include <type_traits>
 
 namespace bamql {
 
@@ -45,13 +48,64 @@ public:
                              llvm::Value *error_ctx) {
     return LF(state.module()->getContext(), value);
   }
+  bool constantInt(int &out) {
+    if (ET != INT) {
+      return false;
+    }
+    out = value;
+    return true;
+  }
+  bool structuralKey(std::string &key) {
+    if (ET == FP) {
+      return false;
+    }
+    key = std::to_string(value);
+    return true;
+  }
+  bool coreOnly() { return true; }
   ExprType type() { return ET; }
   void writeDebug(GenerateState &state) {}
+  void explain(QueryPlan &plan) {
+    std::ostringstream description;
+    // Nucleotides are stored as character bitmaps, so only printable
+    // characters are shown as characters.
+    if (std::is_same<T, char>::value && isprint((unsigned char)value)) {
+      description << "'" << value << "'";
+    } else if (ET == BOOL) {
+      description << (value ? "true" : "false");
+    } else {
+      description << +value;
+    }
+    plan.add(nullptr, description.str());
+  }
 
 private:
   T value;
 };
 
+class StrConst final : public AstNode {
+public:
+  StrConst(const std::string &value);
+  llvm::Value *generate(GenerateState &state,
+                        llvm::Value *read,
+                        llvm::Value *header,
+                        llvm::Value *error_fn,
+                        llvm::Value *error_ctx);
+  llvm::Value *generateIndex(GenerateState &state,
+                             llvm::Value *tid,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
+  bool constantStr(std::string &out);
+  bool structuralKey(std::string &key);
+  ExprType type();
+  void writeDebug(GenerateState &state);
+  void explain(QueryPlan &plan);
+
+private:
+  std::string value;
+};
+
 typedef LiteralNode<bool, decltype(&make_bool), &make_bool, BOOL> BoolConst;
 typedef LiteralNode<char, decltype(&make_char), &make_char, INT> CharConst;
 typedef LiteralNode<double, decltype(&make_dbl), &make_dbl, FP> DblConst;
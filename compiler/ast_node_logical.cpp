@@ -16,6 +16,10 @@
 
 #include "bamql-compiler.hpp"
 #include "compiler.hpp"
+#include "dfa.hpp"
+#include <algorithm>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
 
 namespace bamql {
 /**
@@ -59,7 +63,46 @@ public:
     }
     return false;
   }
+  bool coreOnly() {
+    for (auto term : terms) {
+      if (!term->coreOnly()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  /**
+   * For conjunction, any of the terms that can be checked is necessary, so
+   * the others are left out. For disjunction, every term must have a
+   * condition or nothing is known.
+   */
+  llvm::Value *generateCore(GenerateState &state,
+                            llvm::Value *read,
+                            llvm::Value *header,
+                            llvm::Value *error_fn,
+                            llvm::Value *error_ctx) {
+    return combineConditions(state, [&](std::shared_ptr<AstNode> &term) {
+      return term->generateCore(state, read, header, error_fn, error_ctx);
+    });
+  }
+  /**
+   * The header conditions are combined the same way as the core conditions.
+   */
+  llvm::Value *generateHeader(GenerateState &state,
+                              llvm::Value *header,
+                              llvm::Value *error_fn,
+                              llvm::Value *error_ctx) {
+    return combineConditions(state, [&](std::shared_ptr<AstNode> &term) {
+      return term->generateHeader(state, header, error_fn, error_ctx);
+    });
+  }
   ExprType type() { return BOOL; }
+  /**
+   * The terms are listed in the order they are checked.
+   */
+  void explain(QueryPlan &plan) {
+    plan.add(this, branchValue() ? "or" : "and", terms);
+  }
   /**
    * The value that causes short circuting.
    */
@@ -68,6 +111,138 @@ public:
   void writeDebug(GenerateState &state) {}
 
 private:
+  /**
+   * Combine a necessary condition from each term into one for this node.
+   */
+  llvm::Value *combineConditions(
+      GenerateState &state,
+      const std::function<llvm::Value *(std::shared_ptr<AstNode> &)>
+          &condition) {
+    llvm::Value *result = nullptr;
+    for (auto term : terms) {
+      auto value = condition(term);
+      if (value == nullptr) {
+        if (branchValue()) {
+          return nullptr;
+        }
+        continue;
+      }
+      if (result == nullptr) {
+        result = value;
+      } else if (branchValue()) {
+        result = state->CreateOr(result, value);
+      } else {
+        result = state->CreateAnd(result, value);
+      }
+    }
+    return result;
+  }
+  /**
+   * What was observed about a term while profiling.
+   */
+  struct TermProfile {
+    uint64_t runs = 0;
+    uint64_t short_circuits = 0;
+    uint64_t cycles = 0;
+  };
+  /**
+   * Collect the counters from a profiled version of this node and reorder the
+   * terms so that the ones most likely to short-circuit for the least effort
+   * go first.
+   */
+  void ingestProfile(const std::vector<std::shared_ptr<AstNode>> &order,
+                     const uint64_t *counters) {
+    for (size_t it = 0; it < order.size(); it++) {
+      auto &term_profile = profile[order[it].get()];
+      term_profile.runs += counters[3 * it];
+      term_profile.short_circuits += counters[3 * it + 1];
+      term_profile.cycles += counters[3 * it + 2];
+    }
+    auto score = [this](const std::shared_ptr<AstNode> &term) {
+      auto &term_profile = profile[term.get()];
+      if (term_profile.runs == 0) {
+        return -1.0;
+      }
+      double cost = std::max(term_profile.cycles, term_profile.runs);
+      return term_profile.short_circuits / cost;
+    };
+    std::stable_sort(
+        terms.begin(), terms.end(),
+        [&](const std::shared_ptr<AstNode> &a,
+            const std::shared_ptr<AstNode> &b) { return score(a) > score(b); });
+  }
+  /**
+   * Regular expressions applied to the same expression that are checked by a
+   * single automaton. The automaton is run when the first of them is reached
+   * and the others use its result.
+   */
+  struct RegexGroup {
+    std::shared_ptr<AstNode> operand;
+    std::shared_ptr<DFA> dfa;
+    llvm::Value *matches = nullptr;
+  };
+  typedef std::map<AstNode *, std::pair<std::shared_ptr<RegexGroup>, int>>
+      RegexGroups;
+  /**
+   * Find the terms that are regular expressions over the same expression and
+   * combine their patterns, recording the group and bit for each term.
+   */
+  RegexGroups groupRegexes() {
+    std::map<std::string, std::vector<size_t>> candidates;
+    for (size_t it = 0; it < terms.size(); it++) {
+      std::shared_ptr<AstNode> operand;
+      const RegularExpression *pattern;
+      std::string key;
+      if (terms[it]->regexOperands(operand, pattern) &&
+          operand->structuralKey(key)) {
+        candidates[key].push_back(it);
+      }
+    }
+    RegexGroups groups;
+    for (auto &candidate : candidates) {
+      auto &members = candidate.second;
+      for (size_t start = 0; start < members.size();
+           start += DFA::MAX_PATTERNS) {
+        auto end = std::min(members.size(), start + DFA::MAX_PATTERNS);
+        if (end - start < 2) {
+          break;
+        }
+        auto group = std::make_shared<RegexGroup>();
+        std::vector<const RegularExpression *> patterns;
+        for (auto it = start; it < end; it++) {
+          const RegularExpression *pattern;
+          terms[members[it]]->regexOperands(group->operand, pattern);
+          patterns.push_back(pattern);
+        }
+        group->dfa = RegularExpression::combine(patterns);
+        if (!group->dfa) {
+          continue;
+        }
+        for (auto it = start; it < end; it++) {
+          groups[terms[members[it]].get()] = std::make_pair(group, it - start);
+        }
+      }
+    }
+    return groups;
+  }
+  /**
+   * Create branch weights for a term based on a previous profile, if there is
+   * one.
+   */
+  llvm::MDNode *createBranchWeights(GenerateState &state, AstNode *term) {
+    auto found = profile.find(term);
+    if (found == profile.end() || found->second.runs == 0) {
+      return nullptr;
+    }
+    uint64_t taken = found->second.short_circuits;
+    uint64_t not_taken = found->second.runs - found->second.short_circuits;
+    while (taken > UINT32_MAX || not_taken > UINT32_MAX) {
+      taken >>= 1;
+      not_taken >>= 1;
+    }
+    return llvm::MDBuilder(state.module()->getContext())
+        .createBranchWeights(taken, not_taken);
+  }
   llvm::Value *generateGeneric(GenerateMember member,
                                GenerateState &state,
                                llvm::Value *param,
@@ -96,17 +271,77 @@ private:
         llvm::Type::getInt1Ty(state.module()->getContext()),
         this->branchValue());
 
-    for (auto term : terms) {
+    /* If profiling, count how often each term is run, how often it short
+     * circuits, and how long it takes. The handler holds on to the order the
+     * terms had when this code was generated since the counters are in that
+     * order. */
+    llvm::GlobalVariable *probe = nullptr;
+    llvm::Function *cycle_counter = nullptr;
+    if ((state.getGenerator().profiling() & PROFILE_TERMS) &&
+        member == &AstNode::generate) {
+      auto order = terms;
+      probe = state.getGenerator().createProbe(
+          3 * terms.size(), [this, order](const uint64_t *counters) {
+            this->ingestProfile(order, counters);
+          });
+      cycle_counter = llvm::Intrinsic::getDeclaration(
+          state.module(), llvm::Intrinsic::readcyclecounter);
+    }
+
+    /* Regular expressions over the same expression are checked together,
+     * unless each one needs its own profile. */
+    RegexGroups regex_groups;
+    if (member == &AstNode::generate &&
+        (state.getGenerator().profiling() & PROFILE_NODES) == 0) {
+      regex_groups = groupRegexes();
+    }
+
+    for (size_t it = 0; it < terms.size(); it++) {
+      auto &term = terms[it];
       auto next_block = llvm::BasicBlock::Create(state.module()->getContext(),
                                                  "next", function);
 
+      llvm::Value *start = nullptr;
+      if (probe != nullptr) {
+        start = state->CreateCall(cycle_counter);
+      }
       /* Generate the term expression in the current block. */
       term->writeDebug(state);
-      auto value = ((*term).*member)(state, param, header, error_fn, error_ctx);
+      llvm::Value *value;
+      auto grouped = regex_groups.find(term.get());
+      if (grouped == regex_groups.end()) {
+        value = ((*term).*member)(state, param, header, error_fn, error_ctx);
+      } else {
+        auto &group = grouped->second.first;
+        auto base_uint32 =
+            llvm::Type::getInt32Ty(state.module()->getContext());
+        if (group->matches == nullptr) {
+          group->operand->writeDebug(state);
+          auto operand_value = group->operand->generate(state, param, header,
+                                                        error_fn, error_ctx);
+          group->matches = group->dfa->matchAll(state, operand_value);
+        }
+        value = state->CreateICmpNE(
+            state->CreateAnd(group->matches,
+                             llvm::ConstantInt::get(
+                                 base_uint32, 1u << grouped->second.second)),
+            llvm::ConstantInt::get(base_uint32, 0));
+      }
       auto short_circuit_value = state->CreateICmpEQ(value, reference);
+      if (probe != nullptr) {
+        auto duration =
+            state->CreateSub(state->CreateCall(cycle_counter), start);
+        state.addToProbe(probe, 3 * it, llvm::ConstantInt::getTrue(
+                                            state.module()->getContext()));
+        state.addToProbe(probe, 3 * it + 1, short_circuit_value);
+        state.addToProbe(probe, 3 * it + 2, duration);
+      }
       /* If short circuiting, jump to the final block, otherwise, do the
        * next expression. */
-      state->CreateCondBr(short_circuit_value, merge_block, next_block);
+      state->CreateCondBr(short_circuit_value, merge_block, next_block,
+                          member == &AstNode::generate
+                              ? createBranchWeights(state, term.get())
+                              : nullptr);
       phi->addIncoming(value, state->GetInsertBlock());
       state->SetInsertPoint(next_block);
     }
@@ -120,6 +355,7 @@ private:
     state->SetInsertPoint(merge_block);
     return phi;
   }
+  std::map<AstNode *, TermProfile> profile;
   std::vector<std::shared_ptr<AstNode>> terms;
 };
 /**
@@ -178,7 +414,23 @@ public:
     }
   }
   bool usesIndex() { return left->usesIndex() || right->usesIndex(); }
+  bool coreOnly() { return left->coreOnly() && right->coreOnly(); }
+  llvm::Value *generateCore(GenerateState &state,
+                            llvm::Value *read,
+                            llvm::Value *header,
+                            llvm::Value *error_fn,
+                            llvm::Value *error_ctx) {
+    if (!coreOnly()) {
+      return nullptr;
+    }
+    auto left_value =
+        left->generateCore(state, read, header, error_fn, error_ctx);
+    auto right_value =
+        right->generateCore(state, read, header, error_fn, error_ctx);
+    return state->CreateICmpNE(left_value, right_value);
+  }
   ExprType type() { return BOOL; }
+  void explain(QueryPlan &plan) { plan.add(this, "xor", { left, right }); }
 
   void writeDebug(GenerateState &state) {}
 
@@ -215,7 +467,20 @@ public:
     return state->CreateNot(result);
   }
   bool usesIndex() { return expr->usesIndex(); }
+  bool coreOnly() { return expr->coreOnly(); }
+  llvm::Value *generateCore(GenerateState &state,
+                            llvm::Value *read,
+                            llvm::Value *header,
+                            llvm::Value *error_fn,
+                            llvm::Value *error_ctx) {
+    if (!coreOnly()) {
+      return nullptr;
+    }
+    return state->CreateNot(
+        expr->generateCore(state, read, header, error_fn, error_ctx));
+  }
   ExprType type() { return BOOL; }
+  void explain(QueryPlan &plan) { plan.add(this, "not", { expr }); }
 
   void writeDebug(GenerateState &state) {}
 
@@ -16,6 +16,28 @@
 
 #include "ast_node_loop.hpp"
 #include "bamql-compiler.hpp"
+#include <algorithm>
+
+/**
+ * The string hash used by `bamql_str_hash` in the runtime library.
+ */
+static uint32_t str_hash(const std::string &str, uint32_t seed) {
+  uint32_t hash = 2166136261U ^ seed;
+  for (auto c : str) {
+    hash ^= (unsigned char)c;
+    hash *= 16777619U;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+/**
+ * The number of displacements to try for each bucket before giving up on
+ * building a perfect hash.
+ */
+#define MAX_DISPLACEMENT 65536
 
 namespace bamql {
 class LoopVar final : public AstNode {
@@ -37,18 +59,21 @@ public:
   }
   ExprType type() { return owner->values.front()->type(); }
   void writeDebug(GenerateState &state) {}
+  void explain(QueryPlan &plan) { plan.add(this, owner->var_name); }
 
 private:
   LoopNode *owner;
 };
 
 LoopNode::LoopNode(ParseState &state,
-                   const std::string &var_name,
+                   const std::string &var_name_,
                    bool all_,
                    std::vector<std::shared_ptr<AstNode>> &&values_)
     : all(all_), values(std::move(values_)),
-      var(std::make_shared<LoopVar>(this)) {
-  PredicateMap loopmap{ { var_name, [&](ParseState &state) {
+      var(std::make_shared<LoopVar>(this)), var_name(var_name_) {
+  size_t references = 0;
+  PredicateMap loopmap{ { var_name_, [&](ParseState &state) {
+                           references++;
                            return std::static_pointer_cast<AstNode>(var);
                          } } };
   state.push(loopmap);
@@ -57,6 +82,190 @@ LoopNode::LoopNode(ParseState &state,
     throw ParseError(state.where(), "Loop body expression must be Boolean.");
   }
   state.pop(loopmap);
+
+  /* `any x = 1, 2, 3 in x == expr` and `all x = 1, 2, 3 in x != expr` only
+   * check if expr is one of the values, so, if they are constants, expr can be
+   * evaluated once and looked up rather than compared to each value. */
+  bool equal;
+  std::shared_ptr<AstNode> left;
+  std::shared_ptr<AstNode> right;
+  if (references == 1 && body->equalityOperands(equal, left, right) &&
+      equal != all) {
+    auto candidate = left.get() == var.get()
+                         ? right
+                         : right.get() == var.get() ? left : nullptr;
+    if (candidate && buildMembership()) {
+      member = candidate;
+    }
+  }
+}
+
+bool LoopNode::buildMembership() {
+  std::set<std::string> str_values;
+  for (auto &value : values) {
+    int int_value;
+    std::string str_value;
+    if (value->constantInt(int_value)) {
+      int_values.insert(int_value);
+    } else if (value->constantStr(str_value)) {
+      str_values.insert(str_value);
+    } else {
+      return false;
+    }
+  }
+  if (str_values.empty()) {
+    return true;
+  }
+
+  /* Build a perfect hash using hash and displace: each string is put in a
+   * bucket by its hash and then, starting with the fullest bucket, a
+   * displacement is found that puts all the strings in the bucket into free
+   * slots of the table. */
+  uint32_t bucket_count = 1;
+  while (bucket_count * 2 < str_values.size()) {
+    bucket_count <<= 1;
+  }
+  str_table_size = 1;
+  while (str_table_size < 2 * str_values.size()) {
+    str_table_size <<= 1;
+  }
+  std::vector<std::vector<const std::string *>> buckets(bucket_count);
+  for (auto &str : str_values) {
+    buckets[str_hash(str, 0) & (bucket_count - 1)].push_back(&str);
+  }
+  std::vector<uint32_t> order;
+  for (uint32_t it = 0; it < bucket_count; it++) {
+    order.push_back(it);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+  displacements.assign(bucket_count, 0);
+  for (auto bucket : order) {
+    if (buckets[bucket].empty()) {
+      break;
+    }
+    uint32_t displacement;
+    std::vector<uint32_t> slots;
+    for (displacement = 1; displacement < MAX_DISPLACEMENT; displacement++) {
+      slots.clear();
+      for (auto str : buckets[bucket]) {
+        auto slot = str_hash(*str, displacement) & (str_table_size - 1);
+        if (str_slots.count(slot) ||
+            std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if (slots.size() == buckets[bucket].size()) {
+        break;
+      }
+    }
+    if (displacement == MAX_DISPLACEMENT) {
+      str_slots.clear();
+      return false;
+    }
+    displacements[bucket] = displacement;
+    for (size_t it = 0; it < slots.size(); it++) {
+      str_slots[slots[it]] = *buckets[bucket][it];
+    }
+  }
+  return true;
+}
+
+llvm::Value *LoopNode::generateIntMembership(GenerateState &state,
+                                             llvm::Value *value) {
+  /* LLVM will lower this to bit tests, a jump table, or a binary search,
+   * depending on how the values are distributed. */
+  auto function = state->GetInsertBlock()->getParent();
+  auto found_block =
+      llvm::BasicBlock::Create(state.module()->getContext(), "found", function);
+  auto merge_block =
+      llvm::BasicBlock::Create(state.module()->getContext(), "merge", function);
+  auto switch_block = state->GetInsertBlock();
+  auto switch_inst =
+      state->CreateSwitch(value, merge_block, int_values.size());
+  for (auto int_value : int_values) {
+    switch_inst->addCase(
+        llvm::ConstantInt::get(llvm::cast<llvm::IntegerType>(value->getType()),
+                               int_value, true),
+        found_block);
+  }
+  state->SetInsertPoint(found_block);
+  state->CreateBr(merge_block);
+  state->SetInsertPoint(merge_block);
+  auto result =
+      state->CreatePHI(llvm::Type::getInt1Ty(state.module()->getContext()), 2);
+  result->addIncoming(
+      llvm::ConstantInt::getTrue(state.module()->getContext()), found_block);
+  result->addIncoming(
+      llvm::ConstantInt::getFalse(state.module()->getContext()), switch_block);
+  return result;
+}
+
+llvm::Value *LoopNode::generateStrMembership(GenerateState &state,
+                                             llvm::Value *value) {
+  auto base_uint32 = llvm::Type::getInt32Ty(state.module()->getContext());
+  auto base_str = llvm::PointerType::get(
+      llvm::Type::getInt8Ty(state.module()->getContext()), 0);
+
+  std::vector<llvm::Constant *> displacement_values;
+  for (auto displacement : displacements) {
+    displacement_values.push_back(
+        llvm::ConstantInt::get(base_uint32, displacement));
+  }
+  auto displacement_ty =
+      llvm::ArrayType::get(base_uint32, displacement_values.size());
+  auto displacement_table = new llvm::GlobalVariable(
+      *state.module(), displacement_ty, true,
+      llvm::GlobalVariable::PrivateLinkage,
+      llvm::ConstantArray::get(displacement_ty, displacement_values),
+      ".displacements");
+  std::vector<llvm::Constant *> slot_values;
+  for (uint32_t it = 0; it < str_table_size; it++) {
+    auto slot = str_slots.find(it);
+    slot_values.push_back(slot == str_slots.end()
+                              ? llvm::ConstantPointerNull::get(base_str)
+                              : state.createString(slot->second));
+  }
+  auto slot_ty = llvm::ArrayType::get(base_str, slot_values.size());
+  auto slot_table = new llvm::GlobalVariable(
+      *state.module(), slot_ty, true, llvm::GlobalVariable::PrivateLinkage,
+      llvm::ConstantArray::get(slot_ty, slot_values), ".slots");
+
+  auto hash_func = state.module()->getFunction("bamql_str_hash");
+  llvm::Value *bucket_args[] = { value,
+                                 llvm::ConstantInt::get(base_uint32, 0) };
+  auto bucket = state->CreateAnd(
+      state->CreateCall(hash_func, bucket_args),
+      llvm::ConstantInt::get(base_uint32, displacements.size() - 1));
+  llvm::Value *displacement_index[] = {
+    llvm::ConstantInt::get(base_uint32, 0), bucket
+  };
+  llvm::Value *slot_args[] = {
+    value, state->CreateLoad(base_uint32,
+                             state->CreateInBoundsGEP(displacement_ty,
+                                                      displacement_table,
+                                                      displacement_index))
+  };
+  auto slot = state->CreateAnd(
+      state->CreateCall(hash_func, slot_args),
+      llvm::ConstantInt::get(base_uint32, str_table_size - 1));
+  llvm::Value *slot_index[] = { llvm::ConstantInt::get(base_uint32, 0), slot };
+  llvm::Value *compare_args[] = {
+    state->CreateLoad(base_str,
+                      state->CreateInBoundsGEP(slot_ty, slot_table,
+                                               slot_index)),
+    value
+  };
+  /* Empty slots are null, which never compares equal to a non-null string,
+   * but a null input (e.g., a missing auxiliary field) would match one. */
+  return state->CreateAnd(
+      state->CreateIsNotNull(value),
+      state->CreateICmpEQ(
+          state->CreateCall(state.module()->getFunction("bamql_strcmp"),
+                            compare_args),
+          llvm::ConstantInt::get(base_uint32, 0)));
 }
 
 llvm::Value *LoopNode::generate(GenerateState &state,
@@ -64,6 +273,14 @@ llvm::Value *LoopNode::generate(GenerateState &state,
                                 llvm::Value *header,
                                 llvm::Value *error_fn,
                                 llvm::Value *error_ctx) {
+  if (member) {
+    member->writeDebug(state);
+    auto value = member->generate(state, read, header, error_fn, error_ctx);
+    auto found = values.front()->type() == STR
+                     ? generateStrMembership(state, value)
+                     : generateIntMembership(state, value);
+    return all ? state->CreateNot(found) : found;
+  }
 
   auto type = llvm::Type::getInt32Ty(state.module()->getContext());
   auto index = state->CreateAlloca(type);
@@ -125,4 +342,27 @@ llvm::Value *LoopNode::generateIndex(GenerateState &state,
 bool LoopNode::usesIndex() { return false; }
 ExprType LoopNode::type() { return BOOL; }
 void LoopNode::writeDebug(GenerateState &state) {}
+/**
+ * A loop that only checks membership is shown as the lookup it generates.
+ * Otherwise, the body may be evaluated once for each value.
+ */
+void LoopNode::explain(QueryPlan &plan) {
+  auto count = std::to_string(values.size());
+  if (member) {
+    bool str = values.front()->type() == STR;
+    plan.add(this,
+             std::string(all ? "not one of " : "one of ") + count +
+                 (str ? " strings (perfect hash)" : " integers (switch)"),
+             { member }, str ? 4 : 1);
+    return;
+  }
+  plan.add(this, std::string(all ? "all " : "any ") + var_name + " in " +
+                     count + " values");
+  plan.nest([&]() {
+    for (auto &value : values) {
+      value->explain(plan);
+    }
+  });
+  plan.nest([&]() { body->explain(plan); }, values.size());
+}
 } // namespace bamql
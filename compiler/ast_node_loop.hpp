@@ -16,6 +16,8 @@
 #pragma once
 
 #include "bamql-compiler.hpp"
+#include <map>
+#include <set>
 
 namespace bamql {
 
@@ -44,11 +46,29 @@ public:
   bool usesIndex();
   ExprType type();
   void writeDebug(GenerateState &state);
+  void explain(QueryPlan &plan);
 
 private:
+  bool buildMembership();
+  llvm::Value *generateIntMembership(GenerateState &state, llvm::Value *value);
+  llvm::Value *generateStrMembership(GenerateState &state, llvm::Value *value);
   bool all;
   std::shared_ptr<AstNode> body;
   std::vector<std::shared_ptr<AstNode>> values;
   std::shared_ptr<LoopVar> var;
+  std::string var_name;
+  /**
+   * If the loop only checks if an expression is one of the values, the
+   * expression.
+   */
+  std::shared_ptr<AstNode> member;
+  std::set<int> int_values;
+  /**
+   * A perfect hash table of string values: the slot for a string is chosen
+   * by hashing it with the displacement for its bucket.
+   */
+  std::vector<uint32_t> displacements;
+  std::map<uint32_t, std::string> str_slots;
+  uint32_t str_table_size;
 };
 } // namespace bamql
@@ -15,6 +15,7 @@
  */
 
 #include "bamql-compiler.hpp"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <sstream>
@@ -32,17 +33,18 @@ namespace bamql {
 class BoundMatchNode final : public DebuggableNode {
 public:
   BoundMatchNode(ParseState &state,
+                 const std::string &name_,
                  int number_,
                  ExprType type_,
                  int decode_,
                  const std::string &error_)
       : DebuggableNode(state), decode(decode_), error(error_), exprType(type_),
-        number(number_) {}
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx) {
+        name(name_), number(number_) {}
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx) {
     return state->CreateLoad(
         getReifiedType(exprType, state.module()->getContext()),
         state.definitions[this]);
@@ -65,22 +67,14 @@ public:
     arg_values.push_back(box);
   }
 
-  void cleanup(GenerateState &state) {
-    std::vector<llvm::Value *> arg_values;
-    if (exprType == STR) {
-      auto function = state.module()->getFunction("pcre_free_substring");
-      arg_values.push_back(state->CreateLoad(
-          getReifiedType(exprType, state.module()->getContext()),
-          state.definitions[this]));
-      state->CreateCall(function, arg_values);
-    }
-  }
   ExprType type() { return exprType; }
+  void explain(QueryPlan &plan) { plan.add(this, name); }
 
 private:
   int decode;
   std::string error;
   ExprType exprType;
+  std::string name;
   int number;
 };
 
@@ -120,8 +114,8 @@ public:
         decode = 3;
         type = INT;
       }
-      auto use = std::make_shared<BoundMatchNode>(state, name.second, type,
-                                                  decode, errorMessage);
+      auto use = std::make_shared<BoundMatchNode>(
+          state, name.first, name.second, type, decode, errorMessage);
       definitions.push_back(use);
       childPredicates[name.first] = [=](ParseState &state) {
         return std::static_pointer_cast<AstNode>(use);
@@ -139,11 +133,11 @@ public:
       throw ParseError(state.where(), "Expression must be Boolean.");
     }
   }
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx) {
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx) {
     auto input_value =
         input->generate(state, read, header, error_fn, error_ctx);
     auto function = state.module()->getFunction("bamql_re_bind");
@@ -161,6 +155,16 @@ public:
     for (auto def : definitions) {
       def->prepare(state, arg_values);
     }
+    /* String captures are copied into the runtime's scratch space, which is
+     * given back once the body is done with them. */
+    llvm::Value *mark = nullptr;
+    if (std::any_of(definitions.begin(), definitions.end(),
+                    [](const std::shared_ptr<BoundMatchNode> &def) {
+                      return def->type() == STR;
+                    })) {
+      mark = state->CreateCall(
+          state.module()->getFunction("bamql_scratch_mark"));
+    }
     auto matched = state->CreateCall(function, arg_values);
 
     auto original_block = state->GetInsertBlock();
@@ -175,16 +179,19 @@ public:
     state->SetInsertPoint(match_block);
     body->writeDebug(state);
     auto body_result = body->generate(state, read, header, error_fn, error_ctx);
-    for (auto &def : definitions) {
-      def->cleanup(state);
-    }
+    auto body_block = state->GetInsertBlock();
     state->CreateBr(merge_block);
 
     state->SetInsertPoint(merge_block);
     auto phi = state->CreatePHI(
         llvm::Type::getInt1Ty(state.module()->getContext()), 2);
     phi->addIncoming(matched, original_block);
-    phi->addIncoming(body_result, match_block);
+    phi->addIncoming(body_result, body_block);
+    if (mark != nullptr) {
+      llvm::Value *release_args[] = { mark };
+      state->CreateCall(state.module()->getFunction("bamql_scratch_release"),
+                        release_args);
+    }
     return phi;
   }
   llvm::Value *generateIndex(GenerateState &state,
@@ -195,6 +202,16 @@ public:
     return llvm::ConstantInt::getTrue(state.module()->getContext());
   }
   ExprType type() { return BOOL; }
+  /**
+   * The captures are always extracted by PCRE.
+   */
+  void explain(QueryPlan &plan) {
+    plan.add(this, "bind " + regex.describe() + " (PCRE)", 32);
+    plan.nest([&]() {
+      input->explain(plan);
+      body->explain(plan);
+    });
+  }
 
 private:
   std::vector<std::shared_ptr<BoundMatchNode>> definitions;
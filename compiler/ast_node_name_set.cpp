@@ -0,0 +1,71 @@
+/*
+ * Copyright 2017 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+
+#include "ast_node_name_set.hpp"
+#include "bamql-compiler.hpp"
+#include "compiler.hpp"
+#include <fstream>
+
+namespace bamql {
+NameSetNode::NameSetNode(std::shared_ptr<AstNode> &operand_,
+                         const std::string &file_name_,
+                         ParseState &state)
+    : DebuggableNode(state), operand(operand_), file_name(file_name_) {
+  type_check(operand, STR);
+}
+llvm::Value *NameSetNode::generateValue(GenerateState &state,
+                                        llvm::Value *read,
+                                        llvm::Value *header,
+                                        llvm::Value *error_fn,
+                                        llvm::Value *error_ctx) {
+  operand->writeDebug(state);
+  auto operand_value =
+      operand->generate(state, read, header, error_fn, error_ctx);
+  this->writeDebug(state);
+
+  /* The set is loaded once, when the module is constructed, and kept in a
+   * global, the same way as a regular expression. */
+  auto base_str = llvm::PointerType::get(
+      llvm::Type::getInt8Ty(state.module()->getContext()), 0);
+  auto var = state.getGenerator().createShared(
+      "name_set " + file_name,
+      [&](llvm::IRBuilder<> &constructor) -> llvm::Value * {
+        llvm::Value *load_args[] = {
+          state.getGenerator().createString(file_name)
+        };
+        return constructor.CreateCall(
+            state.module()->getFunction("bamql_name_set_load"), load_args);
+      },
+      state.module()->getFunction("bamql_name_set_free"));
+
+  llvm::Value *args[] = { state->CreateLoad(base_str, var), operand_value };
+  return state->CreateCall(
+      state.module()->getFunction("bamql_name_set_contains"), args);
+}
+llvm::Value *NameSetNode::generateIndex(GenerateState &state,
+                                        llvm::Value *param,
+                                        llvm::Value *header,
+                                        llvm::Value *error_fn,
+                                        llvm::Value *error_ctx) {
+  return llvm::ConstantInt::getTrue(state.module()->getContext());
+}
+bool NameSetNode::usesIndex() { return false; }
+ExprType NameSetNode::type() { return BOOL; }
+void NameSetNode::explain(QueryPlan &plan) {
+  plan.add(this, "in_file(\"" + file_name + "\") (hash set)", { operand }, 4);
+}
+} // namespace bamql
@@ -31,11 +31,11 @@ public:
     type_check_not(left, BOOL);
   }
 
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx) {
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx) {
     left->writeDebug(state);
     auto left_value = left->generate(state, read, header, error_fn, error_ctx);
     right->writeDebug(state);
@@ -68,6 +68,10 @@ public:
                                direction ? right_value : left_value);
   }
   ExprType type() { return left->type(); }
+  void explain(QueryPlan &plan) {
+    plan.add(this, direction ? "min" : "max", { left, right },
+             left->type() == STR ? 4 : 1);
+  }
   bool direction;
   std::shared_ptr<AstNode> left;
   std::shared_ptr<AstNode> right;
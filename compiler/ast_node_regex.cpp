@@ -18,6 +18,16 @@
 #include "bamql-compiler.hpp"
 #include "compiler.hpp"
 
+/**
+ * Auxiliary fields, such as the read group, usually take only a few distinct
+ * values across a file, so the results of matching them are worth keeping.
+ */
+static bool fewValues(std::shared_ptr<bamql::AstNode> &operand) {
+  std::string key;
+  return operand->structuralKey(key) &&
+         key.compare(0, 14, "bamql_aux_str(") == 0;
+}
+
 namespace bamql {
 RegexNode::RegexNode(std::shared_ptr<AstNode> &operand_,
                      RegularExpression &&pattern_,
@@ -25,18 +35,16 @@ RegexNode::RegexNode(std::shared_ptr<AstNode> &operand_,
     : DebuggableNode(state), operand(operand_), pattern(std::move(pattern_)) {
   type_check(operand, STR);
 }
-llvm::Value *RegexNode::generate(GenerateState &state,
-                                 llvm::Value *read,
-                                 llvm::Value *header,
-                                 llvm::Value *error_fn,
-                                 llvm::Value *error_ctx) {
+llvm::Value *RegexNode::generateValue(GenerateState &state,
+                                      llvm::Value *read,
+                                      llvm::Value *header,
+                                      llvm::Value *error_fn,
+                                      llvm::Value *error_ctx) {
   operand->writeDebug(state);
   auto operand_value =
       operand->generate(state, read, header, error_fn, error_ctx);
   this->writeDebug(state);
-  auto function = state.module()->getFunction("bamql_re_match");
-  llvm::Value *args[] = { pattern(state), operand_value };
-  return state->CreateCall(function, args);
+  return pattern.match(state, operand_value, fewValues(operand));
 }
 llvm::Value *RegexNode::generateIndex(GenerateState &state,
                                       llvm::Value *param,
@@ -46,5 +54,27 @@ llvm::Value *RegexNode::generateIndex(GenerateState &state,
   return llvm::ConstantInt::getTrue(state.module()->getContext());
 }
 bool RegexNode::usesIndex() { return false; }
+llvm::Value *RegexNode::generateHeader(GenerateState &state,
+                                       llvm::Value *header,
+                                       llvm::Value *error_fn,
+                                       llvm::Value *error_ctx) {
+  if (!operand->readGroup()) {
+    return nullptr;
+  }
+  auto function = state.module()->getFunction("bamql_header_read_group");
+  llvm::Value *args[] = { header, pattern(state) };
+  return state->CreateCall(function, args);
+}
+bool RegexNode::regexOperands(std::shared_ptr<AstNode> &operand_,
+                              const RegularExpression *&pattern_) {
+  operand_ = operand;
+  pattern_ = &pattern;
+  return true;
+}
 ExprType RegexNode::type() { return BOOL; }
+void RegexNode::explain(QueryPlan &plan) {
+  plan.add(this,
+           "matches " + pattern.describe() + " (" + pattern.method() + ")",
+           { operand }, pattern.cost());
+}
 } // namespace bamql
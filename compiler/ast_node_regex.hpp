@@ -30,18 +30,25 @@ public:
                                llvm::Value *header,
                                llvm::Value *error_fn,
                                llvm::Value *error_ctx);
-  llvm::Value *generate(GenerateState &state,
-                        llvm::Value *read,
-                        llvm::Value *header,
-                        llvm::Value *error_fn,
-                        llvm::Value *error_ctx);
+  llvm::Value *generateValue(GenerateState &state,
+                             llvm::Value *read,
+                             llvm::Value *header,
+                             llvm::Value *error_fn,
+                             llvm::Value *error_ctx);
   llvm::Value *generateIndex(GenerateState &state,
                              llvm::Value *read,
                              llvm::Value *header,
                              llvm::Value *error_fn,
                              llvm::Value *error_ctx);
   bool usesIndex();
+  llvm::Value *generateHeader(GenerateState &state,
+                              llvm::Value *header,
+                              llvm::Value *error_fn,
+                              llvm::Value *error_ctx);
+  bool regexOperands(std::shared_ptr<AstNode> &operand,
+                     const RegularExpression *&pattern);
   ExprType type();
+  void explain(QueryPlan &plan);
 
 private:
   std::shared_ptr<AstNode> operand;
@@ -15,6 +15,7 @@
  */
 
 #pragma once
+#include <chrono>
 #include <exception>
 #include <functional>
 #include <llvm/Config/llvm-config.h>
@@ -23,9 +24,11 @@
 #include <llvm/IR/Module.h>
 #include <map>
 #include <memory>
+#include <ostream>
 #include <set>
+#include <vector>
 
-#define BAMQL_COMPILER_API_VERSION 1
+#define BAMQL_COMPILER_API_VERSION 6
 namespace bamql {
 
 /**
@@ -77,7 +80,161 @@ class GenerateState;
  */
 typedef std::function<std::shared_ptr<AstNode>(ParseState &state)> Predicate;
 
-typedef std::function<llvm::Value *(GenerateState &state)> RegularExpression;
+class DFA;
+/**
+ * A regular expression from a query.
+ *
+ * Patterns that are only a literal string, possibly anchored at the start or
+ * end, are matched with string functions; other patterns that need no
+ * backtracking are matched by an automaton in the generated code; anything
+ * else uses PCRE.
+ */
+class RegularExpression {
+public:
+  RegularExpression();
+  RegularExpression(const std::string &pattern, int flags, int captures);
+  /**
+   * Get the PCRE compiled pattern, for runtime functions that need it.
+   */
+  llvm::Value *operator()(GenerateState &state) const;
+  /**
+   * Generate code to check if a string matches this pattern.
+   *
+   * If memoize is set, patterns that need PCRE remember their result for
+   * each distinct string. Only use this for fields with few distinct values.
+   */
+  llvm::Value *match(GenerateState &state,
+                     llvm::Value *input,
+                     bool memoize = false) const;
+  /**
+   * Build an automaton that checks a string against several patterns at once.
+   * Returns null if any of the patterns cannot be matched by an automaton.
+   */
+  static std::shared_ptr<DFA> combine(
+      const std::vector<const RegularExpression *> &patterns);
+  /**
+   * Check if a string matches this pattern now, rather than in generated code.
+   */
+  bool matches(const std::string &input) const;
+  /**
+   * Write the pattern as it would appear in a query, for a query plan.
+   */
+  std::string describe() const;
+  /**
+   * Describe how `match` checks a string against this pattern.
+   */
+  std::string method() const;
+  /**
+   * The estimated cost of `match`. See `QueryPlan`.
+   */
+  double cost() const;
+
+private:
+  enum LiteralKind { NONE, EXACT, PREFIX, SUFFIX, CONTAINS };
+  std::string pattern;
+  int flags;
+  int captures;
+  LiteralKind kind;
+  std::string literal;
+  std::shared_ptr<DFA> dfa;
+  /**
+   * The pattern compiled by PCRE, for `matches`.
+   */
+  std::shared_ptr<void> compiled;
+};
+
+/**
+ * A description of how a query will be evaluated, built by walking the syntax
+ * tree after parsing, so it shows the query as it will be generated.
+ *
+ * Costs are estimates relative to reading one of the fixed-size fields of a
+ * read. The cost of a query is the sum of the costs of its nodes, so it
+ * assumes nothing short circuits.
+ */
+class QueryPlan {
+public:
+  /**
+   * Add a line describing a node, indented below the node whose children are
+   * being described. If a node is provided, the line notes whether it can be
+   * checked using the index or only the fixed-size fields of a read.
+   * @param cost: the cost of evaluating this node, not including its
+   * children.
+   */
+  void add(AstNode *node, const std::string &description, double cost = 0);
+  /**
+   * Add a line for a node followed by its children.
+   */
+  void add(AstNode *node,
+           const std::string &description,
+           const std::vector<std::shared_ptr<AstNode>> &children,
+           double cost = 0);
+  /**
+   * Add the lines for children of the last line added.
+   * @param repeat: the number of times the children are evaluated for each
+   * time the parent is.
+   */
+  void nest(const std::function<void()> &children, double repeat = 1);
+  /**
+   * Note that a part of the read must be decoded.
+   */
+  void decode(const std::string &field);
+  /**
+   * The estimated cost of evaluating the query for one read.
+   */
+  double cost() const;
+  void write(std::ostream &output) const;
+
+private:
+  std::vector<std::string> lines;
+  std::set<std::string> fields;
+  double total_cost = 0;
+  double scale = 1;
+  size_t depth = 0;
+};
+
+/**
+ * The time and memory used by each phase of compiling queries, and the size
+ * of the code generated for each function.
+ *
+ * Phases are timed exclusively: the optimiser runs when the JIT first looks
+ * up a symbol, so that time is counted as optimisation and not as linking.
+ * Timers must not be used from several threads at once.
+ */
+class CompileReport {
+public:
+  enum Phase { PARSE, GENERATE, OPTIMISE, LINK, INITIALISE, PHASE_COUNT };
+  /**
+   * Charge the time spent to a phase for as long as this object exists. If
+   * no report is being collected, this does nothing.
+   */
+  class Timer {
+  public:
+    Timer(const std::shared_ptr<CompileReport> &report, Phase phase);
+    ~Timer();
+
+  private:
+    CompileReport *report;
+    Phase outer;
+  };
+
+  /**
+   * Count the instructions in each function of a module, before or after it
+   * has been optimised.
+   */
+  void countInstructions(llvm::Module &module, bool optimised);
+  void write(std::ostream &output) const;
+
+private:
+  void enter(Phase phase);
+  Phase current = PHASE_COUNT;
+  std::chrono::steady_clock::time_point last;
+  size_t last_peak = 0;
+  std::chrono::steady_clock::duration times[PHASE_COUNT] = {};
+  size_t peak_growth[PHASE_COUNT] = {};
+  std::map<std::string, std::pair<size_t, size_t>> instructions;
+  size_t modules = 0;
+  size_t regexes = 0;
+};
 
 /**
  * A collection of predicates, where the name is the keyword in the query
@@ -104,6 +261,50 @@ RegularExpression setToRegEx(const std::string &prefix,
                              const std::set<std::string> &names,
                              const std::string &suffix);
 
+/**
+ * A callback that receives the counters collected by a probe after the
+ * generated code has run.
+ */
+typedef std::function<void(const uint64_t *counters)> ProbeHandler;
+
+/**
+ * A block of counters placed in the generated module by a node that wants
+ * feedback about how it behaved at run time.
+ *
+ * Probes with a node are attached to that node in the query and hold the
+ * number of times it ran, the number of times it was true, the number of
+ * times it was false, and the cycles spent in it. The node's position in the
+ * query is only for display, since several nodes can share one. Other probes
+ * belong to the node that created them and are interpreted by the handler.
+ */
+struct Probe {
+  std::string name;
+  size_t size;
+  ProbeHandler handler;
+  const AstNode *node;
+  unsigned int line;
+  unsigned int column;
+};
+
+/**
+ * The kinds of instrumentation that can be added to the generated code. These
+ * may be combined.
+ */
+enum ProfileFlags {
+  /**
+   * Count how the terms of logical operations behave.
+   */
+  PROFILE_TERMS = 1,
+  /**
+   * Count how often each node in the query runs and its results.
+   */
+  PROFILE_NODES = 2,
+  /**
+   * Also measure the time spent in each node.
+   */
+  PROFILE_CYCLES = 4
+};
+
 class Generator {
 public:
   Generator(llvm::Module *module, llvm::DIScope *debug_scope);
@@ -115,11 +316,84 @@ public:
   llvm::Constant *createString(const std::string &str);
   llvm::IRBuilder<> *constructor() const;
   llvm::IRBuilder<> *destructor() const;
+  /**
+   * Get a global pointer that is set by the constructor, using `create`, and
+   * released by the destructor, by passing the global to `release`. Globals
+   * with the same key are created once. If the key was imported, the global
+   * is taken from the module that created it and nothing is constructed.
+   */
+  llvm::GlobalVariable *createShared(
+      const std::string &key,
+      const std::function<llvm::Value *(llvm::IRBuilder<> &)> &create,
+      llvm::Function *release);
+  /**
+   * The names of the globals made by `createShared`, by key.
+   */
+  const std::map<std::string, std::string> &sharedGlobals() const;
+  /**
+   * Use the globals of another module, which must be linked with this one,
+   * rather than constructing them again.
+   */
+  void importShared(const std::map<std::string, std::string> &globals);
+  /**
+   * What instrumentation nodes should add to the generated code, as a
+   * combination of `ProfileFlags`.
+   */
+  unsigned int profiling() const;
+  void setProfiling(unsigned int);
+  /**
+   * Create a global array of 64-bit counters, initially zero, that will be
+   * passed to the handler when the profile is collected.
+   */
+  llvm::GlobalVariable *createProbe(size_t size, ProbeHandler &&handler);
+  /**
+   * Create a global array of counters for a node at a position in the query.
+   */
+  llvm::GlobalVariable *createProbe(const AstNode *node,
+                                    unsigned int line,
+                                    unsigned int column);
+  const std::vector<Probe> &probes() const;
+  /**
+   * Generate code only for the reads on the chromosome with this name, so that
+   * checks of the chromosome are decided while generating.
+   */
+  void setChromosome(const std::string &name);
+  /**
+   * Decide if the chromosome of the read matches a pattern, if it is known.
+   * The answers are recorded in order, so code generated for different
+   * chromosomes that got the same answers is the same.
+   * @returns: whether the chromosome is known.
+   */
+  bool decideChromosome(const RegularExpression &pattern, bool &matches);
+  /**
+   * The answers given by `decideChromosome`.
+   */
+  const std::vector<bool> &chromosomeDecisions() const;
+  /**
+   * The number of checks of the chromosome that could have been decided.
+   */
+  size_t chromosomeChecks() const;
+  /**
+   * The different patterns that checks of the chromosome use, in the order
+   * they were first seen, while no chromosome is set. The code generated for
+   * a chromosome depends only on which of these it matches.
+   */
+  const std::vector<const RegularExpression *> &chromosomePatterns() const;
 
 private:
   llvm::Module *mod;
   llvm::DIScope *debug_scope;
+  unsigned int profile = 0;
+  std::vector<Probe> probe_list;
+  bool has_chromosome = false;
+  std::string chromosome;
+  std::vector<bool> chromosome_decisions;
+  size_t chromosome_checks = 0;
+  std::vector<const RegularExpression *> chromosome_patterns;
   std::map<std::string, llvm::Constant *> constant_pool;
+  std::map<std::string, llvm::GlobalVariable *> shared;
+  std::map<std::string, std::string> shared_names;
+  std::map<std::string, std::string> imported_names;
   llvm::IRBuilder<> *ctor;
   llvm::IRBuilder<> *dtor;
 };
@@ -139,8 +413,19 @@ public:
    * One would think this is trivial, but it isn't.
    */
   llvm::Constant *createString(const std::string &str);
+  /**
+   * Atomically add a value to one of the counters in a probe.
+   */
+  void addToProbe(llvm::GlobalVariable *probe,
+                  size_t index,
+                  llvm::Value *value);
   std::map<void *, llvm::Value *> definitions;
   std::map<void *, llvm::Value *> definitionsIndex;
+  /**
+   * Whether the read is an undecoded BAM record rather than a `bam1_t`, in
+   * which case only the fixed-size fields can be accessed.
+   */
+  bool raw_record = false;
 
 private:
   std::shared_ptr<Generator> generator;
@@ -199,6 +484,64 @@ public:
    * `generateIndex` be non-constant).
    */
   virtual bool usesIndex();
+  /**
+   * If this expression is an integer known at compile time, get its value.
+   */
+  virtual bool constantInt(int &value);
+  /**
+   * If this expression is a string known at compile time, get its value.
+   */
+  virtual bool constantStr(std::string &value);
+  /**
+   * If this node tests two expressions for equality or inequality, get the
+   * expressions being compared.
+   * @param equal: set to true for equality and false for inequality.
+   */
+  virtual bool equalityOperands(bool &equal,
+                                std::shared_ptr<AstNode> &left,
+                                std::shared_ptr<AstNode> &right);
+  /**
+   * If this node checks an expression against a regular expression, get the
+   * expression and the pattern.
+   */
+  virtual bool regexOperands(std::shared_ptr<AstNode> &operand,
+                             const RegularExpression *&pattern);
+  /**
+   * If this expression always produces the same value for the same read,
+   * get a string that is identical for every other such expression that
+   * produces the same value.
+   */
+  virtual bool structuralKey(std::string &key);
+  /**
+   * Determine if this expression only reads the fixed-size fields of a read,
+   * so that it can be computed without branching for many reads at once.
+   */
+  virtual bool coreOnly();
+  /**
+   * Render, without branching, a condition that must hold for this node to be
+   * true and that only reads the fixed-size fields of a read. If the node is
+   * `coreOnly`, the condition is the node itself.
+   * @returns: the condition or null if nothing can be checked this way.
+   */
+  virtual llvm::Value *generateCore(GenerateState &state,
+                                    llvm::Value *read,
+                                    llvm::Value *header,
+                                    llvm::Value *error_fn,
+                                    llvm::Value *error_ctx);
+  /**
+   * If this expression is the read group of a read, whose values should be
+   * the IDs of the `@RG` lines in the header.
+   */
+  virtual bool readGroup();
+  /**
+   * Render a condition, using only the header, that must hold for this node
+   * to be true for any read in the file.
+   * @returns: the condition or null if nothing can be checked this way.
+   */
+  virtual llvm::Value *generateHeader(GenerateState &state,
+                                      llvm::Value *header,
+                                      llvm::Value *error_fn,
+                                      llvm::Value *error_ctx);
   /**
    * Generate the LLVM function from the query.
    */
@@ -206,14 +549,53 @@ public:
                                        llvm::StringRef name);
   llvm::Function *createIndexFunction(std::shared_ptr<Generator> &generator,
                                       llvm::StringRef name);
+  /**
+   * Generate a function that filters an array of reads, storing whether each
+   * one matches, and returns whether any did. The fixed-size fields of every
+   * read are checked first, in a loop that can be vectorised, and only the
+   * reads that pass are given to the filter function.
+   */
+  llvm::Function *createBatchFunction(std::shared_ptr<Generator> &generator,
+                                      llvm::StringRef name,
+                                      llvm::Function *filter);
+  /**
+   * Generate a function that checks the fixed-size fields of an undecoded BAM
+   * record, from the reference ID onwards, so that reads that cannot match
+   * are skipped without being decoded. Returns null if there is nothing to
+   * check or the records cannot be read on this host.
+   */
+  llvm::Function *createRawFilterFunction(
+      std::shared_ptr<Generator> &generator, llvm::StringRef name);
+  /**
+   * Generate a function that checks if any read in a file with a particular
+   * header could match, so that files that cannot match are skipped without
+   * reading them. Returns null if the header has nothing to say.
+   */
+  llvm::Function *createHeaderFunction(std::shared_ptr<Generator> &generator,
+                                       llvm::StringRef name);
 
   /**
    * Gets the type of this expression.
    */
   virtual ExprType type() = 0;
+  /**
+   * Describe this node, and its children, for a query plan. Nodes that do not
+   * describe themselves appear as an opaque term.
+   */
+  virtual void explain(QueryPlan &plan);
   virtual void writeDebug(GenerateState &state) = 0;
 
 private:
+  llvm::Value *generateRaw(GenerateState &state,
+                           llvm::Value *record,
+                           llvm::Value *header,
+                           llvm::Value *error_fn,
+                           llvm::Value *error_ctx);
+  llvm::Value *generateFile(GenerateState &state,
+                            llvm::Value *unused,
+                            llvm::Value *header,
+                            llvm::Value *error_fn,
+                            llvm::Value *error_ctx);
   llvm::Function *createFunction(std::shared_ptr<Generator> &generator,
                                  llvm::StringRef name,
                                  llvm::StringRef param_name,
@@ -228,6 +610,23 @@ private:
 class DebuggableNode : public AstNode {
 public:
   DebuggableNode(ParseState &state);
+  /**
+   * Render this syntax node to LLVM, surrounded by a probe if the node is
+   * being profiled.
+   */
+  llvm::Value *generate(GenerateState &state,
+                        llvm::Value *read,
+                        llvm::Value *header,
+                        llvm::Value *error_fn,
+                        llvm::Value *error_ctx) final;
+  /**
+   * Render this syntax node to LLVM. See `AstNode::generate`.
+   */
+  virtual llvm::Value *generateValue(GenerateState &state,
+                                     llvm::Value *read,
+                                     llvm::Value *header,
+                                     llvm::Value *error_fn,
+                                     llvm::Value *error_ctx) = 0;
   void writeDebug(GenerateState &state);
 
 private:
@@ -268,6 +667,11 @@ public:
    * any character execpt those listed.
    */
   std::string parseStr(const std::string &accept_chars, bool reject = false);
+  /**
+   * Parse a double-quoted string. A backslash includes the next character
+   * literally.
+   */
+  std::string parseQuoted();
   /**
    * Consume whitespace in the parse stream.
    * @returns: true if any whitespace was consumed.
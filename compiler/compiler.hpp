@@ -55,4 +55,18 @@ std::shared_ptr<AstNode> parseBinding(ParseState &state);
 std::shared_ptr<AstNode> parseMatchBinding(ParseState &state);
 std::shared_ptr<AstNode> parseMax(ParseState &state);
 std::shared_ptr<AstNode> parseMin(ParseState &state);
+
+/**
+ * Check if a runtime function is defined in the generated module so that it
+ * only loads fixed-size fields of the read rather than calling the runtime.
+ */
+bool isCoreAccessor(const std::string &name);
+
+/**
+ * Generate code to check if a string is equal to a constant string. The input
+ * may be null, in which case, it is not equal.
+ */
+llvm::Value *generateStrEquals(GenerateState &state,
+                               llvm::Value *input,
+                               const std::string &literal);
 } // namespace bamql
@@ -0,0 +1,755 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+
+#include "dfa.hpp"
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <map>
+
+/**
+ * The result cannot change from this state, so the rest of the input need not
+ * be read.
+ */
+#define STATE_FINAL 1
+/**
+ * The largest automaton that will be generated. Larger automata are left to
+ * PCRE.
+ */
+#define MAX_DFA_STATES 1024
+#define MAX_NFA_STATES 8192
+/**
+ * The largest count allowed in a `{m,n}` repetition, since each repetition
+ * is copied.
+ */
+#define MAX_REPEAT 64
+
+namespace {
+typedef std::bitset<256> CharSet;
+
+/**
+ * A parsed regular expression.
+ */
+struct RegexTree {
+  enum Kind { SET, CONCAT, ALT, REPEAT };
+  RegexTree(Kind kind_) : kind(kind_), min(0), max(0) {}
+  Kind kind;
+  CharSet set;
+  std::vector<std::shared_ptr<RegexTree>> children;
+  int min;
+  /**
+   * The maximum number of repetitions, or -1 if unbounded.
+   */
+  int max;
+};
+typedef std::shared_ptr<RegexTree> RegexTreePtr;
+
+/**
+ * A recursive descent parser for the part of the PCRE syntax that can be
+ * matched by an automaton. The pattern has already been accepted by PCRE, so
+ * only unsupported features, not syntax errors, are of concern. Every method
+ * returns null if the pattern cannot be handled.
+ */
+class RegexParser {
+public:
+  RegexParser(const std::string &pattern_,
+              size_t start,
+              size_t end_,
+              bool caseless_)
+      : pattern(pattern_), index(start), end(end_), caseless(caseless_),
+        depth(0), top_alternation(false) {}
+
+  RegexTreePtr parse() {
+    auto tree = parseAlternation();
+    return index == end ? tree : nullptr;
+  }
+  /**
+   * Whether `|` appears outside of any group, which changes the meaning of
+   * anchors.
+   */
+  bool topLevelAlternation() const { return top_alternation; }
+
+private:
+  RegexTreePtr parseAlternation() {
+    auto result = std::make_shared<RegexTree>(RegexTree::ALT);
+    while (true) {
+      auto option = parseConcat();
+      if (!option) {
+        return nullptr;
+      }
+      result->children.push_back(option);
+      if (index >= end || pattern[index] != '|') {
+        break;
+      }
+      index++;
+    }
+    if (result->children.size() == 1) {
+      return result->children.front();
+    }
+    if (depth == 0) {
+      top_alternation = true;
+    }
+    return result;
+  }
+
+  RegexTreePtr parseConcat() {
+    auto result = std::make_shared<RegexTree>(RegexTree::CONCAT);
+    while (index < end && pattern[index] != '|' && pattern[index] != ')') {
+      auto item = parseRepeat();
+      if (!item) {
+        return nullptr;
+      }
+      result->children.push_back(item);
+    }
+    return result;
+  }
+
+  RegexTreePtr parseRepeat() {
+    auto atom = parseAtom();
+    while (atom && index < end) {
+      int min;
+      int max;
+      switch (pattern[index]) {
+      case '*':
+        min = 0;
+        max = -1;
+        index++;
+        break;
+      case '+':
+        min = 1;
+        max = -1;
+        index++;
+        break;
+      case '?':
+        min = 0;
+        max = 1;
+        index++;
+        break;
+      case '{':
+        index++;
+        if (!parseNumber(min)) {
+          return nullptr;
+        }
+        max = min;
+        if (index < end && pattern[index] == ',') {
+          index++;
+          max = -1;
+          if (index < end && pattern[index] != '}' && !parseNumber(max)) {
+            return nullptr;
+          }
+        }
+        if (index >= end || pattern[index] != '}' ||
+            (max != -1 && max < min) || min > MAX_REPEAT || max > MAX_REPEAT) {
+          return nullptr;
+        }
+        index++;
+        break;
+      default:
+        return atom;
+      }
+      // Laziness does not change whether there is a match, but possessiveness
+      // does.
+      if (index < end && pattern[index] == '?') {
+        index++;
+      } else if (index < end && pattern[index] == '+') {
+        return nullptr;
+      }
+      auto repeat = std::make_shared<RegexTree>(RegexTree::REPEAT);
+      repeat->children.push_back(atom);
+      repeat->min = min;
+      repeat->max = max;
+      atom = repeat;
+    }
+    return atom;
+  }
+
+  RegexTreePtr parseAtom() {
+    CharSet set;
+    switch (pattern[index++]) {
+    case '(': {
+      if (index < end && pattern[index] == '?') {
+        if (index + 1 < end && pattern[index + 1] == ':') {
+          index += 2;
+        } else {
+          return nullptr;
+        }
+      }
+      depth++;
+      auto inner = parseAlternation();
+      depth--;
+      if (!inner || index >= end || pattern[index] != ')') {
+        return nullptr;
+      }
+      index++;
+      return inner;
+    }
+    case '[':
+      // Classes are folded before they are negated.
+      if (!parseClass(set)) {
+        return nullptr;
+      }
+      return makeSet(set);
+    case '.':
+      set.set();
+      set.reset('\n');
+      break;
+    case '\\':
+      if (!parseEscape(set)) {
+        return nullptr;
+      }
+      break;
+    case '^':
+    case '$':
+    case '{':
+    case '*':
+    case '+':
+    case '?':
+      return nullptr;
+    default:
+      set.set((unsigned char)pattern[index - 1]);
+      break;
+    }
+    foldCase(set);
+    return makeSet(set);
+  }
+
+  RegexTreePtr makeSet(const CharSet &set) {
+    auto result = std::make_shared<RegexTree>(RegexTree::SET);
+    result->set = set;
+    return result;
+  }
+
+  /**
+   * For a caseless pattern, add the other case of every letter in a set.
+   */
+  void foldCase(CharSet &set) {
+    if (caseless) {
+      for (int c = 'a'; c <= 'z'; c++) {
+        if (set[c] || set[toupper(c)]) {
+          set.set(c);
+          set.set(toupper(c));
+        }
+      }
+    }
+  }
+
+  bool parseEscape(CharSet &set) {
+    if (index >= end) {
+      return false;
+    }
+    auto c = pattern[index++];
+    switch (c) {
+    case 'd':
+    case 'D':
+      for (int it = '0'; it <= '9'; it++) {
+        set.set(it);
+      }
+      break;
+    case 'w':
+    case 'W':
+      for (int it = 0; it < 256; it++) {
+        if (isalnum(it) || it == '_') {
+          set.set(it);
+        }
+      }
+      break;
+    case 's':
+    case 'S':
+      for (auto space : " \t\n\v\f\r") {
+        set.set((unsigned char)space);
+      }
+      set.reset(0);
+      break;
+    case 'a':
+      set.set('\a');
+      break;
+    case 'e':
+      set.set(27);
+      break;
+    case 'f':
+      set.set('\f');
+      break;
+    case 'n':
+      set.set('\n');
+      break;
+    case 'r':
+      set.set('\r');
+      break;
+    case 't':
+      set.set('\t');
+      break;
+    default:
+      if (isalnum(c)) {
+        return false;
+      }
+      set.set((unsigned char)c);
+      break;
+    }
+    if (isupper(c)) {
+      set.flip();
+    }
+    return true;
+  }
+
+  bool parseClass(CharSet &set) {
+    bool negate = index < end && pattern[index] == '^';
+    if (negate) {
+      index++;
+    }
+    bool first = true;
+    while (true) {
+      if (index >= end) {
+        return false;
+      }
+      if (pattern[index] == ']' && !first) {
+        index++;
+        break;
+      }
+      first = false;
+      if (pattern[index] == '[') {
+        // POSIX classes, such as [:alpha:], are not supported.
+        return false;
+      }
+      int low;
+      if (!parseClassChar(set, low)) {
+        return false;
+      }
+      if (low < 0) {
+        continue;
+      }
+      int high = low;
+      if (index + 1 < end && pattern[index] == '-' &&
+          pattern[index + 1] != ']') {
+        index++;
+        if (pattern[index] == '[' || !parseClassChar(set, high) || high < 0 ||
+            high < low) {
+          return false;
+        }
+      }
+      for (int it = low; it <= high; it++) {
+        set.set(it);
+      }
+    }
+    foldCase(set);
+    if (negate) {
+      set.flip();
+    }
+    return true;
+  }
+
+  /**
+   * Parse a single character in a class. If it is an escape for a set of
+   * characters, such as \d, the set is added to the class and `c` is -1.
+   */
+  bool parseClassChar(CharSet &set, int &c) {
+    if (pattern[index] != '\\') {
+      c = (unsigned char)pattern[index++];
+      return true;
+    }
+    index++;
+    CharSet escape;
+    if (!parseEscape(escape)) {
+      return false;
+    }
+    if (escape.count() != 1) {
+      set |= escape;
+      c = -1;
+      return true;
+    }
+    for (c = 0; !escape[c]; c++)
+      ;
+    return true;
+  }
+
+  bool parseNumber(int &value) {
+    auto start = index;
+    value = 0;
+    while (index < end && isdigit(pattern[index]) && value <= MAX_REPEAT) {
+      value = value * 10 + (pattern[index++] - '0');
+    }
+    return index > start;
+  }
+
+  const std::string &pattern;
+  size_t index;
+  size_t end;
+  bool caseless;
+  int depth;
+  bool top_alternation;
+};
+
+/**
+ * A Thompson non-deterministic automaton.
+ */
+class NFA {
+public:
+  size_t add() {
+    edges.emplace_back();
+    epsilons.emplace_back();
+    return edges.size() - 1;
+  }
+  /**
+   * Add the states for a regular expression between two states. Only new
+   * states have transitions into them, so a tree can be built from any
+   * state.
+   */
+  bool build(const RegexTreePtr &tree, size_t from, size_t to) {
+    if (edges.size() > MAX_NFA_STATES) {
+      return false;
+    }
+    switch (tree->kind) {
+    case RegexTree::SET:
+      edges[from].push_back(std::make_pair(tree->set, to));
+      return true;
+    case RegexTree::CONCAT: {
+      auto current = from;
+      for (size_t it = 0; it < tree->children.size(); it++) {
+        auto next = it + 1 == tree->children.size() ? to : add();
+        if (!build(tree->children[it], current, next)) {
+          return false;
+        }
+        current = next;
+      }
+      if (tree->children.empty()) {
+        epsilons[from].push_back(to);
+      }
+      return true;
+    }
+    case RegexTree::ALT:
+      for (auto &child : tree->children) {
+        if (!build(child, from, to)) {
+          return false;
+        }
+      }
+      return true;
+    case RegexTree::REPEAT: {
+      auto current = from;
+      for (int it = 0; it < tree->min; it++) {
+        auto next = add();
+        if (!build(tree->children.front(), current, next)) {
+          return false;
+        }
+        current = next;
+      }
+      if (tree->max == -1) {
+        auto loop = add();
+        auto loop_end = add();
+        epsilons[current].push_back(loop);
+        if (!build(tree->children.front(), loop, loop_end)) {
+          return false;
+        }
+        epsilons[loop_end].push_back(loop);
+        epsilons[loop].push_back(to);
+        return true;
+      }
+      for (int it = tree->min; it < tree->max; it++) {
+        auto next = add();
+        epsilons[current].push_back(to);
+        if (!build(tree->children.front(), current, next)) {
+          return false;
+        }
+        current = next;
+      }
+      epsilons[current].push_back(to);
+      return true;
+    }
+    }
+    return false;
+  }
+  /**
+   * Get the states reachable from a set of states without consuming input.
+   */
+  std::vector<size_t> closure(std::vector<size_t> &&states) const {
+    std::vector<bool> seen(edges.size());
+    std::vector<size_t> result;
+    while (!states.empty()) {
+      auto state = states.back();
+      states.pop_back();
+      if (seen[state]) {
+        continue;
+      }
+      seen[state] = true;
+      result.push_back(state);
+      states.insert(states.end(), epsilons[state].begin(),
+                    epsilons[state].end());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  std::vector<std::vector<std::pair<CharSet, size_t>>> edges;
+  std::vector<std::vector<size_t>> epsilons;
+};
+
+template <typename T>
+llvm::GlobalVariable *createTable(bamql::GenerateState &state,
+                                  const std::vector<T> &values,
+                                  const std::string &name) {
+  auto array = llvm::ConstantDataArray::get(state.module()->getContext(),
+                                            llvm::ArrayRef<T>(values));
+  return new llvm::GlobalVariable(*state.module(), array->getType(), true,
+                                  llvm::GlobalVariable::PrivateLinkage, array,
+                                  name);
+}
+} // namespace
+
+namespace bamql {
+
+std::shared_ptr<DFA> DFA::compile(const std::string &pattern, bool caseless) {
+  return compile({ std::make_pair(pattern, caseless) });
+}
+
+std::shared_ptr<DFA> DFA::compile(
+    const std::vector<std::pair<std::string, bool>> &patterns) {
+  if (patterns.size() > MAX_PATTERNS) {
+    return nullptr;
+  }
+  // Build one NFA with a separate start and accept state for each pattern.
+  // The states of each pattern are numbered consecutively, so the pattern a
+  // state belongs to can be found from the last state of each pattern.
+  NFA nfa;
+  std::vector<size_t> nfa_starts;
+  std::vector<size_t> nfa_accepts;
+  std::vector<size_t> nfa_ends;
+  std::vector<bool> end_anchors;
+  for (auto &entry : patterns) {
+    auto &pattern = entry.first;
+    size_t start = 0;
+    size_t end = pattern.length();
+    bool start_anchor = end > 0 && pattern[0] == '^';
+    if (start_anchor) {
+      start++;
+    }
+    bool end_anchor = false;
+    if (end > start && pattern[end - 1] == '$') {
+      // Make sure the dollar is not escaped.
+      size_t backslashes = 0;
+      while (end - 1 - backslashes > start &&
+             pattern[end - 2 - backslashes] == '\\') {
+        backslashes++;
+      }
+      if (backslashes % 2 == 0) {
+        end_anchor = true;
+        end--;
+      }
+    }
+    RegexParser parser(pattern, start, end, entry.second);
+    auto tree = parser.parse();
+    if (!tree ||
+        ((start_anchor || end_anchor) && parser.topLevelAlternation())) {
+      return nullptr;
+    }
+
+    auto nfa_start = nfa.add();
+    auto nfa_accept = nfa.add();
+    if (!start_anchor) {
+      // A match may start anywhere, so skip any prefix.
+      nfa.edges[nfa_start].push_back(
+          std::make_pair(CharSet().set(), nfa_start));
+    }
+    if (!nfa.build(tree, nfa_start, nfa_accept)) {
+      return nullptr;
+    }
+    nfa_starts.push_back(nfa_start);
+    nfa_accepts.push_back(nfa_accept);
+    nfa_ends.push_back(nfa.edges.size());
+    end_anchors.push_back(end_anchor);
+  }
+  auto owner = [&](size_t nfa_state) {
+    return std::upper_bound(nfa_ends.begin(), nfa_ends.end(), nfa_state) -
+           nfa_ends.begin();
+  };
+
+  std::shared_ptr<DFA> dfa(new DFA());
+
+  // Divide the bytes into classes that no transition distinguishes.
+  dfa->classes.assign(256, 0);
+  dfa->class_count = 1;
+  for (auto &state_edges : nfa.edges) {
+    for (auto &edge : state_edges) {
+      std::map<std::pair<uint8_t, bool>, uint8_t> refined;
+      for (int it = 0; it < 256; it++) {
+        auto key = std::make_pair(dfa->classes[it], (bool)edge.first[it]);
+        auto found = refined.find(key);
+        if (found == refined.end()) {
+          found = refined.insert(std::make_pair(key, refined.size())).first;
+        }
+        dfa->classes[it] = found->second;
+      }
+      dfa->class_count = refined.size();
+    }
+  }
+  std::vector<int> representatives(dfa->class_count, -1);
+  for (int it = 255; it >= 0; it--) {
+    representatives[dfa->classes[it]] = it;
+  }
+
+  // Convert to a DFA using the subset construction. Each DFA state is the
+  // set of NFA states and the mask of patterns that have already matched.
+  // Once a pattern has matched, its NFA states are dropped, so a state with
+  // no NFA states left is final. State 0 is the start.
+  typedef std::pair<std::vector<size_t>, uint32_t> Subset;
+  std::map<Subset, uint16_t> ids;
+  std::vector<Subset> states;
+  auto intern = [&](std::vector<size_t> &&nfa_states, uint32_t matched) {
+    auto closed = nfa.closure(std::move(nfa_states));
+    for (size_t it = 0; it < patterns.size(); it++) {
+      if (!end_anchors[it] &&
+          std::binary_search(closed.begin(), closed.end(), nfa_accepts[it])) {
+        matched |= 1u << it;
+      }
+    }
+    closed.erase(std::remove_if(closed.begin(), closed.end(),
+                                [&](size_t nfa_state) {
+                                  return matched & (1u << owner(nfa_state));
+                                }),
+                 closed.end());
+    Subset subset(std::move(closed), matched);
+    auto found = ids.find(subset);
+    if (found != ids.end()) {
+      return (int)found->second;
+    }
+    if (states.size() >= MAX_DFA_STATES) {
+      return -1;
+    }
+    ids[subset] = states.size();
+    states.push_back(std::move(subset));
+    return (int)states.size() - 1;
+  };
+  intern(std::vector<size_t>(nfa_starts), 0);
+  for (size_t it = 0; it < states.size(); it++) {
+    auto current = states[it];
+    auto accept = current.second;
+    for (size_t pattern = 0; pattern < patterns.size(); pattern++) {
+      if (end_anchors[pattern] &&
+          std::binary_search(current.first.begin(), current.first.end(),
+                             nfa_accepts[pattern])) {
+        accept |= 1u << pattern;
+      }
+    }
+    dfa->flags.push_back(current.first.empty() ? STATE_FINAL : 0);
+    dfa->accepts.push_back(accept);
+    for (auto c : representatives) {
+      std::vector<size_t> next;
+      for (auto nfa_state : current.first) {
+        for (auto &edge : nfa.edges[nfa_state]) {
+          if (edge.first[c]) {
+            next.push_back(edge.second);
+          }
+        }
+      }
+      auto id = intern(std::move(next), current.second);
+      if (id < 0) {
+        return nullptr;
+      }
+      dfa->transitions.push_back(id);
+    }
+  }
+  return dfa;
+}
+
+llvm::Value *DFA::match(GenerateState &state, llvm::Value *input) const {
+  return state->CreateICmpNE(
+      matchAll(state, input),
+      llvm::ConstantInt::get(llvm::Type::getInt32Ty(
+                                 state.module()->getContext()),
+                             0));
+}
+
+llvm::Value *DFA::matchAll(GenerateState &state, llvm::Value *input) const {
+  auto &context = state.module()->getContext();
+  auto base_uint8 = llvm::Type::getInt8Ty(context);
+  auto base_uint16 = llvm::Type::getInt16Ty(context);
+  auto base_uint32 = llvm::Type::getInt32Ty(context);
+  auto base_uint64 = llvm::Type::getInt64Ty(context);
+  auto zero = llvm::ConstantInt::get(base_uint32, 0);
+
+  auto class_table = createTable(state, classes, ".dfa_classes");
+  auto transition_table = createTable(state, transitions, ".dfa_transitions");
+  auto flag_table = createTable(state, flags, ".dfa_flags");
+  auto accept_table = createTable(state, accepts, ".dfa_accepts");
+
+  auto function = state->GetInsertBlock()->getParent();
+  auto entry_block = state->GetInsertBlock();
+  auto loop_block = llvm::BasicBlock::Create(context, "dfa_loop", function);
+  auto read_block = llvm::BasicBlock::Create(context, "dfa_read", function);
+  auto step_block = llvm::BasicBlock::Create(context, "dfa_step", function);
+  auto end_block = llvm::BasicBlock::Create(context, "dfa_end", function);
+  auto done_block = llvm::BasicBlock::Create(context, "dfa_done", function);
+
+  state->CreateCondBr(state->CreateIsNull(input), done_block, loop_block);
+
+  // Stop early if the current state decides the result.
+  state->SetInsertPoint(loop_block);
+  auto current = state->CreatePHI(base_uint32, 2);
+  auto offset = state->CreatePHI(base_uint64, 2);
+  llvm::Value *flag_index[] = { zero, current };
+  auto current_flags = state->CreateLoad(
+      base_uint8, state->CreateInBoundsGEP(flag_table->getValueType(),
+                                           flag_table, flag_index));
+  state->CreateCondBr(
+      state->CreateICmpNE(state->CreateAnd(current_flags, STATE_FINAL),
+                          llvm::ConstantInt::get(base_uint8, 0)),
+      end_block, read_block);
+
+  state->SetInsertPoint(read_block);
+  auto c = state->CreateLoad(
+      base_uint8, state->CreateInBoundsGEP(base_uint8, input, offset));
+  state->CreateCondBr(
+      state->CreateICmpEQ(c, llvm::ConstantInt::get(base_uint8, 0)), end_block,
+      step_block);
+
+  // Move to the next state.
+  state->SetInsertPoint(step_block);
+  llvm::Value *class_index[] = { zero, state->CreateZExt(c, base_uint32) };
+  auto char_class = state->CreateLoad(
+      base_uint8, state->CreateInBoundsGEP(class_table->getValueType(),
+                                           class_table, class_index));
+  auto row = state->CreateMul(
+      current, llvm::ConstantInt::get(base_uint32, class_count));
+  llvm::Value *transition_index[] = {
+    zero, state->CreateAdd(row, state->CreateZExt(char_class, base_uint32))
+  };
+  auto next = state->CreateZExt(
+      state->CreateLoad(base_uint16,
+                        state->CreateInBoundsGEP(
+                            transition_table->getValueType(), transition_table,
+                            transition_index)),
+      base_uint32);
+  auto next_offset =
+      state->CreateAdd(offset, llvm::ConstantInt::get(base_uint64, 1));
+  state->CreateBr(loop_block);
+
+  current->addIncoming(zero, entry_block);
+  current->addIncoming(next, step_block);
+  offset->addIncoming(llvm::ConstantInt::get(base_uint64, 0), entry_block);
+  offset->addIncoming(next_offset, step_block);
+
+  state->SetInsertPoint(end_block);
+  llvm::Value *accept_index[] = { zero, current };
+  auto end_result = state->CreateLoad(
+      base_uint32, state->CreateInBoundsGEP(accept_table->getValueType(),
+                                            accept_table, accept_index));
+  state->CreateBr(done_block);
+
+  state->SetInsertPoint(done_block);
+  auto result = state->CreatePHI(base_uint32, 2);
+  result->addIncoming(zero, entry_block);
+  result->addIncoming(end_result, end_block);
+  return result;
+}
+} // namespace bamql
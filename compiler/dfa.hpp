@@ -0,0 +1,84 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#pragma once
+
+#include "bamql-compiler.hpp"
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bamql {
+
+/**
+ * A deterministic finite automaton for a regular expression that can be
+ * matched without backtracking, so it can be run in generated code instead
+ * of calling PCRE.
+ */
+class DFA {
+public:
+  /**
+   * Build an automaton for a PCRE pattern. If the pattern uses features that
+   * an automaton cannot match (backreferences, look-around, anchors in the
+   * middle of the pattern, and the like) or the automaton would be too large,
+   * null is returned and PCRE must be used instead.
+   */
+  static std::shared_ptr<DFA> compile(const std::string &pattern,
+                                      bool caseless);
+  /**
+   * Build one automaton for several PCRE patterns, each given with whether it
+   * is caseless, that finds all the patterns that match in a single pass.
+   */
+  static std::shared_ptr<DFA> compile(
+      const std::vector<std::pair<std::string, bool>> &patterns);
+  /**
+   * Generate code that runs the automaton over a string, which may be null.
+   */
+  llvm::Value *match(GenerateState &state, llvm::Value *input) const;
+  /**
+   * Generate code that runs the automaton over a string, which may be null,
+   * and produces a 32-bit mask with a bit set for each pattern that matched.
+   */
+  llvm::Value *matchAll(GenerateState &state, llvm::Value *input) const;
+
+  /**
+   * The most patterns that can be combined into one automaton.
+   */
+  static const size_t MAX_PATTERNS = 32;
+
+private:
+  DFA() = default;
+  /**
+   * The character class of each byte. Bytes in the same class have the same
+   * transitions from every state.
+   */
+  std::vector<uint8_t> classes;
+  size_t class_count;
+  /**
+   * The next state for each state and character class.
+   */
+  std::vector<uint16_t> transitions;
+  /**
+   * What to do when in each state. See the `STATE_` constants in the
+   * implementation.
+   */
+  std::vector<uint8_t> flags;
+  /**
+   * The patterns that have matched if the input stops in each state.
+   */
+  std::vector<uint32_t> accepts;
+};
+} // namespace bamql
@@ -16,7 +16,9 @@
 
 #include "bamql-compiler.hpp"
 #include "compiler.hpp"
+#include <algorithm>
 #include <llvm/Support/Alignment.h>
+#include <sstream>
 
 namespace bamql {
 
@@ -69,6 +71,102 @@ void Generator::setDebugScope(llvm::DIScope *scope) { debug_scope = scope; }
 llvm::IRBuilder<> *Generator::constructor() const { return ctor; }
 llvm::IRBuilder<> *Generator::destructor() const { return dtor; }
 
+llvm::GlobalVariable *Generator::createShared(
+    const std::string &key,
+    const std::function<llvm::Value *(llvm::IRBuilder<> &)> &create,
+    llvm::Function *release) {
+  auto iterator = shared.find(key);
+  if (iterator != shared.end()) {
+    return iterator->second;
+  }
+  auto base_str =
+      llvm::PointerType::get(llvm::Type::getInt8Ty(mod->getContext()), 0);
+  llvm::GlobalVariable *global_variable;
+  auto imported = imported_names.find(key);
+  if (imported != imported_names.end()) {
+    global_variable = new llvm::GlobalVariable(
+        *mod, base_str, false, llvm::GlobalValue::ExternalLinkage, nullptr,
+        imported->second);
+  } else {
+    // The global is visible outside the module so that versions of the query
+    // for particular chromosomes can use it.
+    std::stringstream name;
+    name << mod->getName().str() << ".shared"
+         << (imported_names.size() + shared_names.size());
+    global_variable = new llvm::GlobalVariable(
+        *mod, base_str, false, llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantPointerNull::get(base_str), name.str());
+    ctor->CreateStore(create(*ctor), global_variable);
+    llvm::Value *release_args[] = { global_variable };
+    dtor->CreateCall(release, release_args);
+    shared_names[key] = name.str();
+  }
+  shared[key] = global_variable;
+  return global_variable;
+}
+const std::map<std::string, std::string> &Generator::sharedGlobals() const {
+  return shared_names;
+}
+void Generator::importShared(
+    const std::map<std::string, std::string> &globals) {
+  imported_names = globals;
+}
+
+unsigned int Generator::profiling() const { return profile; }
+void Generator::setProfiling(unsigned int flags) { profile = flags; }
+const std::vector<Probe> &Generator::probes() const { return probe_list; }
+
+void Generator::setChromosome(const std::string &name) {
+  has_chromosome = true;
+  chromosome = name;
+}
+bool Generator::decideChromosome(const RegularExpression &pattern,
+                                 bool &matches) {
+  chromosome_checks++;
+  if (!has_chromosome) {
+    if (std::find(chromosome_patterns.begin(), chromosome_patterns.end(),
+                  &pattern) == chromosome_patterns.end()) {
+      chromosome_patterns.push_back(&pattern);
+    }
+    return false;
+  }
+  matches = pattern.matches(chromosome);
+  chromosome_decisions.push_back(matches);
+  return true;
+}
+const std::vector<bool> &Generator::chromosomeDecisions() const {
+  return chromosome_decisions;
+}
+size_t Generator::chromosomeChecks() const { return chromosome_checks; }
+const std::vector<const RegularExpression *> &
+Generator::chromosomePatterns() const {
+  return chromosome_patterns;
+}
+
+llvm::GlobalVariable *Generator::createProbe(size_t size,
+                                             ProbeHandler &&handler) {
+  std::stringstream name;
+  name << mod->getName().str() << ".probe" << probe_list.size();
+  auto array_ty =
+      llvm::ArrayType::get(llvm::Type::getInt64Ty(mod->getContext()), size);
+  auto global_variable = new llvm::GlobalVariable(
+      *mod, array_ty, false, llvm::GlobalValue::ExternalLinkage,
+      llvm::ConstantAggregateZero::get(array_ty), name.str());
+  global_variable->setAlignment(llvm::MaybeAlign(8));
+  probe_list.push_back(
+      Probe{ name.str(), size, std::move(handler), nullptr, 0, 0 });
+  return global_variable;
+}
+llvm::GlobalVariable *Generator::createProbe(const AstNode *node,
+                                             unsigned int line,
+                                             unsigned int column) {
+  auto global_variable = createProbe(4, nullptr);
+  probe_list.back().node = node;
+  probe_list.back().line = line;
+  probe_list.back().column = column;
+  return global_variable;
+}
+
 llvm::Constant *Generator::createString(const std::string &str) {
   auto iterator = constant_pool.find(str);
   if (iterator != constant_pool.end()) {
@@ -108,4 +206,15 @@ llvm::DIScope *GenerateState::debugScope() const {
 llvm::Constant *GenerateState::createString(const std::string &str) {
   return generator->createString(str);
 }
+void GenerateState::addToProbe(llvm::GlobalVariable *probe,
+                               size_t index,
+                               llvm::Value *value) {
+  auto counter = builder.CreateConstInBoundsGEP2_64(probe->getValueType(),
+                                                    probe, 0, index);
+  builder.CreateAtomicRMW(
+      llvm::AtomicRMWInst::Add, counter,
+      builder.CreateZExt(value,
+                         llvm::Type::getInt64Ty(module()->getContext())),
+      llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+}
 } // namespace bamql
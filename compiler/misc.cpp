@@ -16,6 +16,8 @@
 
 #include "bamql-compiler.hpp"
 #include "compiler.hpp"
+#include "config.h"
+#include <llvm/Support/SwapByteOrder.h>
 
 namespace bamql {
 
@@ -24,8 +26,9 @@ static void PureReadArg(llvm::Function *func) {
   func->setOnlyReadsMemory();
   func->setOnlyAccessesArgMemory();
 }
-static void MutateInaccessible(llvm::Function *func) {
-  func->setOnlyAccessesInaccessibleMemory();
+static void ReadOnlyNoRecurse(llvm::Function *func) {
+  func->setOnlyReadsMemory();
+  func->setDoesNotRecurse();
 }
 static void PureReadArgNoRecurse(llvm::Function *func) {
   PureReadArg(func);
@@ -48,6 +51,188 @@ static void createFunction(llvm::Module *module,
   policy(func);
 }
 
+#ifdef BAMQL_KNOWN_BAM_LAYOUT
+/**
+ * The fields of `bam1_core_t`, which is at the start of `bam1_t`. configure
+ * checks that HTSlib lays the structure out this way.
+ */
+enum CoreField {
+  CORE_POS,
+  CORE_TID,
+  CORE_BIN,
+  CORE_QUAL,
+  CORE_L_EXTRANUL,
+  CORE_FLAG,
+  CORE_L_QNAME,
+  CORE_N_CIGAR,
+  CORE_L_QSEQ,
+  CORE_MTID,
+  CORE_MPOS,
+  CORE_ISIZE
+};
+
+/**
+ * The offsets of the fixed-size fields in an undecoded BAM record, after the
+ * block size, as given by the SAM/BAM specification.
+ */
+enum RawField {
+  RAW_TID = 0,
+  RAW_POS = 4,
+  RAW_L_READ_NAME = 8,
+  RAW_QUAL = 9,
+  RAW_BIN = 10,
+  RAW_N_CIGAR = 12,
+  RAW_FLAG = 14,
+  RAW_L_SEQ = 16,
+  RAW_MTID = 20,
+  RAW_MPOS = 24,
+  RAW_ISIZE = 28
+};
+
+/**
+ * Replace the runtime functions that only read a few fields of a read or
+ * header with definitions in the module, so they can be inlined and the loads
+ * optimised along with the rest of the query.
+ */
+static void defineAccessors(llvm::Module *module) {
+  auto &context = module->getContext();
+  auto base_uint8 = llvm::Type::getInt8Ty(context);
+  auto base_uint16 = llvm::Type::getInt16Ty(context);
+  auto base_uint32 = llvm::Type::getInt32Ty(context);
+  auto base_uint64 = llvm::Type::getInt64Ty(context);
+  auto core_type = llvm::StructType::create(
+      context,
+      { base_uint64, base_uint32, base_uint16, base_uint8, base_uint8,
+        base_uint16, base_uint16, base_uint32, base_uint32, base_uint32,
+        base_uint64, base_uint64 },
+      "struct.bam1_core_t");
+
+  auto define = [&](const char *name,
+                    std::function<llvm::Value *(llvm::IRBuilder<> &,
+                                                llvm::Value **)> body) {
+    auto func = module->getFunction(name);
+    func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+    func->addFnAttr(llvm::Attribute::AlwaysInline);
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", func));
+    std::vector<llvm::Value *> args;
+    for (auto &arg : func->args()) {
+      args.push_back(&arg);
+    }
+    builder.CreateRet(body(builder, args.data()));
+  };
+  auto load = [&](llvm::IRBuilder<> &builder, llvm::Value *read,
+                  CoreField field) {
+    return builder.CreateLoad(core_type->getElementType(field),
+                              builder.CreateStructGEP(core_type, read, field));
+  };
+  // Undecoded records are packed, so the fields may not be aligned.
+  auto load_raw = [&](llvm::IRBuilder<> &builder, llvm::Value *record,
+                      RawField field, llvm::Type *type) {
+    return builder.CreateAlignedLoad(
+        type,
+        builder.CreateConstInBoundsGEP1_32(base_uint8, record, field),
+        llvm::MaybeAlign(1));
+  };
+  // n_targets is the first field of the header.
+  auto load_targets = [&](llvm::IRBuilder<> &builder, llvm::Value *header) {
+    return builder.CreateLoad(base_uint32, header);
+  };
+
+  auto check_mapping_quality = [&](llvm::IRBuilder<> &builder,
+                                   llvm::Value *qual, llvm::Value *minimum) {
+    return builder.CreateAnd(
+        builder.CreateICmpNE(qual, llvm::ConstantInt::get(base_uint8, 255)),
+        builder.CreateICmpUGE(qual, minimum));
+  };
+  auto check_split_pair = [&](llvm::IRBuilder<> &builder,
+                              llvm::Value *targets, llvm::Value *tid,
+                              llvm::Value *mtid) {
+    return builder.CreateAnd(
+        builder.CreateAnd(builder.CreateICmpSLT(tid, targets),
+                          builder.CreateICmpSLT(mtid, targets)),
+        builder.CreateICmpNE(tid, mtid));
+  };
+  auto is_negative = [&](llvm::IRBuilder<> &builder, llvm::Value *value) {
+    return builder.CreateICmpSLT(value,
+                                 llvm::ConstantInt::get(base_uint32, 0));
+  };
+
+  define("bamql_check_mapping_quality",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           return check_mapping_quality(
+               builder, load(builder, args[0], CORE_QUAL), args[1]);
+         });
+  define("bamql_check_split_pair",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           return check_split_pair(builder, load_targets(builder, args[0]),
+                                   load(builder, args[1], CORE_TID),
+                                   load(builder, args[1], CORE_MTID));
+         });
+  define("bamql_flags", [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+    return builder.CreateZExt(load(builder, args[0], CORE_FLAG), base_uint32);
+  });
+  define("bamql_insert_reversed",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           // The runtime reads the insert size as a 32-bit signed number.
+           return is_negative(
+               builder, builder.CreateTrunc(load(builder, args[0], CORE_ISIZE),
+                                            base_uint32));
+         });
+
+  // The same accessors over undecoded BAM records, which are little-endian.
+  if (!llvm::sys::IsLittleEndianHost) {
+    return;
+  }
+  auto base_bool = llvm::Type::getInt1Ty(context);
+  auto base_str = llvm::PointerType::get(base_uint8, 0);
+  auto ptr_bam_hdr_t = llvm::PointerType::get(
+      llvm::StructType::getTypeByName(context, "struct.bam_hdr_t"), 0);
+  createFunction(module, "bamql_check_mapping_quality_raw",
+                 PureReadArgNoRecurse, base_bool, { base_str, base_uint8 });
+  createFunction(module, "bamql_check_split_pair_raw", PureReadArgNoRecurse,
+                 base_bool, { ptr_bam_hdr_t, base_str });
+  createFunction(module, "bamql_flags_raw", PureReadArgNoRecurse, base_uint32,
+                 { base_str });
+  createFunction(module, "bamql_insert_reversed_raw", PureReadArgNoRecurse,
+                 base_bool, { base_str });
+  define("bamql_check_mapping_quality_raw",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           return check_mapping_quality(
+               builder, load_raw(builder, args[0], RAW_QUAL, base_uint8),
+               args[1]);
+         });
+  define("bamql_check_split_pair_raw",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           return check_split_pair(
+               builder, load_targets(builder, args[0]),
+               load_raw(builder, args[1], RAW_TID, base_uint32),
+               load_raw(builder, args[1], RAW_MTID, base_uint32));
+         });
+  define("bamql_flags_raw",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           return builder.CreateZExt(
+               load_raw(builder, args[0], RAW_FLAG, base_uint16), base_uint32);
+         });
+  define("bamql_insert_reversed_raw",
+         [&](llvm::IRBuilder<> &builder, llvm::Value **args) {
+           return is_negative(
+               builder, load_raw(builder, args[0], RAW_ISIZE, base_uint32));
+         });
+}
+#endif
+
+bool isCoreAccessor(const std::string &name) {
+#ifdef BAMQL_KNOWN_BAM_LAYOUT
+  static const std::set<std::string> accessors{ "bamql_check_mapping_quality",
+                                                "bamql_check_split_pair",
+                                                "bamql_flags",
+                                                "bamql_insert_reversed" };
+  return accessors.count(name) > 0;
+#else
+  return false;
+#endif
+}
+
 llvm::Type *getRuntimeType(llvm::Module *module, llvm::StringRef name) {
   auto struct_ty = llvm::StructType::getTypeByName(module->getContext(), name);
   if (struct_ty == nullptr) {
@@ -60,10 +245,13 @@ llvm::Type *getRuntimeType(llvm::Module *module, llvm::StringRef name) {
     auto base_bool = llvm::IntegerType::get(module->getContext(), 1);
     auto base_uint8 = llvm::IntegerType::get(module->getContext(), 8);
     auto base_uint32 = llvm::IntegerType::get(module->getContext(), 32);
+    auto base_uint64 = llvm::IntegerType::get(module->getContext(), 64);
     auto ptr_uint32 = llvm::PointerType::get(base_uint32, 0);
     auto base_str = llvm::PointerType::get(base_uint8, 0);
     auto base_double = llvm::Type::getDoubleTy(module->getContext());
     auto ptr_double = llvm::PointerType::get(base_double, 0);
+    auto base_size =
+        llvm::IntegerType::get(module->getContext(), sizeof(size_t) * 8);
 
     createFunction(module, "bamql_aux_fp", NoRecurse, base_bool,
                    { ptr_bam1_t, base_uint8, base_uint8, ptr_double });
@@ -90,6 +278,12 @@ llvm::Type *getRuntimeType(llvm::Module *module, llvm::StringRef name) {
                    { ptr_bam1_t });
     createFunction(module, "bamql_header", PureReadArg, base_str,
                    { ptr_bam1_t });
+    createFunction(module, "bamql_header_chromosome", PureReadArg, base_bool,
+                   { ptr_bam_hdr_t, base_str });
+    createFunction(module, "bamql_header_read_group", PureReadArg, base_bool,
+                   { ptr_bam_hdr_t, base_str });
+    createFunction(module, "bamql_header_read_group_id", PureReadArg,
+                   base_bool, { ptr_bam_hdr_t, base_str });
     createFunction(module, "bamql_insert_size", PureReadArg, base_uint32,
                    { ptr_bam1_t, getErrorHandlerType(module), base_str });
     createFunction(module, "bamql_insert_reversed", PureReadArgNoRecurse,
@@ -97,35 +291,70 @@ llvm::Type *getRuntimeType(llvm::Module *module, llvm::StringRef name) {
     createFunction(
         module, "bamql_mate_position_begin", PureReadArg, base_uint32,
         { ptr_bam_hdr_t, ptr_bam1_t, getErrorHandlerType(module), base_str });
+    createFunction(module, "bamql_memo_new", NoRecurse, base_str, {});
+    createFunction(module, "bamql_name_set_contains", PureReadArg, base_bool,
+                   { base_str, base_str });
+    createFunction(module, "bamql_name_set_load", NoRecurse, base_str,
+                   { base_str });
     createFunction(module, "bamql_position_begin", PureReadArg, base_bool,
                    { ptr_bam_hdr_t, ptr_bam1_t, ptr_uint32 });
     createFunction(module, "bamql_position_end", PureReadArg, base_bool,
                    { ptr_bam_hdr_t, ptr_bam1_t, ptr_uint32 });
-    createFunction(module, "bamql_randomly", MutateInaccessible, base_bool,
-                   { base_double });
+    createFunction(module, "bamql_randomly", ReadOnlyNoRecurse, base_bool,
+                   { ptr_bam1_t, base_double, base_uint32 });
+    createFunction(module, "bamql_randomly_by_name", PureReadArgNoRecurse,
+                   base_bool, { ptr_bam1_t, base_double, base_uint32 });
     createFunction(module, "bamql_re_match", PureReadArg, base_bool,
                    { base_str, base_str });
+    createFunction(module, "bamql_re_match_memo", NoRecurse, base_bool,
+                   { base_str, base_str, base_str });
+    createFunction(module, "bamql_scratch_mark", NoRecurse, base_uint64, {});
+    createFunction(module, "bamql_str_hash", PureReadArgNoRecurse, base_uint32,
+                   { base_str, base_uint32 });
     createFunction(module, "bamql_strcmp", PureReadArg, base_uint32,
                    { base_str, base_str });
     createFunction(module, "bamql_re_compile", PureReadArg, base_str,
                    { base_str, base_uint32, base_uint32 });
+    createFunction(module, "memcmp", PureReadArgNoRecurse, base_uint32,
+                   { base_str, base_str, base_size });
+    createFunction(module, "strlen", PureReadArgNoRecurse, base_size,
+                   { base_str });
+    createFunction(module, "strncasecmp", PureReadArgNoRecurse, base_uint32,
+                   { base_str, base_str, base_size });
+    createFunction(module, "strncmp", PureReadArgNoRecurse, base_uint32,
+                   { base_str, base_str, base_size });
+    createFunction(module, "strstr", PureReadArgNoRecurse, base_str,
+                   { base_str, base_str });
 
-    llvm::Type *pcre_free_args[] = { base_str };
-    llvm::Function::Create(
-        llvm::FunctionType::get(llvm::Type::getVoidTy(module->getContext()),
-                                pcre_free_args, false),
-        llvm::GlobalValue::ExternalLinkage, "pcre_free_substring", module);
     llvm::Type *bamql_re_free_args[] = { llvm::PointerType::get(base_str, 0) };
     llvm::Function::Create(
         llvm::FunctionType::get(llvm::Type::getVoidTy(module->getContext()),
                                 bamql_re_free_args, false),
         llvm::GlobalValue::ExternalLinkage, "bamql_re_free", module);
+    llvm::Type *memo_free_args[] = { llvm::PointerType::get(base_str, 0) };
+    llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(module->getContext()),
+                                memo_free_args, false),
+        llvm::GlobalValue::ExternalLinkage, "bamql_memo_free", module);
+    llvm::Type *scratch_release_args[] = { base_uint64 };
+    llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(module->getContext()),
+                                scratch_release_args, false),
+        llvm::GlobalValue::ExternalLinkage, "bamql_scratch_release", module);
+    llvm::Type *name_set_free_args[] = { llvm::PointerType::get(base_str, 0) };
+    llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(module->getContext()),
+                                name_set_free_args, false),
+        llvm::GlobalValue::ExternalLinkage, "bamql_name_set_free", module);
     llvm::Type *re_bind_args[] = { base_str, base_uint32,
                                    getErrorHandlerType(module), base_str,
                                    base_str };
     llvm::Function::Create(
         llvm::FunctionType::get(base_bool, re_bind_args, true),
         llvm::GlobalValue::ExternalLinkage, "bamql_re_bind", module);
+#ifdef BAMQL_KNOWN_BAM_LAYOUT
+    defineAccessors(module);
+#endif
 
     struct_ty = llvm::StructType::getTypeByName(module->getContext(), name);
     if (struct_ty == nullptr) {
@@ -18,9 +18,11 @@
 #include "ast_node_contains.hpp"
 #include "ast_node_if.hpp"
 #include "ast_node_loop.hpp"
+#include "ast_node_name_set.hpp"
 #include "ast_node_regex.hpp"
 #include "bamql-compiler.hpp"
 #include "compiler.hpp"
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <vector>
@@ -128,6 +130,21 @@ static std::shared_ptr<AstNode> parseComparison(ParseState &state) {
     auto pattern = state.parseRegEx();
     return std::make_shared<RegexNode>(left, std::move(pattern), state);
   }
+  if (state.parseKeyword("in_file")) {
+    if (left->type() != STR) {
+      throw ParseError(state.where(),
+                       "Name lists may only be used on strings.");
+    }
+    state.parseCharInSpace('(');
+    auto file_start = state.where();
+    auto file_name = state.parseQuoted();
+    // The list itself is read when the query is loaded.
+    if (!std::ifstream(file_name)) {
+      throw ParseError(file_start, "Cannot read file: " + file_name);
+    }
+    state.parseCharInSpace(')');
+    return std::make_shared<NameSetNode>(left, file_name, state);
+  }
   if (state.parseKeyword("\\")) {
     if (left->type() != INT) {
       throw ParseError(state.where(), "Type mismatch.");
@@ -75,6 +75,10 @@ std::shared_ptr<AstNode> ParseState::parseLiteral() {
         LiteralNode<int, decltype(&make_int), &make_int, INT>>(c);
   }
 
+  if (input[index] == '"') {
+    return std::make_shared<StrConst>(parseQuoted());
+  }
+
   if (!isdigit(input[index]) && input[index] != '-') {
     return nullptr;
   }
@@ -135,6 +139,29 @@ double ParseState::parseDouble() {
   }
   return result;
 }
+std::string ParseState::parseQuoted() {
+  if (index >= input.length() || input[index] != '"') {
+    throw ParseError(index, "Expected `\"'.");
+  }
+  size_t start = index;
+  std::string result;
+  next();
+  while (index < input.length() && input[index] != '"') {
+    if (input[index] == '\\') {
+      next();
+      if (index >= input.length()) {
+        break;
+      }
+    }
+    result.push_back(input[index]);
+    next();
+  }
+  if (index >= input.length()) {
+    throw ParseError(start, "Unterminated string.");
+  }
+  next();
+  return result;
+}
 std::string ParseState::parseStr(const std::string &accept_chars, bool reject) {
   size_t start = index;
   while (index < input.length() &&
@@ -16,6 +16,9 @@
 
 #include "ast_node_regex.hpp"
 #include "bamql-compiler.hpp"
+#include "compiler.hpp"
+#include "dfa.hpp"
+#include <cstring>
 #include <pcre.h>
 #include <sstream>
 
@@ -52,34 +55,287 @@ static bamql::RegularExpression createPCRE(const std::string &input,
     names[name_table + 2] = (name_table[0] << 8) + name_table[1];
   }
 
-  return [=](bamql::GenerateState &state) {
-    auto base_int32 = llvm::Type::getInt32Ty(state.module()->getContext());
-    auto base_str = llvm::PointerType::get(
-        llvm::Type::getInt8Ty(state.module()->getContext()), 0);
-    auto null_value = llvm::ConstantPointerNull::get(base_str);
-    auto compile_func = state.module()->getFunction("bamql_re_compile");
-    auto free_func = state.module()->getFunction("bamql_re_free");
-    auto var = new llvm::GlobalVariable(*state.module(), base_str, false,
-                                        llvm::GlobalVariable::PrivateLinkage, 0,
-                                        ".regex");
-    var->setInitializer(null_value);
-    llvm::Value *construct_args[] = { state.getGenerator().createString(input),
-                                      llvm::ConstantInt::get(base_int32, flags),
-                                      llvm::ConstantInt::get(base_int32,
-                                                             name_count) };
-    state.getGenerator().constructor()->CreateStore(
-        state.getGenerator().constructor()->CreateCall(compile_func,
-                                                       construct_args),
-        var);
-    llvm::Value *free_args[] = { var };
-    state.getGenerator().destructor()->CreateCall(free_func, free_args);
-
-    return state->CreateLoad(base_str, var);
+  return bamql::RegularExpression(input, flags, name_count);
+}
+
+/**
+ * Check if a regular expression is a literal string, possibly anchored at the
+ * start and end.
+ */
+static bool parseLiteralPattern(const std::string &pattern,
+                                bool &start,
+                                bool &end,
+                                std::string &literal) {
+  size_t it = 0;
+  start = pattern.compare(it, 1, "^") == 0;
+  if (start) {
+    it++;
+  }
+  if (pattern.compare(it, 2, ".*") == 0) {
+    start = false;
+    it += 2;
+  }
+  while (it < pattern.length()) {
+    if (pattern[it] == '\\') {
+      if (it + 1 >= pattern.length() || isalnum(pattern[it + 1])) {
+        return false;
+      }
+      literal.push_back(pattern[it + 1]);
+      it += 2;
+    } else if (strchr("^$.[]|()?*+{}", pattern[it]) != nullptr) {
+      break;
+    } else {
+      literal.push_back(pattern[it]);
+      it++;
+    }
+  }
+  auto rest = pattern.substr(it);
+  end = rest == "$";
+  return rest == "" || rest == "$" || rest == ".*" || rest == ".*$";
+}
+
+/**
+ * Generate a check that is only done if a condition is true; if the condition
+ * is false, the result is false.
+ */
+static llvm::Value *generateGuarded(bamql::GenerateState &state,
+                                    llvm::Value *condition,
+                                    std::function<llvm::Value *()> check) {
+  auto &context = state.module()->getContext();
+  auto function = state->GetInsertBlock()->getParent();
+  auto guard_block = state->GetInsertBlock();
+  auto check_block = llvm::BasicBlock::Create(context, "check", function);
+  auto merge_block = llvm::BasicBlock::Create(context, "merge", function);
+  state->CreateCondBr(condition, check_block, merge_block);
+  state->SetInsertPoint(check_block);
+  auto result = check();
+  check_block = state->GetInsertBlock();
+  state->CreateBr(merge_block);
+  state->SetInsertPoint(merge_block);
+  auto phi = state->CreatePHI(llvm::Type::getInt1Ty(context), 2);
+  phi->addIncoming(llvm::ConstantInt::getFalse(context), guard_block);
+  phi->addIncoming(result, check_block);
+  return phi;
+}
+
+/**
+ * Call a C string function taking two strings and a length and check that it
+ * returns zero.
+ */
+static llvm::Value *generateCompareN(bamql::GenerateState &state,
+                                     const char *function,
+                                     llvm::Value *input,
+                                     const std::string &literal,
+                                     size_t length) {
+  auto &context = state.module()->getContext();
+  llvm::Value *args[] = {
+    input, state.createString(literal),
+    llvm::ConstantInt::get(llvm::Type::getIntNTy(context, sizeof(size_t) * 8),
+                           length)
   };
+  return state->CreateICmpEQ(
+      state->CreateCall(state.module()->getFunction(function), args),
+      llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), 0));
 }
 
 namespace bamql {
 
+RegularExpression::RegularExpression() : flags(0), captures(0), kind(NONE) {}
+RegularExpression::RegularExpression(const std::string &pattern_,
+                                     int flags_,
+                                     int captures_)
+    : pattern(pattern_), flags(flags_), captures(captures_), kind(NONE) {
+  int erroroffset = 0;
+  const char *error = nullptr;
+  compiled = std::shared_ptr<void>(
+      pcre_compile(pattern.c_str(), flags, &error, &erroroffset, nullptr),
+      pcre_free);
+  bool start;
+  bool end;
+  if (captures > 0) {
+    return;
+  }
+  if (!parseLiteralPattern(pattern, start, end, literal)) {
+    literal.clear();
+    dfa = DFA::compile(pattern, flags & PCRE_CASELESS);
+    return;
+  }
+  if (start) {
+    kind = end ? EXACT : PREFIX;
+  } else if (end) {
+    kind = SUFFIX;
+  } else if (!(flags & PCRE_CASELESS)) {
+    kind = CONTAINS;
+  } else {
+    dfa = DFA::compile(pattern, true);
+  }
+}
+
+llvm::Value *RegularExpression::operator()(GenerateState &state) const {
+  auto base_int32 = llvm::Type::getInt32Ty(state.module()->getContext());
+  auto base_str = llvm::PointerType::get(
+      llvm::Type::getInt8Ty(state.module()->getContext()), 0);
+  auto compile_func = state.module()->getFunction("bamql_re_compile");
+  auto free_func = state.module()->getFunction("bamql_re_free");
+  // The same pattern is compiled once, however many times it is used.
+  std::stringstream key;
+  key << "regex " << flags << " " << captures << " " << pattern;
+  auto var = state.getGenerator().createShared(
+      key.str(),
+      [&](llvm::IRBuilder<> &constructor) -> llvm::Value * {
+        llvm::Value *construct_args[] = {
+          state.getGenerator().createString(pattern),
+          llvm::ConstantInt::get(base_int32, flags),
+          llvm::ConstantInt::get(base_int32, captures)
+        };
+        return constructor.CreateCall(compile_func, construct_args);
+      },
+      free_func);
+
+  return state->CreateLoad(base_str, var);
+}
+
+llvm::Value *RegularExpression::match(GenerateState &state,
+                                      llvm::Value *input,
+                                      bool memoize) const {
+  bool caseless = flags & PCRE_CASELESS;
+  auto &context = state.module()->getContext();
+  auto size_type = llvm::Type::getIntNTy(context, sizeof(size_t) * 8);
+  switch (kind) {
+  case EXACT:
+    if (!caseless) {
+      return generateStrEquals(state, input, literal);
+    }
+    return generateGuarded(state, state->CreateIsNotNull(input), [&]() {
+      return generateCompareN(state, "strncasecmp", input, literal,
+                              literal.length() + 1);
+    });
+  case PREFIX:
+    return generateGuarded(state, state->CreateIsNotNull(input), [&]() {
+      return generateCompareN(state, caseless ? "strncasecmp" : "strncmp",
+                              input, literal, literal.length());
+    });
+  case SUFFIX:
+    return generateGuarded(state, state->CreateIsNotNull(input), [&]() {
+      llvm::Value *length_args[] = { input };
+      auto length = state->CreateCall(state.module()->getFunction("strlen"),
+                                      length_args);
+      auto literal_length = llvm::ConstantInt::get(size_type, literal.length());
+      return generateGuarded(
+          state, state->CreateICmpUGE(length, literal_length), [&]() {
+            auto tail = state->CreateInBoundsGEP(
+                llvm::Type::getInt8Ty(context), input,
+                state->CreateSub(length, literal_length));
+            return generateCompareN(state, caseless ? "strncasecmp" : "memcmp",
+                                    tail, literal, literal.length());
+          });
+    });
+  case CONTAINS:
+    return generateGuarded(state, state->CreateIsNotNull(input), [&]() {
+      llvm::Value *args[] = { input, state.createString(literal) };
+      return state->CreateIsNotNull(
+          state->CreateCall(state.module()->getFunction("strstr"), args));
+    });
+  default: {
+    if (dfa) {
+      return dfa->match(state, input);
+    }
+    if (!memoize) {
+      llvm::Value *args[] = { (*this)(state), input };
+      return state->CreateCall(state.module()->getFunction("bamql_re_match"),
+                               args);
+    }
+    /* Keep a memo of the results, created with the module. */
+    auto base_str = llvm::PointerType::get(llvm::Type::getInt8Ty(context), 0);
+    std::stringstream key;
+    key << "memo " << flags << " " << pattern;
+    auto memo = state.getGenerator().createShared(
+        key.str(),
+        [&](llvm::IRBuilder<> &constructor) -> llvm::Value * {
+          return constructor.CreateCall(
+              state.module()->getFunction("bamql_memo_new"));
+        },
+        state.module()->getFunction("bamql_memo_free"));
+    llvm::Value *args[] = { (*this)(state), state->CreateLoad(base_str, memo),
+                            input };
+    return state->CreateCall(
+        state.module()->getFunction("bamql_re_match_memo"), args);
+  }
+  }
+}
+
+bool RegularExpression::matches(const std::string &input) const {
+  return compiled &&
+         pcre_exec((pcre *)compiled.get(), nullptr, input.c_str(),
+                   input.length(), 0, 0, nullptr, 0) >= 0;
+}
+
+std::string RegularExpression::describe() const {
+  return "/" + pattern + "/" + ((flags & PCRE_CASELESS) ? "i" : "");
+}
+
+std::string RegularExpression::method() const {
+  switch (kind) {
+  case EXACT:
+    return "string comparison";
+  case PREFIX:
+    return "prefix comparison";
+  case SUFFIX:
+    return "suffix comparison";
+  case CONTAINS:
+    return "substring search";
+  default:
+    return dfa ? "automaton" : "PCRE";
+  }
+}
+
+double RegularExpression::cost() const {
+  switch (kind) {
+  case EXACT:
+  case PREFIX:
+    return 2;
+  case SUFFIX:
+  case CONTAINS:
+    return 4;
+  default:
+    return dfa ? 8 : 32;
+  }
+}
+
+std::shared_ptr<DFA> RegularExpression::combine(
+    const std::vector<const RegularExpression *> &patterns) {
+  std::vector<std::pair<std::string, bool>> sources;
+  for (auto pattern : patterns) {
+    if (pattern->captures > 0) {
+      return nullptr;
+    }
+    sources.push_back(
+        std::make_pair(pattern->pattern, pattern->flags & PCRE_CASELESS));
+  }
+  return DFA::compile(sources);
+}
+
+llvm::Value *generateStrEquals(GenerateState &state,
+                               llvm::Value *input,
+                               const std::string &literal) {
+  auto base_uint8 = llvm::Type::getInt8Ty(state.module()->getContext());
+  /* Check the first character inline, so most strings that differ are
+   * rejected without a call, then compare no more than the length of the
+   * literal. */
+  return generateGuarded(state, state->CreateIsNotNull(input), [&]() {
+    auto first_matches = state->CreateICmpEQ(
+        state->CreateLoad(base_uint8, input),
+        llvm::ConstantInt::get(base_uint8, (unsigned char)literal.c_str()[0]));
+    if (literal.empty()) {
+      return first_matches;
+    }
+    return generateGuarded(state, first_matches, [&]() {
+      return generateCompareN(state, "strncmp", input, literal,
+                              literal.length() + 1);
+    });
+  });
+}
+
 RegularExpression ParseState::parseRegEx(std::map<std::string, int> &names) {
   auto start = index;
   index++;
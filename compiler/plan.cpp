@@ -0,0 +1,74 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql-compiler.hpp"
+
+namespace bamql {
+void QueryPlan::add(AstNode *node,
+                    const std::string &description,
+                    double cost) {
+  std::string line(2 * depth, ' ');
+  line += description;
+  if (node != nullptr) {
+    if (node->usesIndex()) {
+      line += " [index]";
+    }
+    if (node->coreOnly()) {
+      line += " [fixed-size fields only]";
+    }
+  }
+  lines.push_back(line);
+  total_cost += cost * scale;
+}
+void QueryPlan::add(AstNode *node,
+                    const std::string &description,
+                    const std::vector<std::shared_ptr<AstNode>> &children,
+                    double cost) {
+  add(node, description, cost);
+  nest([&]() {
+    for (auto &child : children) {
+      child->explain(*this);
+    }
+  });
+}
+void QueryPlan::nest(const std::function<void()> &children, double repeat) {
+  auto old_scale = scale;
+  depth++;
+  scale *= repeat;
+  children();
+  scale = old_scale;
+  depth--;
+}
+void QueryPlan::decode(const std::string &field) { fields.insert(field); }
+double QueryPlan::cost() const { return total_cost; }
+void QueryPlan::write(std::ostream &output) const {
+  for (auto &line : lines) {
+    output << "  " << line << std::endl;
+  }
+  output << "Decoded from each read:";
+  if (fields.empty()) {
+    output << " nothing";
+  }
+  bool first = true;
+  for (auto &field : fields) {
+    output << (first ? " " : ", ") << field;
+    first = false;
+  }
+  output << std::endl;
+  output << "Estimated cost per read: at most " << total_cost
+         << " (reading one fixed-size field costs 1)" << std::endl;
+}
+} // namespace bamql
@@ -67,6 +67,42 @@ protected:
   }
 };
 
+/**
+ * An optional integer seed following the other arguments, which is zero if
+ * absent.
+ */
+class SeedArg final : public FunctionArg {
+public:
+  SeedArg() {}
+  void nextArg(ParseState &state,
+               size_t &pos,
+               std::vector<std::shared_ptr<AstNode>> &args) const {
+    state.parseSpace();
+    int seed = 0;
+    if (!state.empty() && *state == ',') {
+      state.next();
+      state.parseSpace();
+      seed = state.parseInt();
+    }
+    pos++;
+    args.push_back(std::make_shared<IntConst>(seed));
+  }
+};
+
+/**
+ * Where the function appears in the query, so that each use of it gets its
+ * own random numbers.
+ */
+class SiteArg final : public FunctionArg {
+public:
+  SiteArg() {}
+  void nextArg(ParseState &state,
+               size_t &pos,
+               std::vector<std::shared_ptr<AstNode>> &args) const {
+    args.push_back(std::make_shared<IntConst>(state.where()));
+  }
+};
+
 static std::shared_ptr<BoolConst> falseNode(new BoolConst(false));
 static std::shared_ptr<BoolConst> trueNode(new BoolConst(true));
 
@@ -83,6 +119,8 @@ static const IntArg int_max_arg(INT32_MAX);
 static const IntArg int_zero_arg(0);
 static const FixedProbabilityArg fixed_probability_arg;
 static const MappingQualityArg mapping_quality_arg;
+static const SeedArg seed_arg;
+static const SiteArg site_arg;
 static const std::vector<bamql::RawFunctionArg> RAW_FLAG_ARGS{
   bamql::RawFunctionArg::READ
 };
@@ -249,9 +287,16 @@ PredicateMap getDefaultPredicates() {
       parseFunction<BoolFunctionNode>(
           "bamql_check_split_pair",
           { RawFunctionArg::HEADER, RawFunctionArg::READ }, {}) },
-    { "random", parseFunction<BoolFunctionNode>("bamql_randomly",
-                                                { RawFunctionArg::USER },
-                                                { fixed_probability_arg }) },
+    { "random",
+      parseFunction<BoolFunctionNode>(
+          "bamql_randomly",
+          { RawFunctionArg::READ, RawFunctionArg::USER, RawFunctionArg::USER },
+          { fixed_probability_arg, site_arg }) },
+    { "random_by_name",
+      parseFunction<BoolFunctionNode>(
+          "bamql_randomly_by_name",
+          { RawFunctionArg::READ, RawFunctionArg::USER },
+          { fixed_probability_arg, seed_arg }) },
   };
 }
 } // namespace bamql
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql-compiler.hpp"
+#include <iomanip>
+#include <llvm/IR/Instructions.h>
+#include <sys/resource.h>
+
+/**
+ * The most memory the process has used so far, in bytes.
+ */
+static size_t peakMemory() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss * 1024;
+}
+
+namespace bamql {
+static const char *phase_names[CompileReport::PHASE_COUNT] = {
+  "parse",
+  "generate IR",
+  "optimise IR",
+  "generate machine code and link",
+  "initialise (module constructors)"
+};
+
+CompileReport::Timer::Timer(const std::shared_ptr<CompileReport> &report_,
+                            Phase phase)
+    : report(report_.get()) {
+  if (report != nullptr) {
+    outer = report->current;
+    report->enter(phase);
+  }
+}
+
+CompileReport::Timer::~Timer() {
+  if (report != nullptr) {
+    report->enter(outer);
+  }
+}
+
+void CompileReport::enter(Phase phase) {
+  auto now = std::chrono::steady_clock::now();
+  auto peak = peakMemory();
+  if (current != PHASE_COUNT) {
+    times[current] += now - last;
+    peak_growth[current] += peak - last_peak;
+  }
+  current = phase;
+  last = now;
+  last_peak = peak;
+}
+
+void CompileReport::countInstructions(llvm::Module &module, bool optimised) {
+  if (!optimised) {
+    modules++;
+  }
+  for (auto &function : module) {
+    if (function.isDeclaration()) {
+      continue;
+    }
+    size_t count = 0;
+    for (auto &block : function) {
+      for (auto &instruction : block) {
+        count++;
+        // Each call in a constructor compiles a pattern when the module is
+        // initialised.
+        if (!optimised) {
+          if (auto call = llvm::dyn_cast<llvm::CallInst>(&instruction)) {
+            auto callee = call->getCalledFunction();
+            if (callee != nullptr && callee->getName() == "bamql_re_compile") {
+              regexes++;
+            }
+          }
+        }
+      }
+    }
+    auto &counts = instructions[function.getName().str()];
+    (optimised ? counts.second : counts.first) += count;
+  }
+}
+
+void CompileReport::write(std::ostream &output) const {
+  std::chrono::steady_clock::duration total_time{};
+  output << "Compilation phase\tmilliseconds\tpeak memory growth (KiB)"
+         << std::endl;
+  for (size_t it = 0; it < PHASE_COUNT; it++) {
+    total_time += times[it];
+    output << phase_names[it] << "\t" << std::fixed << std::setprecision(3)
+           << std::chrono::duration<double, std::milli>(times[it]).count()
+           << "\t" << peak_growth[it] / 1024 << std::endl;
+  }
+  output << "total\t"
+         << std::chrono::duration<double, std::milli>(total_time).count()
+         << "\t" << peakMemory() / 1024 << " (peak)" << std::endl;
+  output << "Function\tgenerated instructions\toptimised instructions"
+         << std::endl;
+  size_t total_generated = 0;
+  size_t total_optimised = 0;
+  for (auto &function : instructions) {
+    total_generated += function.second.first;
+    total_optimised += function.second.second;
+    output << function.first << "\t" << function.second.first << "\t"
+           << function.second.second << std::endl;
+  }
+  output << "total (" << modules << " modules)\t" << total_generated << "\t"
+         << total_optimised << std::endl;
+  output << "Regular expressions compiled when loaded: " << regexes
+         << std::endl;
+}
+} // namespace bamql
@@ -15,11 +15,17 @@
  */
 
 #pragma once
+#include <htslib/bgzf.h>
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
 
-#define BAMQL_ITERARTOR_API_VERSION 2
+#define BAMQL_ITERARTOR_API_VERSION 6
 namespace bamql {
 
 /**
@@ -37,22 +43,194 @@ typedef bool (*FilterFunction)(bam_hdr_t *, bam1_t *, ErrorHandler, void *);
  */
 typedef bool (*IndexFunction)(bam_hdr_t *, uint32_t, ErrorHandler, void *);
 
+/**
+ * The run-time type of a filter over an array of reads. Whether each read
+ * matches is stored in the array of flags and the result is whether any did.
+ */
+typedef bool (*BatchFunction)(
+    bam_hdr_t *, bam1_t **, uint8_t *, size_t, ErrorHandler, void *);
+
+/**
+ * The run-time type of a filter over the fixed-size fields of an undecoded
+ * BAM record.
+ */
+typedef bool (*RawFilterFunction)(bam_hdr_t *,
+                                  const uint8_t *,
+                                  ErrorHandler,
+                                  void *);
+
+/**
+ * The run-time type of a check of whether any read in a file could match,
+ * given its header.
+ */
+typedef bool (*HeaderFunction)(bam_hdr_t *, ErrorHandler, void *);
+
+/**
+ * Throughput and timing information collected while processing files, which
+ * is periodically written to a file for monitoring.
+ */
+class Metrics {
+public:
+  /**
+   * The parts of processing that are timed separately.
+   */
+  enum Stage { DECODE, FILTER, WRITE, SEEK, STAGE_COUNT };
+  /**
+   * Measure the time spent in a stage for as long as this object exists. If
+   * no metrics are being collected, this does nothing.
+   */
+  class Timer {
+  public:
+    Timer(std::shared_ptr<Metrics> &metrics, Stage stage);
+    ~Timer();
+
+  private:
+    Metrics *metrics;
+    Stage stage;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  /**
+   * @param path: the file to write. If the name ends in `.prom`, it is
+   * written in the Prometheus text format; otherwise, as JSON.
+   * @param interval: the minimum number of seconds between writes.
+   */
+  Metrics(const std::string &path, double interval);
+  /**
+   * Start measuring progress through a newly opened file.
+   */
+  void startFile(const char *file_name, htsFile *input);
+  /**
+   * Stop measuring progress through the current file and write the metrics.
+   */
+  void finishFile();
+  void add(Stage stage, std::chrono::steady_clock::duration time);
+  /**
+   * Count a read and write the metrics if enough time has passed.
+   */
+  void countRead();
+  void write();
+
+private:
+  void updateBytes();
+  std::string path;
+  double interval;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point last_write;
+  std::chrono::steady_clock::duration stages[STAGE_COUNT] = {};
+  std::string file_name;
+  BGZF *bgzf = nullptr;
+  struct hFILE *hfile = nullptr;
+  size_t file_size = 0;
+  size_t reads = 0;
+  size_t base_compressed = 0;
+  size_t base_uncompressed = 0;
+  size_t compressed_bytes = 0;
+  size_t uncompressed_bytes = 0;
+  double progress = 0;
+};
+
+/**
+ * A recycling allocator for reads. Reads and their data buffers are carved
+ * out of large arenas and return to the pool when the last reference to them
+ * is dropped, so reading, filtering, and writing do not allocate once the
+ * pool is warm. When HTSlib has to give a read a bigger buffer, the buffers
+ * handed out from then on are sized from the reads seen so far and the read
+ * gets one of them back. The pool must outlive every
+ * read acquired from it. It is safe to use from multiple threads.
+ */
+class ReadPool {
+public:
+  /**
+   * @param huge_pages: ask for the arenas to be backed by transparent huge
+   * pages, where the system supports them.
+   */
+  ReadPool(bool huge_pages = false);
+  ~ReadPool();
+  ReadPool(const ReadPool &) = delete;
+  ReadPool &operator=(const ReadPool &) = delete;
+  /**
+   * Get a read. Its contents are whatever was left by its previous use.
+   */
+  std::shared_ptr<bam1_t> acquire();
+
+private:
+  void release(bam1_t *read);
+  void grow();
+  void *map(size_t size);
+  uint8_t *allocateData();
+  std::mutex mutex;
+  bool huge_pages;
+  std::vector<bam1_t *> available;
+  std::vector<bam1_t *> reads;
+  std::vector<std::pair<void *, size_t>> arenas;
+  size_t released = 0;
+  size_t released_bytes = 0;
+  size_t data_size;
+  uint8_t *spare_data = nullptr;
+  size_t spare_count = 0;
+};
+
 /**
  * Iterator over all the reads in a BAM file, using an index if possible.
  */
 class ReadIterator {
 public:
   ReadIterator();
+  /**
+   * Could any read in a file with this header be wanted? If not, the header
+   * is ingested, but no reads are read. By default, every file is wanted.
+   */
+  virtual bool wantFile(std::shared_ptr<bam_hdr_t> &header);
   /**
    * Should the reads on this chromosome be examined?
    */
   virtual bool wantChromosome(std::shared_ptr<bam_hdr_t> &header,
                               uint32_t tid) = 0;
+  /**
+   * Should a read be decoded? This is given the fixed-size fields of a BAM
+   * record, starting from the reference ID, before the read is decoded and
+   * reads that are rejected are never examined. By default, all reads are
+   * wanted. When reads are filtered concurrently, this is called on the thread
+   * decoding the input rather than the one examining reads.
+   */
+  virtual bool wantRawRead(std::shared_ptr<bam_hdr_t> &header,
+                           const uint8_t *record);
   /**
    * Examine a read.
    */
   virtual void processRead(std::shared_ptr<bam_hdr_t> &header,
                            std::shared_ptr<bam1_t> &read) = 0;
+  /**
+   * Examine the first `count` reads in a batch. By default, this processes
+   * each read in turn.
+   */
+  virtual void processBatch(std::shared_ptr<bam_hdr_t> &header,
+                            std::vector<std::shared_ptr<bam1_t>> &reads,
+                            size_t count);
+  /**
+   * Can `filterBatch` be called from several threads at once? If so, and
+   * more than one thread was requested, reads that are not found through an
+   * index are decoded, filtered, and passed to `processFiltered` in parallel,
+   * but in their original order. By default, this is false.
+   */
+  virtual bool canFilterConcurrently();
+  /**
+   * Decide which of the first `count` reads in a batch match, storing a flag
+   * for each. By default, every read matches.
+   */
+  virtual void filterBatch(std::shared_ptr<bam_hdr_t> &header,
+                           std::vector<std::shared_ptr<bam1_t>> &reads,
+                           size_t count,
+                           uint8_t *matches);
+  /**
+   * Examine a batch of reads given the results of `filterBatch`. By default,
+   * this calls `processBatch`.
+   */
+  virtual void processFiltered(std::shared_ptr<bam_hdr_t> &header,
+                               std::vector<std::shared_ptr<bam1_t>> &reads,
+                               size_t count,
+                               const uint8_t *matches);
   /**
    * Examine the header of a new file.
    */
@@ -64,26 +242,133 @@ public:
    * @param ignore_index: Do not use the index even if one is found.
    */
   bool processFile(const char *file_name, bool binary, bool ignore_index);
+  /**
+   * Describe how `processFile` would read a file, using only its header and
+   * index: whether the file is skipped, which chromosomes are read, and about
+   * how many compressed bytes that is. No reads are examined and the header
+   * is not ingested.
+   */
+  bool explainFile(const char *file_name,
+                   bool binary,
+                   bool ignore_index,
+                   std::ostream &output);
+  /**
+   * Collect throughput and timing information while processing files.
+   */
+  void setMetrics(std::shared_ptr<Metrics> &metrics);
+  /**
+   * Allow reads from unindexed BAM files to be views into the decompressed
+   * data rather than copies. A view is only valid until `processRead` or
+   * `processBatch` returns, so only turn this on for iterators that do not
+   * keep reads.
+   */
+  void setZeroCopy(bool zero_copy);
+  /**
+   * Allocate reads from a pool shared with other iterators or stages. By
+   * default, each iterator has its own.
+   */
+  void setReadPool(std::shared_ptr<ReadPool> &pool);
+  /**
+   * Set the number of threads filtering reads that are not found through an
+   * index. With one, the default, everything happens on the calling thread.
+   */
+  void setThreads(size_t threads);
+  /**
+   * Only process one part of each file. The file is divided, through its
+   * index, into `count` parts with about the same number of compressed bytes,
+   * splitting at read start positions, and the one at `index`, starting from
+   * zero, is processed. Reads without a position belong to the last part
+   * and, as for a whole file, are skipped unless every chromosome with reads
+   * is wanted. Concatenating the output of every part, in order, gives the
+   * output for the whole file. A file without an index cannot be split.
+   */
+  void setShard(size_t index, size_t count);
+
+protected:
+  std::shared_ptr<Metrics> metrics;
+  std::shared_ptr<ReadPool> pool;
 
 private:
-  bool wantAll(std::shared_ptr<bam_hdr_t> &header);
+  /**
+   * Find the chromosomes that are wanted, skipping any that the index shows
+   * have no reads. Returns whether every chromosome with reads is wanted.
+   */
+  bool wantedChromosomes(std::shared_ptr<hts_idx_t> &index,
+                         std::shared_ptr<bam_hdr_t> &header,
+                         std::vector<int> &wanted);
+  /**
+   * Move past the unwanted records at the current position in a BAM file.
+   * If `keep_block` is set, this stops before any record that would require
+   * reading the next block. Returns false if the file is truncated.
+   */
+  bool skipRawReads(BGZF *bgzf,
+                    std::shared_ptr<bam_hdr_t> &header,
+                    bool keep_block,
+                    size_t &skipped);
+  /**
+   * Point a view at the record at the current position in a BAM file and move
+   * past it. Returns false, without moving, if the record is not entirely in
+   * the current block or must be decoded by HTSlib.
+   */
+  bool readView(BGZF *bgzf, std::shared_ptr<bam_hdr_t> &header, bam1_t *view);
+  /**
+   * Read the rest of a file with separate threads for decoding, filtering,
+   * and examining the filtered reads in order.
+   */
+  bool processConcurrently(std::shared_ptr<htsFile> &input,
+                           std::shared_ptr<bam_hdr_t> &header);
+  /**
+   * Use the index to process the reads that start in a region.
+   */
+  bool processRegion(std::shared_ptr<htsFile> &input,
+                     std::shared_ptr<hts_idx_t> &index,
+                     std::shared_ptr<bam_hdr_t> &header,
+                     std::vector<std::shared_ptr<bam1_t>> &reads,
+                     int tid,
+                     hts_pos_t begin,
+                     hts_pos_t end);
+  bool processShard(std::shared_ptr<htsFile> &input,
+                    std::shared_ptr<hts_idx_t> &index,
+                    std::shared_ptr<bam_hdr_t> &header,
+                    std::vector<std::shared_ptr<bam1_t>> &reads);
+  void countReads(size_t count);
+  /**
+   * Examine the reads decoded so far and count them.
+   */
+  void flushBatch(std::shared_ptr<bam_hdr_t> &header,
+                  std::vector<std::shared_ptr<bam1_t>> &reads,
+                  size_t count);
+  bool zero_copy = false;
+  size_t threads = 1;
+  size_t shard_index = 0;
+  size_t shard_count = 1;
 };
 
 /**
  * Craft a new BAM header appending information about the manipulations done.
+ * The chromosome names and lengths are shared with the original header, which
+ * is kept alive as long as the new one.
  * @param name: the name of the program doing the manipulation.
  * @param id: a unique ID.
  * @param version: the version of the program doing the manipulation.
  * @param args: the command line arguments passed to this program.
  */
-std::shared_ptr<bam_hdr_t> appendProgramToHeader(const bam_hdr_t *original,
-                                                 const std::string &name,
-                                                 const std::string &id,
-                                                 const std::string &version,
-                                                 const std::string &args);
+std::shared_ptr<bam_hdr_t> appendProgramToHeader(
+    std::shared_ptr<bam_hdr_t> &original,
+    const std::string &name,
+    const std::string &id,
+    const std::string &version,
+    const std::string &args);
 
 std::shared_ptr<htsFile> open(const char *filename, const char *mode);
 
+/**
+ * Join BAM files that share a header, such as the parts of a file written by
+ * iterators given `setShard`, by copying their compressed blocks. The header
+ * of the first file is used.
+ */
+bool concatenate(const std::vector<std::string> &inputs, const char *output);
+
 std::string makeUuid();
 
 int main(int argc,
@@ -43,7 +43,7 @@ public:
 
     if (accept) {
       std::string name("bamql-accept");
-      auto copy = bamql::appendProgramToHeader(header.get(), name, id_str,
+      auto copy = bamql::appendProgramToHeader(header, name, id_str,
                                                version_str, header_str);
       if (sam_hdr_write(accept.get(), copy.get()) == -1) {
         std::cerr << "Error writing to output BAM. Giving up on file."
@@ -53,7 +53,7 @@ public:
     }
     if (reject) {
       std::string name("bamql-reject");
-      auto copy = bamql::appendProgramToHeader(header.get(), name, id_str,
+      auto copy = bamql::appendProgramToHeader(header, name, id_str,
                                                version_str, header_str);
       if (sam_hdr_write(reject.get(), copy.get()) == -1) {
         std::cerr << "Error writing to output BAM. Giving up on file."
@@ -196,6 +196,7 @@ int main(int argc,
   // Process the input file.
   DataCollector stats(filter, index, verbose, headerName, version, accept,
                       reject);
+  stats.setZeroCopy(true);
   if (stats.processFile(bam_filename, binary, ignore_index)) {
     stats.writeSummary();
     return 0;
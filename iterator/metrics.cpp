@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql-iterator.hpp"
+#include <cstdio>
+#include <fstream>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <iostream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+/**
+ * How many reads to process between checking if it is time to write the
+ * metrics.
+ */
+#define CHECK_INTERVAL 4096
+
+static const char *stage_names[] = { "decode", "filter", "write", "seek" };
+
+bamql::Metrics::Metrics(const std::string &path_, double interval_)
+    : path(path_), interval(interval_),
+      start(std::chrono::steady_clock::now()), last_write(start) {}
+
+void bamql::Metrics::startFile(const char *file_name_, htsFile *input_) {
+  file_name = file_name_;
+  struct stat info;
+  file_size = stat(file_name_, &info) == 0 && S_ISREG(info.st_mode)
+                  ? info.st_size
+                  : 0;
+  // Plain SAM files are read directly rather than through BGZF, so only the
+  // position in the file is known. Other compressed files have no progress.
+  auto format = hts_get_format(input_);
+  bgzf = nullptr;
+  hfile = nullptr;
+  if (format->format == bam || format->compression == ::bgzf) {
+    bgzf = input_->fp.bgzf;
+  } else if (format->compression == no_compression) {
+    hfile = input_->fp.hfile;
+  }
+  base_compressed = compressed_bytes;
+  base_uncompressed = uncompressed_bytes;
+}
+
+void bamql::Metrics::finishFile() {
+  updateBytes();
+  bgzf = nullptr;
+  hfile = nullptr;
+  write();
+}
+
+void bamql::Metrics::add(Stage stage,
+                         std::chrono::steady_clock::duration time) {
+  stages[stage] += time;
+}
+
+void bamql::Metrics::countRead() {
+  if (++reads % CHECK_INTERVAL == 0 &&
+      std::chrono::steady_clock::now() - last_write >=
+          std::chrono::duration<double>(interval)) {
+    updateBytes();
+    write();
+  }
+}
+
+void bamql::Metrics::updateBytes() {
+  if (bgzf != nullptr) {
+    compressed_bytes = base_compressed + bgzf->block_address;
+    uncompressed_bytes = base_uncompressed + bgzf->uncompressed_address;
+    progress = file_size > 0 ? (double)bgzf->block_address / file_size : 0;
+  } else if (hfile != nullptr) {
+    auto position = htell(hfile);
+    compressed_bytes = base_compressed + position;
+    uncompressed_bytes = base_uncompressed + position;
+    progress = file_size > 0 ? (double)position / file_size : 0;
+  }
+}
+
+void bamql::Metrics::write() {
+  last_write = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(last_write - start).count();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  size_t peak_rss = usage.ru_maxrss * 1024;
+  double eta = progress > 0 && progress < 1
+                   ? elapsed * (1 - progress) / progress
+                   : 0;
+  bool prometheus =
+      path.size() > 5 && path.compare(path.size() - 5, 5, ".prom") == 0;
+
+  /* Write to a temporary file and rename it so that readers never see a
+   * partially written file. */
+  auto temp_path = path + ".tmp";
+  {
+    std::ofstream output(temp_path);
+    if (prometheus) {
+      output << "# TYPE bamql_reads_total counter" << std::endl
+             << "bamql_reads_total " << reads << std::endl
+             << "# TYPE bamql_elapsed_seconds gauge" << std::endl
+             << "bamql_elapsed_seconds " << elapsed << std::endl
+             << "# TYPE bamql_reads_per_second gauge" << std::endl
+             << "bamql_reads_per_second "
+             << (elapsed > 0 ? reads / elapsed : 0) << std::endl
+             << "# TYPE bamql_compressed_bytes_total counter" << std::endl
+             << "bamql_compressed_bytes_total " << compressed_bytes
+             << std::endl
+             << "# TYPE bamql_uncompressed_bytes_total counter" << std::endl
+             << "bamql_uncompressed_bytes_total " << uncompressed_bytes
+             << std::endl
+             << "# TYPE bamql_stage_seconds_total counter" << std::endl;
+      for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        output << "bamql_stage_seconds_total{stage=\"" << stage_names[stage]
+               << "\"} "
+               << std::chrono::duration<double>(stages[stage]).count()
+               << std::endl;
+      }
+      output << "# TYPE bamql_progress_ratio gauge" << std::endl
+             << "bamql_progress_ratio " << progress << std::endl
+             << "# TYPE bamql_eta_seconds gauge" << std::endl
+             << "bamql_eta_seconds " << eta << std::endl
+             << "# TYPE bamql_peak_rss_bytes gauge" << std::endl
+             << "bamql_peak_rss_bytes " << peak_rss << std::endl;
+    } else {
+      output << "{\"file\": \"";
+      for (auto c : file_name) {
+        if (c == '"' || c == '\\') {
+          output << '\\';
+        }
+        output << c;
+      }
+      output << "\", \"reads\": " << reads
+             << ", \"elapsed_seconds\": " << elapsed
+             << ", \"reads_per_second\": "
+             << (elapsed > 0 ? reads / elapsed : 0)
+             << ", \"compressed_bytes\": " << compressed_bytes
+             << ", \"compressed_bytes_per_second\": "
+             << (elapsed > 0 ? compressed_bytes / elapsed : 0)
+             << ", \"uncompressed_bytes\": " << uncompressed_bytes
+             << ", \"uncompressed_bytes_per_second\": "
+             << (elapsed > 0 ? uncompressed_bytes / elapsed : 0)
+             << ", \"stage_seconds\": {";
+      for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        output << (stage == 0 ? "" : ", ") << "\"" << stage_names[stage]
+               << "\": "
+               << std::chrono::duration<double>(stages[stage]).count();
+      }
+      output << "}, \"progress\": " << progress
+             << ", \"eta_seconds\": " << eta
+             << ", \"peak_rss_bytes\": " << peak_rss << "}" << std::endl;
+    }
+    if (!output) {
+      std::cerr << temp_path << ": Cannot write metrics." << std::endl;
+      return;
+    }
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    perror(path.c_str());
+  }
+}
+
+bamql::Metrics::Timer::Timer(std::shared_ptr<Metrics> &metrics_, Stage stage_)
+    : metrics(metrics_.get()), stage(stage_) {
+  if (metrics != nullptr) {
+    start = std::chrono::steady_clock::now();
+  }
+}
+
+bamql::Metrics::Timer::~Timer() {
+  if (metrics != nullptr) {
+    metrics->add(stage, std::chrono::steady_clock::now() - start);
+  }
+}
@@ -17,16 +17,36 @@
 #include "bamql-iterator.hpp"
 #include <cstdio>
 #include <cstring>
+#include <htslib/hfile.h>
+#include <iostream>
 #include <sstream>
 #include <uuid.h>
 
+/**
+ * The empty block that marks the end of a BGZF file.
+ */
+static const uint8_t BGZF_EOF[28] = { 0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00,
+                                      0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+                                      0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00,
+                                      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
 std::shared_ptr<bam_hdr_t> bamql::appendProgramToHeader(
-    const bam_hdr_t *original,
+    std::shared_ptr<bam_hdr_t> &original,
     const std::string &name,
     const std::string &id,
     const std::string &version,
     const std::string &args) {
-  auto copy = std::shared_ptr<bam_hdr_t>(bam_hdr_init(), bam_hdr_destroy);
+  // Copying the names of millions of chromosomes for every output is slow, so
+  // the copy borrows them and gives them back before it is destroyed.
+  auto copy = std::shared_ptr<bam_hdr_t>(
+      bam_hdr_init(), [original](bam_hdr_t *header) {
+        if (header != nullptr) {
+          header->n_targets = 0;
+          header->target_len = nullptr;
+          header->target_name = nullptr;
+          bam_hdr_destroy(header);
+        }
+      });
   if (!copy) {
     return copy;
   }
@@ -40,12 +60,8 @@ std::shared_ptr<bam_hdr_t> bamql::appendProgramToHeader(
   copy->l_text = text_str.length();
   copy->sdict = nullptr;
   copy->text = strdup(text_str.c_str());
-  copy->target_len = (uint32_t *)calloc(original->n_targets, sizeof(uint32_t));
-  copy->target_name = (char **)calloc(original->n_targets, sizeof(char *));
-  for (int it = 0; it < original->n_targets; it++) {
-    copy->target_len[it] = original->target_len[it];
-    copy->target_name[it] = strdup(original->target_name[it]);
-  }
+  copy->target_len = original->target_len;
+  copy->target_name = original->target_name;
   return copy;
 }
 
@@ -58,6 +74,80 @@ std::shared_ptr<htsFile> bamql::open(const char *filename, const char *mode) {
   return std::shared_ptr<htsFile>(hts_open(filename, mode), hts_close0);
 }
 
+static void bgzf_close0(BGZF *handle) {
+  if (handle != nullptr)
+    bgzf_close(handle);
+}
+
+bool bamql::concatenate(const std::vector<std::string> &inputs,
+                        const char *output) {
+  std::unique_ptr<BGZF, void (*)(BGZF *)> out(bgzf_open(output, "w"),
+                                              bgzf_close0);
+  if (!out) {
+    perror(output);
+    return false;
+  }
+  std::vector<uint8_t> buffer(1 << 16);
+  for (size_t it = 0; it < inputs.size(); it++) {
+    std::shared_ptr<BGZF> in(bgzf_open(inputs[it].c_str(), "r"), bgzf_close0);
+    if (!in) {
+      perror(inputs[it].c_str());
+      return false;
+    }
+    std::shared_ptr<bam_hdr_t> header(bam_hdr_read(in.get()), bam_hdr_destroy);
+    if (!header) {
+      std::cerr << inputs[it] << ": Cannot read header." << std::endl;
+      return false;
+    }
+    if (it == 0 && bam_hdr_write(out.get(), header.get()) != 0) {
+      std::cerr << output << ": Cannot write header." << std::endl;
+      return false;
+    }
+    // The reads after the header in its last block have to be compressed
+    // again, but every block after that can be copied as it is.
+    if (in->block_offset < in->block_length &&
+        bgzf_write(out.get(), (uint8_t *)in->uncompressed_block +
+                                  in->block_offset,
+                   in->block_length - in->block_offset) < 0) {
+      std::cerr << output << ": Cannot write reads." << std::endl;
+      return false;
+    }
+    if (bgzf_flush(out.get()) != 0) {
+      std::cerr << output << ": Cannot write reads." << std::endl;
+      return false;
+    }
+    // Hold back the last few bytes read, so the end-of-file marker is not
+    // copied into the middle of the output.
+    size_t held = 0;
+    ssize_t length;
+    while ((length = hread(in->fp, buffer.data() + held,
+                           buffer.size() - held)) > 0) {
+      held += length;
+      if (held > sizeof(BGZF_EOF)) {
+        auto ready = held - sizeof(BGZF_EOF);
+        if (hwrite(out->fp, buffer.data(), ready) != (ssize_t)ready) {
+          std::cerr << output << ": Cannot write reads." << std::endl;
+          return false;
+        }
+        memmove(buffer.data(), buffer.data() + ready, sizeof(BGZF_EOF));
+        held = sizeof(BGZF_EOF);
+      }
+    }
+    if (length < 0) {
+      std::cerr << inputs[it] << ": Cannot read reads." << std::endl;
+      return false;
+    }
+    if ((held != sizeof(BGZF_EOF) ||
+         memcmp(buffer.data(), BGZF_EOF, sizeof(BGZF_EOF)) != 0) &&
+        hwrite(out->fp, buffer.data(), held) != (ssize_t)held) {
+      std::cerr << output << ": Cannot write reads." << std::endl;
+      return false;
+    }
+  }
+  // Closing the output adds the end-of-file marker.
+  return bgzf_close(out.release()) == 0;
+}
+
 std::string bamql::makeUuid() {
 #if defined(_UUID_UUID_H) || defined(_UL_LIBUUID_UUID_H)
   uuid_t uuid;
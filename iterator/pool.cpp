@@ -0,0 +1,121 @@
+/*
+ * Copyright 2017 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql-iterator.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+/**
+ * The number of reads allocated together in one arena.
+ */
+static const size_t SLAB_SIZE = 256;
+/**
+ * The size of a read's data buffer before any reads have been seen.
+ */
+static const size_t INITIAL_DATA_SIZE = 512;
+
+bamql::ReadPool::ReadPool(bool huge_pages_)
+    : huge_pages(huge_pages_), data_size(INITIAL_DATA_SIZE) {}
+
+bamql::ReadPool::~ReadPool() {
+  for (auto read : reads) {
+    // Only frees the data if HTSlib had to replace the arena's buffer.
+    bam_destroy1(read);
+  }
+  for (auto &arena : arenas) {
+    munmap(arena.first, arena.second);
+  }
+}
+
+std::shared_ptr<bam1_t> bamql::ReadPool::acquire() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (available.empty()) {
+    grow();
+  }
+  auto read = available.back();
+  available.pop_back();
+  return std::shared_ptr<bam1_t>(read,
+                                 [this](bam1_t *read) { release(read); });
+}
+
+void bamql::ReadPool::release(bam1_t *read) {
+  std::lock_guard<std::mutex> lock(mutex);
+  released++;
+  released_bytes += read->l_data;
+  if ((bam_get_mempolicy(read) & BAM_USER_OWNS_DATA) == 0) {
+    // HTSlib outgrew the read's buffer and allocated one of its own. Give
+    // later buffers room for somewhat more than the average read, rounded to
+    // a cache line, and, unless this read is longer than that, swap its
+    // buffer for one of them. Reads longer than that keep HTSlib's buffer.
+    auto target = (released_bytes / released * 5 / 4 + 63) / 64 * 64;
+    if (target > data_size) {
+      data_size = target;
+      spare_count = 0;
+    }
+    if (read->l_data <= (int)data_size) {
+      auto data = allocateData();
+      memcpy(data, read->data, read->l_data);
+      free(read->data);
+      read->data = data;
+      read->m_data = data_size;
+      bam_set_mempolicy(read, BAM_USER_OWNS_STRUCT | BAM_USER_OWNS_DATA);
+    }
+  }
+  available.push_back(read);
+}
+
+void *bamql::ReadPool::map(size_t size) {
+  auto arena = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages) {
+    madvise(arena, size, MADV_HUGEPAGE);
+  }
+#endif
+  arenas.push_back(std::make_pair(arena, size));
+  return arena;
+}
+
+uint8_t *bamql::ReadPool::allocateData() {
+  // Buffers outgrown when the size changes stay in their arena until the
+  // pool is destroyed.
+  if (spare_count == 0) {
+    spare_data = (uint8_t *)map(SLAB_SIZE * data_size);
+    spare_count = SLAB_SIZE;
+  }
+  auto data = spare_data;
+  spare_data += data_size;
+  spare_count--;
+  return data;
+}
+
+void bamql::ReadPool::grow() {
+  auto records = (bam1_t *)map(SLAB_SIZE * sizeof(bam1_t));
+  for (size_t it = 0; it < SLAB_SIZE; it++) {
+    auto read = &records[it];
+    // Anonymous mappings are zeroed, so only the buffer needs to be set.
+    read->data = allocateData();
+    read->m_data = data_size;
+    bam_set_mempolicy(read, BAM_USER_OWNS_STRUCT | BAM_USER_OWNS_DATA);
+    reads.push_back(read);
+    available.push_back(read);
+  }
+}
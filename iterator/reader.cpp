@@ -15,12 +15,43 @@
  */
 
 #include "bamql-iterator.hpp"
-#include <climits>
+#include <algorithm>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <htslib/hts_endian.h>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <thread>
 
-bamql::ReadIterator::ReadIterator() {}
+/**
+ * The number of reads decoded before they are examined together.
+ */
+static const size_t BATCH_SIZE = 256;
+
+bamql::ReadIterator::ReadIterator() : pool(std::make_shared<ReadPool>()) {}
+
+void bamql::ReadIterator::setMetrics(std::shared_ptr<Metrics> &metrics_) {
+  metrics = metrics_;
+}
+
+void bamql::ReadIterator::setZeroCopy(bool zero_copy_) {
+  zero_copy = zero_copy_;
+}
+
+void bamql::ReadIterator::setReadPool(std::shared_ptr<ReadPool> &pool_) {
+  pool = pool_;
+}
+
+void bamql::ReadIterator::setThreads(size_t threads_) {
+  threads = threads_ < 1 ? 1 : threads_;
+}
+
+void bamql::ReadIterator::setShard(size_t index, size_t count) {
+  shard_index = index;
+  shard_count = count;
+}
 
 static bool checkHtsError(int result) {
   if (result == -1) {
@@ -38,14 +69,461 @@ static bool checkHtsError(int result) {
   return false;
 }
 
-bool bamql::ReadIterator::wantAll(std::shared_ptr<bam_hdr_t> &header) {
+static std::vector<std::shared_ptr<bam1_t>>
+makeBatch(bamql::ReadPool &pool) {
+  std::vector<std::shared_ptr<bam1_t>> reads;
+  for (size_t it = 0; it < BATCH_SIZE; it++) {
+    reads.push_back(pool.acquire());
+  }
+  return reads;
+}
+
+/**
+ * Create reads that borrow their data from the decompressed blocks. Views are
+ * only possible where BAM records can be used as they are stored: on
+ * little-endian hosts that allow unaligned access, since the CIGAR string is
+ * not padded to a word boundary.
+ */
+static std::vector<std::shared_ptr<bam1_t>> makeViews() {
+  std::vector<std::shared_ptr<bam1_t>> views;
+#if defined(HTS_LITTLE_ENDIAN) && HTS_ALLOW_UNALIGNED != 0
+  for (size_t it = 0; it < BATCH_SIZE; it++) {
+    views.emplace_back(bam_init1(), bam_destroy1);
+    bam_set_mempolicy(views.back().get(),
+                      bam_get_mempolicy(views.back().get()) |
+                          BAM_USER_OWNS_DATA);
+  }
+#endif
+  return views;
+}
+
+/**
+ * Check if the record at the current position of a BAM file is entirely in
+ * the current block.
+ */
+static bool recordInBlock(BGZF *bgzf) {
+  auto available = bgzf->block_length - bgzf->block_offset;
+  return available >= 4 &&
+         available - 4 >= le_to_i32((const uint8_t *)bgzf->uncompressed_block +
+                                    bgzf->block_offset);
+}
+
+static void advance(BGZF *bgzf, size_t length) {
+  bgzf->block_offset += length;
+  bgzf->uncompressed_address += length;
+}
+
+void bamql::ReadIterator::processBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count) {
+  for (size_t it = 0; it < count; it++) {
+    processRead(header, reads[it]);
+  }
+}
+
+bool bamql::ReadIterator::canFilterConcurrently() { return false; }
+
+void bamql::ReadIterator::filterBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count,
+    uint8_t *matches) {
+  std::fill(matches, matches + count, 1);
+}
+
+void bamql::ReadIterator::processFiltered(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count,
+    const uint8_t *matches) {
+  processBatch(header, reads, count);
+}
+
+void bamql::ReadIterator::countReads(size_t count) {
+  if (metrics) {
+    for (size_t it = 0; it < count; it++) {
+      metrics->countRead();
+    }
+  }
+}
+
+void bamql::ReadIterator::flushBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count) {
+  if (count == 0) {
+    return;
+  }
+  processBatch(header, reads, count);
+  countReads(count);
+}
+
+bool bamql::ReadIterator::wantFile(std::shared_ptr<bam_hdr_t> &header) {
+  return true;
+}
+
+bool bamql::ReadIterator::wantRawRead(std::shared_ptr<bam_hdr_t> &header,
+                                      const uint8_t *record) {
+  return true;
+}
+
+bool bamql::ReadIterator::skipRawReads(BGZF *bgzf,
+                                       std::shared_ptr<bam_hdr_t> &header,
+                                       bool keep_block,
+                                       size_t &skipped) {
+  while (true) {
+    if (keep_block && !recordInBlock(bgzf)) {
+      return true;
+    }
+    // Only records whose fixed-size fields are in the block already
+    // decompressed are checked. Everything else, including the end of the
+    // file and errors, is left for HTSlib.
+    if (bgzf_peek(bgzf) < 0 ||
+        bgzf->block_length - bgzf->block_offset < 4 + 32) {
+      return true;
+    }
+    auto record = (const uint8_t *)bgzf->uncompressed_block +
+                  bgzf->block_offset;
+    auto block_size = le_to_i32(record);
+    if (block_size < 32 || wantRawRead(header, record + 4)) {
+      return true;
+    }
+    skipped++;
+    // The rest of the record may be in the following blocks.
+    size_t remaining = 4 + block_size;
+    while (remaining > 0) {
+      if (bgzf->block_offset >= bgzf->block_length && bgzf_peek(bgzf) < 0) {
+        return false;
+      }
+      auto used = std::min(remaining, (size_t)(bgzf->block_length -
+                                               bgzf->block_offset));
+      advance(bgzf, used);
+      remaining -= used;
+    }
+  }
+}
+
+bool bamql::ReadIterator::readView(BGZF *bgzf,
+                                   std::shared_ptr<bam_hdr_t> &header,
+                                   bam1_t *view) {
+  if (!recordInBlock(bgzf)) {
+    return false;
+  }
+  auto record = (const uint8_t *)bgzf->uncompressed_block + bgzf->block_offset;
+  auto block_size = le_to_i32(record);
+  if (block_size < 32) {
+    return false;
+  }
+  auto &core = view->core;
+  core.tid = le_to_i32(record + 4);
+  core.pos = le_to_i32(record + 8);
+  core.l_qname = record[12];
+  core.qual = record[13];
+  core.bin = le_to_u16(record + 14);
+  core.n_cigar = le_to_u16(record + 16);
+  core.flag = le_to_u16(record + 18);
+  core.l_qseq = le_to_i32(record + 20);
+  core.mtid = le_to_i32(record + 24);
+  core.mpos = le_to_i32(record + 28);
+  core.isize = le_to_i32(record + 32);
+  core.l_extranul = 0;
+  auto data = const_cast<uint8_t *>(record + 36);
+  uint32_t l_data = block_size - 32;
+
+  // Anything that HTSlib would reject or rewrite is left for it to decode.
+  if (core.tid < -1 || core.tid >= header->n_targets || core.mtid < -1 ||
+      core.mtid >= header->n_targets || core.l_qname == 0 ||
+      data[core.l_qname - 1] != '\0' || core.l_qseq < 0 ||
+      core.l_qname + 4 * (uint64_t)core.n_cigar + (core.l_qseq + 1) / 2 +
+              (uint64_t)core.l_qseq >
+          l_data) {
+    return false;
+  }
+  // A CIGAR string that clips the whole sequence may be a placeholder for
+  // one too long to fit, which is stored in the CG tag.
+  if (core.n_cigar > 0) {
+    auto cigar = le_to_u32(data + core.l_qname);
+    if (bam_cigar_op(cigar) == BAM_CSOFT_CLIP &&
+        bam_cigar_oplen(cigar) == (uint32_t)core.l_qseq) {
+      return false;
+    }
+  }
+  view->data = data;
+  view->l_data = l_data;
+  view->m_data = l_data;
+  view->id = 0;
+  advance(bgzf, 4 + block_size);
+  return true;
+}
+
+/**
+ * Find the chromosomes that might have reads, using the statistics in the
+ * index. HTSlib records statistics for every chromosome with reads, so if any
+ * chromosome has them, the ones without are empty; otherwise, every chromosome
+ * in the index might have reads.
+ */
+static std::vector<bool> populatedChromosomes(
+    std::shared_ptr<hts_idx_t> &index, std::shared_ptr<bam_hdr_t> &header) {
+  std::vector<bool> populated(header->n_targets, false);
+  auto indexed = std::min(header->n_targets, hts_idx_nseq(index.get()));
+  bool has_stats = false;
+  for (auto tid = 0; tid < indexed; tid++) {
+    uint64_t mapped;
+    uint64_t unmapped;
+    if (hts_idx_get_stat(index.get(), tid, &mapped, &unmapped) == 0) {
+      has_stats = true;
+      populated[tid] = mapped + unmapped > 0;
+    }
+  }
+  if (!has_stats) {
+    std::fill(populated.begin(), populated.begin() + indexed, true);
+  }
+  return populated;
+}
+
+bool bamql::ReadIterator::wantedChromosomes(std::shared_ptr<hts_idx_t> &index,
+                                            std::shared_ptr<bam_hdr_t> &header,
+                                            std::vector<int> &wanted) {
+  auto populated = populatedChromosomes(index, header);
+  bool all = true;
   for (auto tid = 0; tid < header->n_targets; tid++) {
-    if (!wantChromosome(header, tid)) {
+    if (!populated[tid]) {
+      continue;
+    }
+    if (wantChromosome(header, tid)) {
+      wanted.push_back(tid);
+    } else {
+      all = false;
+    }
+  }
+  return all;
+}
+bool bamql::ReadIterator::processRegion(
+    std::shared_ptr<htsFile> &input,
+    std::shared_ptr<hts_idx_t> &index,
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    int tid,
+    hts_pos_t begin,
+    hts_pos_t end) {
+  // The first read is counted as part of the seek since that is when the file
+  // is repositioned.
+  size_t count = 0;
+  int result;
+  std::shared_ptr<hts_itr_t> itr;
+  {
+    Metrics::Timer timer(metrics, Metrics::SEEK);
+    itr = std::shared_ptr<hts_itr_t>(
+        bam_itr_queryi(index.get(), tid, begin, end), hts_itr_destroy);
+    result = bam_itr_next(input.get(), itr.get(), reads[count].get());
+  }
+  while (result >= 0) {
+    // Reads that start before the region only overlap it and belong to the
+    // region before.
+    if ((begin == 0 || reads[count]->core.pos >= begin) &&
+        ++count == reads.size()) {
+      flushBatch(header, reads, count);
+      count = 0;
+    }
+    Metrics::Timer timer(metrics, Metrics::DECODE);
+    result = bam_itr_next(input.get(), itr.get(), reads[count].get());
+  }
+  flushBatch(header, reads, count);
+  return checkHtsError(result);
+}
+
+/**
+ * The range of virtual offsets holding the reads that overlap a region, or an
+ * empty range if there are none. The compressed offset is in the upper bits,
+ * so differences are dominated by compressed bytes, but reads that all sit in
+ * one block still have a non-zero size from the uncompressed offset.
+ */
+static std::pair<uint64_t, uint64_t>
+regionBytes(std::shared_ptr<hts_idx_t> &index,
+            int tid,
+            hts_pos_t begin,
+            hts_pos_t end) {
+  std::shared_ptr<hts_itr_t> itr(
+      bam_itr_queryi(index.get(), tid, begin, end), hts_itr_destroy);
+  if (!itr || itr->n_off == 0) {
+    return std::make_pair(0, 0);
+  }
+  uint64_t last = 0;
+  for (int it = 0; it < itr->n_off; it++) {
+    last = std::max(last, itr->off[it].v);
+  }
+  return std::make_pair(itr->off[0].u, last);
+}
+
+bool bamql::ReadIterator::processShard(
+    std::shared_ptr<htsFile> &input,
+    std::shared_ptr<hts_idx_t> &index,
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads) {
+  // Measure how much of the file each chromosome takes. The sizes only
+  // balance the shards; which chromosomes are read depends on whether the
+  // index shows they have reads.
+  auto populated = populatedChromosomes(index, header);
+  std::vector<uint64_t> sizes(header->n_targets, 0);
+  uint64_t total = 0;
+  for (auto tid = 0; tid < header->n_targets; tid++) {
+    if (populated[tid]) {
+      auto bytes = regionBytes(index, tid, 0, HTS_POS_MAX);
+      sizes[tid] = bytes.second - bytes.first;
+      total += sizes[tid];
+    }
+  }
+  // Without offsets in the index, split by the number of chromosomes.
+  if (total == 0) {
+    for (auto tid = 0; tid < header->n_targets; tid++) {
+      sizes[tid] = populated[tid] ? 1 : 0;
+      total += sizes[tid];
+    }
+  }
+
+  // Find where this shard starts and stops, as a chromosome and position,
+  // by finding the first position whose reads start past the shard's share
+  // of the file.
+  auto boundary = [&](size_t shard) {
+    if (shard == 0) {
+      return std::make_pair(0, (hts_pos_t)0);
+    }
+    if (shard == shard_count) {
+      return std::make_pair(header->n_targets, (hts_pos_t)0);
+    }
+    auto target = (uint64_t)(total * (double)shard / shard_count);
+    for (auto tid = 0; tid < header->n_targets; tid++) {
+      if (target >= sizes[tid]) {
+        target -= sizes[tid];
+        continue;
+      }
+      auto start = regionBytes(index, tid, 0, HTS_POS_MAX).first;
+      hts_pos_t low = 0;
+      hts_pos_t high = sam_hdr_tid2len(header.get(), tid);
+      while (low < high) {
+        auto middle = low + (high - low) / 2;
+        auto bytes = regionBytes(index, tid, middle, HTS_POS_MAX);
+        if (bytes.first == bytes.second || bytes.first >= start + target) {
+          high = middle;
+        } else {
+          low = middle + 1;
+        }
+      }
+      return std::make_pair(tid, low);
+    }
+    return std::make_pair(header->n_targets, (hts_pos_t)0);
+  };
+  auto first = boundary(shard_index);
+  auto last = boundary(shard_index + 1);
+
+  std::vector<int> wanted;
+  bool all = wantedChromosomes(index, header, wanted);
+  for (auto tid : wanted) {
+    if (tid < first.first || tid > last.first) {
+      continue;
+    }
+    hts_pos_t begin = tid == first.first ? first.second : 0;
+    hts_pos_t end = tid == last.first ? last.second : HTS_POS_MAX;
+    if (begin < end &&
+        !processRegion(input, index, header, reads, tid, begin, end)) {
       return false;
     }
   }
+  // Reads without a position go with the last shard. As when the file is not
+  // split, they are only read if every chromosome with reads is wanted.
+  return shard_index + 1 < shard_count || !all ||
+         processRegion(input, index, header, reads, HTS_IDX_NOCOOR, 0, 0);
+}
+
+bool bamql::ReadIterator::explainFile(const char *file_name,
+                                      bool binary,
+                                      bool ignore_index,
+                                      std::ostream &output) {
+  auto input = bamql::open(file_name, binary ? "rb" : "r");
+  if (!input) {
+    perror(file_name);
+    return false;
+  }
+  std::shared_ptr<bam_hdr_t> header(sam_hdr_read(input.get()), bam_hdr_destroy);
+  output << file_name << ":" << std::endl;
+  if (!wantFile(header)) {
+    output << "  Skipped: the header shows that no read can match."
+           << std::endl;
+    return true;
+  }
+  std::shared_ptr<hts_idx_t> index(
+      ignore_index ? nullptr : sam_index_load(input.get(), file_name),
+      hts_idx_destroy);
+  if (!index) {
+    output << "  No index: every read is read." << std::endl;
+    return true;
+  }
+
+  // Add up the statistics and sizes the same way `processFile` and
+  // `processShard` would find them.
+  auto populated = populatedChromosomes(index, header);
+  auto indexed = std::min(header->n_targets, hts_idx_nseq(index.get()));
+  uint64_t mapped_total = 0;
+  uint64_t unmapped_total = 0;
+  for (auto tid = 0; tid < indexed; tid++) {
+    uint64_t mapped;
+    uint64_t unmapped;
+    if (hts_idx_get_stat(index.get(), tid, &mapped, &unmapped) == 0) {
+      mapped_total += mapped;
+      unmapped_total += unmapped;
+    }
+  }
+  size_t populated_count = 0;
+  size_t wanted_count = 0;
+  int64_t total_bytes = 0;
+  int64_t wanted_bytes = 0;
+  for (auto tid = 0; tid < header->n_targets; tid++) {
+    if (!populated[tid]) {
+      continue;
+    }
+    auto bytes = regionBytes(index, tid, 0, HTS_POS_MAX);
+    auto size = (int64_t)(bytes.second >> 16) - (int64_t)(bytes.first >> 16);
+    populated_count++;
+    total_bytes += size;
+    if (wantChromosome(header, tid)) {
+      wanted_count++;
+      wanted_bytes += size;
+    }
+  }
+  bool seek = shard_count > 1 || wanted_count < populated_count;
+
+  output << "  Index: " << (hts_idx_fmt(index.get()) == HTS_FMT_CSI ? "CSI"
+                                                                    : "BAI")
+         << ", " << populated_count << " of " << header->n_targets
+         << " chromosomes have reads" << std::endl;
+  output << "  Reads in the index: " << mapped_total << " mapped, "
+         << unmapped_total << " unmapped on a chromosome, "
+         << hts_idx_get_n_no_coor(index.get()) << " without a position"
+         << std::endl;
+  output << "  Chromosomes wanted: " << wanted_count << " of "
+         << populated_count << " with reads" << std::endl;
+  if (shard_count > 1) {
+    output << "  Access: part " << (shard_index + 1) << " of " << shard_count
+           << ", seeking to the wanted chromosomes in it" << std::endl;
+  } else if (seek) {
+    output << "  Access: seek to each wanted chromosome; reads without a "
+              "position are not read"
+           << std::endl;
+  } else {
+    output << "  Access: read the whole file" << std::endl;
+  }
+  // Each part gets an equal share of the file, but only the wanted
+  // chromosomes in it are read.
+  auto read_bytes = seek ? wanted_bytes : total_bytes;
+  if (shard_count > 1) {
+    read_bytes = std::min(read_bytes, total_bytes / (int64_t)shard_count);
+  }
+  output << "  Compressed bytes to read: about " << read_bytes << " of "
+         << total_bytes << " holding reads with a position" << std::endl;
   return true;
 }
+
 bool bamql::ReadIterator::processFile(const char *file_name,
                                       bool binary,
                                       bool ignore_index) {
@@ -56,41 +534,249 @@ bool bamql::ReadIterator::processFile(const char *file_name,
     return false;
   }
 
+  if (metrics) {
+    metrics->startFile(file_name, input.get());
+  }
+
   // Copy the header to the output.
   std::shared_ptr<bam_hdr_t> header(sam_hdr_read(input.get()), bam_hdr_destroy);
   ingestHeader(header);
+  if (!wantFile(header)) {
+    if (metrics) {
+      metrics->finishFile();
+    }
+    return true;
+  }
 
-  // Open the index, if desired.
+  // Open the index, if desired. This may be a BAI or a CSI index, which is
+  // needed for chromosomes longer than 512Mbp.
   std::shared_ptr<hts_idx_t> index(
-      ignore_index ? nullptr : hts_idx_load(file_name, HTS_FMT_BAI),
+      ignore_index ? nullptr : sam_index_load(input.get(), file_name),
       hts_idx_destroy);
 
-  if (index && !wantAll(header)) {
-    std::shared_ptr<bam1_t> read(bam_init1(), bam_destroy1);
-    // Rummage through all the chromosomes in the header...
-    for (auto tid = 0; tid < header->n_targets; tid++) {
-      if (!wantChromosome(header, tid)) {
-        continue;
-      }
-      // ...and use the index to seek through chomosome of interest.
-      std::shared_ptr<hts_itr_t> itr(
-          bam_itr_queryi(index.get(), tid, 0, INT_MAX), hts_itr_destroy);
-      int result;
-      while ((result = bam_itr_next(input.get(), itr.get(), read.get())) >= 0) {
-        processRead(header, read);
+  auto reads = makeBatch(*pool);
+  size_t count = 0;
+  if (shard_count > 1) {
+    if (!index) {
+      std::cerr << file_name << ": An index is required to split the file."
+                << std::endl;
+      if (metrics) {
+        metrics->finishFile();
       }
-      if (!checkHtsError(result)) {
+      return false;
+    }
+    auto success = processShard(input, index, header, reads);
+    if (metrics) {
+      metrics->finishFile();
+    }
+    return success;
+  }
+  std::vector<int> wanted;
+  if (index && !wantedChromosomes(index, header, wanted)) {
+    // Use the index to seek through the chromosomes of interest that have
+    // reads. Each chromosome's answer is only asked for once.
+    for (auto tid : wanted) {
+      if (!processRegion(input, index, header, reads, tid, 0, HTS_POS_MAX)) {
+        if (metrics) {
+          metrics->finishFile();
+        }
         return false;
       }
     }
+    if (metrics) {
+      metrics->finishFile();
+    }
     return true;
   }
 
-  // Cycle through all the reads when an index is unavailable.
-  std::shared_ptr<bam1_t> read(bam_init1(), bam_destroy1);
+  if (threads > 1 && canFilterConcurrently()) {
+    auto success = processConcurrently(input, header);
+    if (metrics) {
+      metrics->finishFile();
+    }
+    return success;
+  }
+
+  // Cycle through all the reads when an index is unavailable. BAM records
+  // that are not wanted are skipped before they are decoded. Views point into
+  // the current block, so they must be examined before the next block is
+  // read.
+  auto bgzf = input->format.format == bam ? input->fp.bgzf : nullptr;
+  auto views = zero_copy && bgzf != nullptr
+                   ? makeViews()
+                   : std::vector<std::shared_ptr<bam1_t>>();
+  auto batch = reads;
+  size_t view_count = 0;
+  size_t skipped = 0;
   int result;
-  while ((result = sam_read1(input.get(), header.get(), read.get())) >= 0) {
-    processRead(header, read);
+  while (true) {
+    if (view_count > 0 && !recordInBlock(bgzf)) {
+      flushBatch(header, batch, count);
+      count = 0;
+      view_count = 0;
+    }
+    {
+      Metrics::Timer timer(metrics, Metrics::DECODE);
+      if (bgzf != nullptr &&
+          !skipRawReads(bgzf, header, view_count > 0, skipped)) {
+        result = -2;
+      } else if (view_count > 0 && !recordInBlock(bgzf)) {
+        continue;
+      } else if (!views.empty() &&
+                 readView(bgzf, header, views[count].get())) {
+        batch[count] = views[count];
+        view_count++;
+        result = 0;
+      } else {
+        batch[count] = reads[count];
+        result = sam_read1(input.get(), header.get(), reads[count].get());
+      }
+    }
+    countReads(skipped);
+    skipped = 0;
+    if (result < 0) {
+      break;
+    }
+    if (++count == batch.size()) {
+      flushBatch(header, batch, count);
+      count = 0;
+      view_count = 0;
+    }
+  }
+  flushBatch(header, batch, count);
+  if (metrics) {
+    metrics->finishFile();
+  }
+  return checkHtsError(result);
+}
+
+namespace {
+/**
+ * A batch of reads moving between the threads of a concurrent reader.
+ */
+struct PipelineBatch {
+  size_t sequence;
+  std::vector<std::shared_ptr<bam1_t>> reads;
+  size_t count;
+  size_t skipped;
+  std::vector<uint8_t> matches;
+  // Only the examining thread updates the metrics, so the time spent
+  // decoding travels with the batch.
+  std::chrono::steady_clock::duration decode_time;
+};
+} // namespace
+
+bool bamql::ReadIterator::processConcurrently(
+    std::shared_ptr<htsFile> &input, std::shared_ptr<bam_hdr_t> &header) {
+  auto bgzf = input->format.format == bam ? input->fp.bgzf : nullptr;
+  // Batches are recycled once examined, so there are at most two for each
+  // filtering thread in flight and the reader waits for the slowest stage.
+  auto limit = 2 * threads;
+  std::mutex mutex;
+  std::condition_variable filter_ready;
+  std::condition_variable process_ready;
+  std::condition_variable read_ready;
+  std::vector<std::shared_ptr<PipelineBatch>> spare;
+  std::deque<std::shared_ptr<PipelineBatch>> unfiltered;
+  std::map<size_t, std::shared_ptr<PipelineBatch>> filtered;
+  size_t created = 0;
+  size_t produced = 0;
+  bool finished = false;
+  int result = -1;
+
+  std::thread reader([&] {
+    int status;
+    do {
+      std::shared_ptr<PipelineBatch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        read_ready.wait(lock,
+                        [&] { return !spare.empty() || created < limit; });
+        if (spare.empty()) {
+          batch = std::make_shared<PipelineBatch>();
+          batch->reads = makeBatch(*pool);
+          batch->matches.resize(batch->reads.size());
+          created++;
+        } else {
+          batch = spare.back();
+          spare.pop_back();
+        }
+      }
+      batch->count = 0;
+      batch->skipped = 0;
+      auto start = std::chrono::steady_clock::now();
+      do {
+        status = bgzf != nullptr &&
+                         !skipRawReads(bgzf, header, false, batch->skipped)
+                     ? -2
+                     : sam_read1(input.get(), header.get(),
+                                 batch->reads[batch->count].get());
+      } while (status >= 0 && ++batch->count < batch->reads.size());
+      batch->decode_time = std::chrono::steady_clock::now() - start;
+      std::lock_guard<std::mutex> lock(mutex);
+      batch->sequence = produced++;
+      unfiltered.push_back(batch);
+      filter_ready.notify_one();
+    } while (status >= 0);
+    std::lock_guard<std::mutex> lock(mutex);
+    result = status;
+    finished = true;
+    filter_ready.notify_all();
+    process_ready.notify_all();
+  });
+
+  std::vector<std::thread> workers;
+  for (size_t it = 0; it < threads; it++) {
+    workers.emplace_back([&] {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        filter_ready.wait(lock,
+                          [&] { return !unfiltered.empty() || finished; });
+        if (unfiltered.empty()) {
+          return;
+        }
+        auto batch = unfiltered.front();
+        unfiltered.pop_front();
+        lock.unlock();
+        filterBatch(header, batch->reads, batch->count, batch->matches.data());
+        lock.lock();
+        filtered[batch->sequence] = batch;
+        process_ready.notify_all();
+      }
+    });
+  }
+
+  // Examine the batches, in order, on this thread.
+  size_t next = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    process_ready.wait(lock, [&] {
+      return filtered.count(next) > 0 || (finished && next == produced);
+    });
+    auto found = filtered.find(next);
+    if (found == filtered.end()) {
+      break;
+    }
+    auto batch = found->second;
+    filtered.erase(found);
+    next++;
+    lock.unlock();
+    if (metrics) {
+      metrics->add(Metrics::DECODE, batch->decode_time);
+    }
+    if (batch->count > 0) {
+      processFiltered(header, batch->reads, batch->count,
+                      batch->matches.data());
+    }
+    countReads(batch->count + batch->skipped);
+    lock.lock();
+    spare.push_back(batch);
+    read_ready.notify_one();
+  }
+  lock.unlock();
+  reader.join();
+  for (auto &worker : workers) {
+    worker.join();
   }
   return checkHtsError(result);
 }
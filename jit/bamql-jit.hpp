@@ -20,8 +20,11 @@
 #include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/Target/TargetMachine.h>
+#include <mutex>
+#include <ostream>
 
-#define BAMQL_JIT_API_VERSION 2
+#define BAMQL_JIT_API_VERSION 8
 namespace bamql {
 
 class CompiledPredicate;
@@ -30,18 +33,43 @@ class JIT {
 public:
   /**
    * Create a JIT.
+   * @param perf_events: make the compiled code visible to perf(1) by writing
+   * /tmp/perf-PID.map and, if LLVM supports it, a jitdump file with line
+   * tables for the query.
+   * @param report: if provided, the time spent compiling queries and the size
+   * of the code generated are added to it.
    */
-  static std::shared_ptr<JIT> create();
+  static std::shared_ptr<JIT> create(
+      bool perf_events = false,
+      std::shared_ptr<CompileReport> report = nullptr);
   static std::shared_ptr<CompiledPredicate> compile(
       std::shared_ptr<JIT> &jit,
       std::shared_ptr<AstNode> &node,
       const std::string &name,
-      llvm::DIScope *debug_scope = nullptr);
+      llvm::DIScope *debug_scope = nullptr,
+      unsigned int profiling = 0);
+  /**
+   * Compile a query that counts how its logical operations behave for the
+   * first reads it sees. Once `sample_size` reads have been filtered, the
+   * query is recompiled with the operations reordered and weighted to match
+   * what was observed. The recompiled query uses the same debugging scope.
+   */
+  static std::shared_ptr<CompiledPredicate> compileAdaptive(
+      std::shared_ptr<JIT> &jit,
+      std::shared_ptr<AstNode> &node,
+      const std::string &name,
+      llvm::DIScope *debug_scope = nullptr,
+      unsigned int profiling = 0,
+      size_t sample_size = 1000000);
   ~JIT();
 
 private:
-  JIT();
+  JIT(bool perf_events, std::shared_ptr<CompileReport> &report);
   llvm::JITEventListener gdbListener;
+  bool perf_events;
+  std::shared_ptr<CompileReport> report;
+  std::unique_ptr<llvm::TargetMachine> target_machine;
+  std::unique_ptr<llvm::JITEventListener> perf_map_listener;
   std::unique_ptr<llvm::orc::LLJIT> lljit;
   friend class CompiledPredicate;
 };
@@ -55,18 +83,126 @@ public:
                     bamql::FilterFunction filter,
                     bamql::IndexFunction index);
   ~CompiledPredicate();
+  /**
+   * Check if any read in a file with this header could match.
+   */
+  bool wantFile(std::shared_ptr<bam_hdr_t> &header,
+                std::function<void(const char *)> error_handler);
   bool wantChromosome(std::shared_ptr<bam_hdr_t> &header,
                       uint32_t tid,
                       std::function<void(const char *)> error_handler);
   bool wantRead(std::shared_ptr<bam_hdr_t> &header,
                 std::shared_ptr<bam1_t> &read,
                 std::function<void(const char *)> error_handler);
+  /**
+   * Check the first `count` reads, storing whether each one matches. If the
+   * query checks the chromosome, reads on a chromosome are checked by a
+   * version of the query where those checks are decided, which is compiled
+   * the first time a chromosome is seen.
+   */
+  void wantReads(std::shared_ptr<bam_hdr_t> &header,
+                 std::vector<std::shared_ptr<bam1_t>> &reads,
+                 size_t count,
+                 uint8_t *matches,
+                 std::function<void(const char *)> error_handler);
+  /**
+   * Check if an undecoded BAM record could match, using only its fixed-size
+   * fields.
+   */
+  bool wantRawRead(std::shared_ptr<bam_hdr_t> &header, const uint8_t *record);
+  /**
+   * Can reads be checked from several threads at once? This is not possible
+   * while profiling or collecting samples for adaptive recompilation.
+   */
+  bool isThreadSafe() const;
+  /**
+   * Write the column names for `writeProfile`.
+   */
+  static void writeProfileHeader(std::ostream &output);
+  /**
+   * Write the counters collected for each node in the query as tab-separated
+   * rows. The query must have been compiled with `PROFILE_NODES`.
+   */
+  void writeProfile(std::ostream &output);
+  /**
+   * Describe how the query will be evaluated: the syntax tree, with the terms
+   * in the order they are checked, the parts of each read that are decoded,
+   * and which checks are made before reads are decoded.
+   */
+  void explain(std::ostream &output);
 
 private:
+  /**
+   * Generate the query into a fresh dylib, replacing the current filter and
+   * index functions and discarding the dylib they came from.
+   */
+  void load(std::shared_ptr<AstNode> &node,
+            llvm::DIScope *debug_scope,
+            unsigned int profiling);
+  /**
+   * Feed the collected profile back to the syntax tree and recompile.
+   */
+  void reload();
+  /**
+   * A version of the query for the reads on chromosomes where every check of
+   * the chromosome has the same answer.
+   */
+  struct Specialization {
+    std::string dylib;
+    bamql::BatchFunction batch;
+  };
+  /**
+   * Get the version of the query for reads on a chromosome, compiling it if
+   * needed, or null if the general version should be used.
+   */
+  Specialization *specialize(const char *chromosome);
+  /**
+   * Discard all versions of the query for particular chromosomes.
+   */
+  void unloadSpecializations();
+  std::string dylibName() const;
   std::shared_ptr<JIT> jit;
   std::string name;
   bamql::FilterFunction filter;
   bamql::IndexFunction index;
+  bamql::BatchFunction batch = nullptr;
+  bamql::RawFilterFunction raw = nullptr;
+  bamql::HeaderFunction file = nullptr;
+  std::shared_ptr<AstNode> node;
+  llvm::DIScope *debug_scope = nullptr;
+  size_t generation = 0;
+  bool loaded = false;
+  unsigned int profiling = 0;
+  std::vector<std::pair<const uint64_t *, Probe>> probes;
+  /**
+   * The counters for a node in the query, added up over every version of the
+   * query compiled so far.
+   */
+  struct NodeProfile {
+    size_t order;
+    unsigned int line;
+    unsigned int column;
+    std::vector<uint64_t> counters;
+  };
+  std::map<const AstNode *, NodeProfile> node_profile;
+  static void addNodeProfile(
+      std::map<const AstNode *, NodeProfile> &totals,
+      const std::vector<std::pair<const uint64_t *, Probe>> &probes);
+  size_t samples_remaining = 0;
+  bool specializable = false;
+  /**
+   * The patterns that decide which version of the query a chromosome gets.
+   * They belong to the syntax tree.
+   */
+  std::vector<const RegularExpression *> chromosome_patterns;
+  /**
+   * The globals of the general version that the other versions use.
+   */
+  std::map<std::string, std::string> shared_globals;
+  std::mutex specialization_mutex;
+  std::map<std::vector<bool>, std::unique_ptr<Specialization>> specializations;
+  std::map<std::string, Specialization *> chromosome_specializations;
+  friend class JIT;
 };
 
 /**
@@ -75,10 +211,36 @@ private:
 class CompileIterator : public ReadIterator {
 public:
   CompileIterator(std::shared_ptr<CompiledPredicate> &predicate);
+  /**
+   * Skip files whose header shows that the query cannot match any read.
+   */
+  virtual bool wantFile(std::shared_ptr<bam_hdr_t> &header);
   virtual bool wantChromosome(std::shared_ptr<bam_hdr_t> &header, uint32_t tid);
+  /**
+   * Reject records on chromosomes that are not wanted or that the query
+   * cannot match.
+   */
+  virtual bool wantRawRead(std::shared_ptr<bam_hdr_t> &header,
+                           const uint8_t *record);
   virtual void processRead(std::shared_ptr<bam_hdr_t> &header,
                            std::shared_ptr<bam1_t> &read);
+  virtual void processBatch(std::shared_ptr<bam_hdr_t> &header,
+                            std::vector<std::shared_ptr<bam1_t>> &reads,
+                            size_t count);
+  virtual bool canFilterConcurrently();
+  virtual void filterBatch(std::shared_ptr<bam_hdr_t> &header,
+                           std::vector<std::shared_ptr<bam1_t>> &reads,
+                           size_t count,
+                           uint8_t *matches);
+  virtual void processFiltered(std::shared_ptr<bam_hdr_t> &header,
+                               std::vector<std::shared_ptr<bam1_t>> &reads,
+                               size_t count,
+                               const uint8_t *matches);
   virtual void ingestHeader(std::shared_ptr<bam_hdr_t> &header) = 0;
+  /**
+   * Record an error from the query. Calls are serialised, even when reads are
+   * filtered concurrently.
+   */
   virtual void handleError(const char *message) = 0;
   /**
    * After filtering, do something useful with a read based on whether it
@@ -92,6 +254,11 @@ public:
                          std::shared_ptr<bam1_t> &read) = 0;
 
 private:
+  void reportError(const char *message);
   std::shared_ptr<CompiledPredicate> predicate;
+  std::mutex error_mutex;
+  std::vector<uint8_t> matches;
+  bam_hdr_t *chromosome_header = nullptr;
+  std::vector<int8_t> chromosomes;
 };
 } // namespace bamql
@@ -16,16 +16,38 @@
 
 #include "bamql-jit.hpp"
 #include "bamql-runtime.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <llvm/Config/llvm-config.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
 #include <llvm/ExecutionEngine/Orc/Core.h>
 #include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/TargetSelect.h>
-#include <pcre.h>
 #include <sstream>
+#include <strings.h>
+#include <tuple>
+#include <unistd.h>
+
+/**
+ * The most versions of a query for particular chromosomes that are compiled,
+ * after which the general version is used for any other chromosomes.
+ */
+#define MAX_SPECIALIZATIONS 64
+
+/**
+ * The most chromosome names whose version of a query is remembered. Beyond
+ * this, as for assemblies with many contigs, the names are forgotten and the
+ * patterns checked again.
+ */
+#define MAX_REMEMBERED_CHROMOSOMES 4096
 
 std::map<std::string, void (*)()> known = {
   { "bamql_aux_fp", (void (*)())bamql_aux_fp },
@@ -40,22 +62,87 @@ std::map<std::string, void (*)()> known = {
   { "bamql_chr", (void (*)())bamql_chr },
   { "bamql_flags", (void (*)())bamql_flags },
   { "bamql_header", (void (*)())bamql_header },
+  { "bamql_header_chromosome", (void (*)())bamql_header_chromosome },
+  { "bamql_header_read_group", (void (*)())bamql_header_read_group },
+  { "bamql_header_read_group_id", (void (*)())bamql_header_read_group_id },
   { "bamql_insert_reversed", (void (*)())bamql_insert_reversed },
   { "bamql_insert_size", (void (*)())bamql_insert_size },
   { "bamql_mate_position_begin", (void (*)())bamql_mate_position_begin },
+  { "bamql_memo_free", (void (*)())bamql_memo_free },
+  { "bamql_memo_new", (void (*)())bamql_memo_new },
+  { "bamql_name_set_contains", (void (*)())bamql_name_set_contains },
+  { "bamql_name_set_free", (void (*)())bamql_name_set_free },
+  { "bamql_name_set_load", (void (*)())bamql_name_set_load },
   { "bamql_position_begin", (void (*)())bamql_position_begin },
   { "bamql_position_end", (void (*)())bamql_position_end },
   { "bamql_randomly", (void (*)())bamql_randomly },
+  { "bamql_randomly_by_name", (void (*)())bamql_randomly_by_name },
   { "bamql_re_bind", (void (*)())bamql_re_bind },
   { "bamql_re_match", (void (*)())bamql_re_match },
+  { "bamql_re_match_memo", (void (*)())bamql_re_match_memo },
+  { "bamql_scratch_mark", (void (*)())bamql_scratch_mark },
+  { "bamql_scratch_release", (void (*)())bamql_scratch_release },
+  { "bamql_str_hash", (void (*)())bamql_str_hash },
   { "bamql_strcmp", (void (*)())bamql_strcmp },
   { "bamql_re_compile", (void (*)())bamql_re_compile },
   { "bamql_re_free", (void (*)())bamql_re_free },
-  { "pcre_free_substring", (void (*)())pcre_free_substring },
+  { "memcmp", (void (*)())memcmp },
+  { "strlen", (void (*)())strlen },
+  { "strncasecmp", (void (*)())strncasecmp },
+  { "strncmp", (void (*)())strncmp },
+  { "strstr",
+    (void (*)())(const char *(*)(const char *, const char *))strstr },
 };
 
-bamql::JIT::JIT()
-    : lljit(llvm::cantFail(
+/**
+ * Write the address of every function loaded to /tmp/perf-PID.map, which
+ * perf(1) uses to name addresses in code it can find no symbols for.
+ */
+class PerfMapListener final : public llvm::JITEventListener {
+public:
+  PerfMapListener() {
+    std::stringstream file_name;
+    file_name << "/tmp/perf-" << getpid() << ".map";
+    output.open(file_name.str(), std::ios::app);
+  }
+  void notifyObjectLoaded(ObjectKey key,
+                          const llvm::object::ObjectFile &object,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+    auto debug_object = info.getObjectForDebug(object);
+    if (debug_object.getBinary() == nullptr) {
+      return;
+    }
+    for (auto &symbol_size :
+         llvm::object::computeSymbolSizes(*debug_object.getBinary())) {
+      auto symbol = symbol_size.first;
+      auto type = symbol.getType();
+      if (!type) {
+        llvm::consumeError(type.takeError());
+        continue;
+      }
+      if (*type != llvm::object::SymbolRef::ST_Function) {
+        continue;
+      }
+      auto name = symbol.getName();
+      auto address = symbol.getAddress();
+      if (!name || !address) {
+        llvm::consumeError(name.takeError());
+        llvm::consumeError(address.takeError());
+        continue;
+      }
+      output << std::hex << *address << " " << symbol_size.second << std::dec
+             << " bamql:" << name->str() << std::endl;
+    }
+  }
+
+private:
+  std::ofstream output;
+};
+
+bamql::JIT::JIT(bool perf_events_, std::shared_ptr<CompileReport> &report_)
+    : perf_events(perf_events_), report(report_),
+      perf_map_listener(perf_events_ ? new PerfMapListener() : nullptr),
+      lljit(llvm::cantFail(
           llvm::orc::LLJITBuilder()
 
               .setObjectLinkingLayerCreator([&](llvm::orc::ExecutionSession
@@ -76,6 +163,14 @@ bamql::JIT::JIT()
                 }
                 linkingLayer->registerJITEventListener(
                     *llvm::JITEventListener::createGDBRegistrationListener());
+                if (perf_events) {
+                  linkingLayer->registerJITEventListener(*perf_map_listener);
+                  auto perf_listener =
+                      llvm::JITEventListener::createPerfJITEventListener();
+                  if (perf_listener != nullptr) {
+                    linkingLayer->registerJITEventListener(*perf_listener);
+                  }
+                }
                 return linkingLayer;
               })
               .create())) {
@@ -96,66 +191,417 @@ bamql::JIT::JIT()
 
   llvm::cantFail(
       lljit->getMainJITDylib().define(llvm::orc::absoluteSymbols(symbols)));
+
+  // The optimiser needs to know the host to decide which vector instructions
+  // it can use for the batch filters.
+  target_machine = llvm::cantFail(
+      llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost())
+          .createTargetMachine());
+
+  // Optimise queries before they are compiled, so the matching code generated
+  // for regular expressions and literals is simplified with the rest of the
+  // query.
+  lljit->getIRTransformLayer().setTransform(
+      [this](llvm::orc::ThreadSafeModule module,
+             const llvm::orc::MaterializationResponsibility &responsibility)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        module.withModuleDo([this](llvm::Module &m) {
+          CompileReport::Timer timer(report, CompileReport::OPTIMISE);
+          if (report) {
+            report->countInstructions(m, false);
+          }
+          llvm::LoopAnalysisManager loop_analysis_manager;
+          llvm::FunctionAnalysisManager function_analysis_manager;
+          llvm::CGSCCAnalysisManager cgscc_analysis_manager;
+          llvm::ModuleAnalysisManager module_analysis_manager;
+          llvm::PassBuilder pass_builder(target_machine.get());
+          pass_builder.registerModuleAnalyses(module_analysis_manager);
+          pass_builder.registerCGSCCAnalyses(cgscc_analysis_manager);
+          pass_builder.registerFunctionAnalyses(function_analysis_manager);
+          pass_builder.registerLoopAnalyses(loop_analysis_manager);
+          pass_builder.crossRegisterProxies(
+              loop_analysis_manager, function_analysis_manager,
+              cgscc_analysis_manager, module_analysis_manager);
+          pass_builder
+              .buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2)
+              .run(m, module_analysis_manager);
+          if (report) {
+            report->countInstructions(m, true);
+          }
+        });
+        return std::move(module);
+      });
 }
 
 bamql::JIT::~JIT() {}
 
-std::shared_ptr<bamql::JIT> bamql::JIT::create() {
+std::shared_ptr<bamql::JIT> bamql::JIT::create(
+    bool perf_events, std::shared_ptr<CompileReport> report) {
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
-  return std::shared_ptr<bamql::JIT>(new bamql::JIT());
+  return std::shared_ptr<bamql::JIT>(new bamql::JIT(perf_events, report));
 }
 
 std::shared_ptr<bamql::CompiledPredicate> bamql::JIT::compile(
     std::shared_ptr<JIT> &jit,
     std::shared_ptr<AstNode> &node,
     const std::string &name,
-    llvm::DIScope *debug_scope) {
+    llvm::DIScope *debug_scope,
+    unsigned int profiling) {
+  auto predicate =
+      std::make_shared<bamql::CompiledPredicate>(jit, name, nullptr, nullptr);
+  predicate->load(node, debug_scope, profiling);
+  return predicate;
+}
+
+std::shared_ptr<bamql::CompiledPredicate> bamql::JIT::compileAdaptive(
+    std::shared_ptr<JIT> &jit,
+    std::shared_ptr<AstNode> &node,
+    const std::string &name,
+    llvm::DIScope *debug_scope,
+    unsigned int profiling,
+    size_t sample_size) {
+  auto predicate =
+      std::make_shared<bamql::CompiledPredicate>(jit, name, nullptr, nullptr);
+  predicate->node = node;
+  predicate->samples_remaining = sample_size;
+  predicate->load(node, debug_scope,
+                  sample_size > 0 ? (profiling | PROFILE_TERMS) : profiling);
+  return predicate;
+}
+
+bamql::CompiledPredicate::CompiledPredicate(std::shared_ptr<JIT> &jit_,
+                                            std::string name_,
+                                            bamql::FilterFunction filter_,
+                                            bamql::IndexFunction index_)
+    : jit(jit_), name(name_), filter(filter_), index(index_) {}
+bamql::CompiledPredicate::~CompiledPredicate() {
+  unloadSpecializations();
+  if (loaded) {
+    auto dylib = jit->lljit->getJITDylibByName(dylibName());
+    llvm::cantFail(jit->lljit->deinitialize(*dylib));
+    llvm::cantFail(jit->lljit->getExecutionSession().removeJITDylib(*dylib));
+  }
+}
+
+std::string bamql::CompiledPredicate::dylibName() const {
+  if (generation == 0) {
+    return name;
+  }
+  std::stringstream dylib_name;
+  dylib_name << name << "." << generation;
+  return dylib_name.str();
+}
+
+/**
+ * Add the counters of the probes attached to query nodes to a running total
+ * for each node in the query.
+ */
+void bamql::CompiledPredicate::addNodeProfile(
+    std::map<const AstNode *, NodeProfile> &totals,
+    const std::vector<std::pair<const uint64_t *, bamql::Probe>> &probes) {
+  for (auto &probe : probes) {
+    if (probe.second.node != nullptr) {
+      auto found = totals.find(probe.second.node);
+      if (found == totals.end()) {
+        found = totals
+                    .emplace(probe.second.node,
+                             NodeProfile{ totals.size(), probe.second.line,
+                                          probe.second.column, {} })
+                    .first;
+      }
+      auto &total = found->second.counters;
+      total.resize(probe.second.size);
+      for (size_t it = 0; it < probe.second.size; it++) {
+        total[it] += probe.first[it];
+      }
+    }
+  }
+}
+
+void bamql::CompiledPredicate::load(std::shared_ptr<AstNode> &node,
+                                    llvm::DIScope *debug_scope,
+                                    unsigned int profiling_) {
+  this->node = node;
+  this->debug_scope = debug_scope;
+  std::unique_ptr<CompileReport::Timer> timer(
+      new CompileReport::Timer(jit->report, CompileReport::GENERATE));
   auto context = std::make_unique<llvm::LLVMContext>();
 
   auto module = std::make_unique<llvm::Module>(name, *context);
+  std::stringstream index_function_name;
+  index_function_name << name << "_index";
+
+  /* For perf, create debugging information that maps the generated code
+   * back to positions in the query. */
+  std::unique_ptr<llvm::DIBuilder> debug_builder;
+  llvm::DISubprogram *filter_scope = nullptr;
+  llvm::DISubprogram *index_scope = nullptr;
+  if (debug_scope == nullptr && jit->perf_events) {
+    debug_builder = std::make_unique<llvm::DIBuilder>(*module);
+    auto file = debug_builder->createFile(name + ".bamql", "");
+    debug_builder->createCompileUnit(llvm::dwarf::DW_LANG_C, file,
+                                     "bamql " + bamql::version(), true, "", 0);
+    auto function_type = debug_builder->createSubroutineType(
+        debug_builder->getOrCreateTypeArray({}));
+    filter_scope = debug_builder->createFunction(
+        file, name, name, file, 1, function_type, 1,
+        llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
+    index_scope = debug_builder->createFunction(
+        file, index_function_name.str(), index_function_name.str(), file, 1,
+        function_type, 1, llvm::DINode::FlagPrototyped,
+        llvm::DISubprogram::SPFlagDefinition);
+    debug_scope = filter_scope;
+  }
+
   auto generator =
       std::make_shared<bamql::Generator>(module.get(), debug_scope);
+  profiling = profiling_;
+  generator->setProfiling(profiling);
   auto filter_func = node->createFilterFunction(generator, name);
-  std::stringstream index_function_name;
-  index_function_name << name << "_index";
+  // Versions of the query for particular chromosomes would need their own
+  // probes, so they are only made when not profiling.
+  chromosome_patterns = generator->chromosomePatterns();
+  specializable = profiling == 0 && !chromosome_patterns.empty();
+  if (index_scope != nullptr) {
+    generator->setDebugScope(index_scope);
+  }
   auto index_func =
       node->createIndexFunction(generator, index_function_name.str());
+  // The header check does not examine reads, so it is always generated.
+  std::stringstream header_function_name;
+  header_function_name << name << "_header";
+  generator->setDebugScope(nullptr);
+  bool has_header = node->createHeaderFunction(
+                        generator, header_function_name.str()) != nullptr;
+  // The batch and raw filters would hide reads from the profile.
+  std::stringstream batch_function_name;
+  batch_function_name << name << "_batch";
+  std::stringstream raw_function_name;
+  raw_function_name << name << "_raw";
+  bool has_raw = false;
+  if (profiling == 0) {
+    node->createBatchFunction(generator, batch_function_name.str(),
+                              filter_func);
+    has_raw = node->createRawFilterFunction(generator,
+                                            raw_function_name.str()) != nullptr;
+  }
+  auto new_probes = generator->probes();
+  shared_globals = generator->sharedGlobals();
 
   generator = nullptr;
-  auto &dylib = llvm::cantFail(jit->lljit->createJITDylib(name));
+  if (debug_builder) {
+    filter_func->setSubprogram(filter_scope);
+    index_func->setSubprogram(index_scope);
+    debug_builder->finalize();
+  }
+  if (loaded) {
+    unloadSpecializations();
+    addNodeProfile(node_profile, probes);
+    auto old_dylib = jit->lljit->getJITDylibByName(dylibName());
+    llvm::cantFail(jit->lljit->deinitialize(*old_dylib));
+    llvm::cantFail(
+        jit->lljit->getExecutionSession().removeJITDylib(*old_dylib));
+    generation++;
+  }
+  // Looking up the functions optimises the module, compiles it, and links it.
+  // The previous phase must end before the next begins.
+  timer.reset();
+  timer.reset(new CompileReport::Timer(jit->report, CompileReport::LINK));
+  auto &dylib = llvm::cantFail(jit->lljit->createJITDylib(dylibName()));
   dylib.addToLinkOrder(jit->lljit->getMainJITDylib());
   llvm::cantFail(jit->lljit->addIRModule(
       dylib,
 
       llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
 
-  auto filter =
+  filter =
       llvm::cantFail(jit->lljit->lookup(dylib, name)).toPtr<FilterFunction>();
-  auto index =
-      llvm::cantFail(jit->lljit->lookup(dylib, index_function_name.str()))
-          .toPtr<IndexFunction>();
+  index = llvm::cantFail(jit->lljit->lookup(dylib, index_function_name.str()))
+              .toPtr<IndexFunction>();
+  batch = profiling == 0
+              ? llvm::cantFail(
+                    jit->lljit->lookup(dylib, batch_function_name.str()))
+                    .toPtr<BatchFunction>()
+              : nullptr;
+  raw = has_raw ? llvm::cantFail(
+                      jit->lljit->lookup(dylib, raw_function_name.str()))
+                      .toPtr<RawFilterFunction>()
+                : nullptr;
+  file = has_header
+             ? llvm::cantFail(
+                   jit->lljit->lookup(dylib, header_function_name.str()))
+                   .toPtr<HeaderFunction>()
+             : nullptr;
+  probes.clear();
+  for (auto &probe : new_probes) {
+    probes.push_back(std::make_pair(
+        llvm::cantFail(jit->lljit->lookup(dylib, probe.name))
+            .toPtr<const uint64_t *>(),
+        probe));
+  }
 
+  timer.reset();
+  timer.reset(
+      new CompileReport::Timer(jit->report, CompileReport::INITIALISE));
   llvm::cantFail(jit->lljit->initialize(dylib));
+  loaded = true;
+}
 
-  return std::make_shared<bamql::CompiledPredicate>(jit, name, filter, index);
+bamql::CompiledPredicate::Specialization *
+bamql::CompiledPredicate::specialize(const char *chromosome) {
+  std::lock_guard<std::mutex> lock(specialization_mutex);
+  auto known = chromosome_specializations.find(chromosome);
+  if (known != chromosome_specializations.end()) {
+    return known->second;
+  }
+  // The version only depends on which of the query's chromosome patterns
+  // match, so nothing is generated for answers that have been seen before or
+  // once there are too many versions.
+  std::vector<bool> decisions;
+  for (auto pattern : chromosome_patterns) {
+    decisions.push_back(pattern->matches(chromosome));
+  }
+  if (chromosome_specializations.size() >= MAX_REMEMBERED_CHROMOSOMES) {
+    chromosome_specializations.clear();
+  }
+  auto existing = specializations.find(decisions);
+  if (existing != specializations.end()) {
+    chromosome_specializations[chromosome] = existing->second.get();
+    return existing->second.get();
+  }
+  if (specializations.size() >= MAX_SPECIALIZATIONS) {
+    chromosome_specializations[chromosome] = nullptr;
+    return nullptr;
+  }
+
+  std::unique_ptr<CompileReport::Timer> timer(
+      new CompileReport::Timer(jit->report, CompileReport::GENERATE));
+  auto context = std::make_unique<llvm::LLVMContext>();
+  auto module = std::make_unique<llvm::Module>(name, *context);
+  std::stringstream batch_function_name;
+  batch_function_name << name << "_batch";
+  auto generator = std::make_shared<bamql::Generator>(module.get(), nullptr);
+  // Compiled patterns and loaded name sets come from the general version.
+  generator->importShared(shared_globals);
+  generator->setChromosome(chromosome);
+  auto filter_func = node->createFilterFunction(generator, name);
+  node->createBatchFunction(generator, batch_function_name.str(),
+                            filter_func);
+  generator = nullptr;
+
+  std::stringstream dylib_name;
+  dylib_name << dylibName() << ".chr" << specializations.size();
+  auto &specialization = specializations[decisions];
+  specialization = std::make_unique<Specialization>();
+  specialization->dylib = dylib_name.str();
+  timer.reset();
+  timer.reset(new CompileReport::Timer(jit->report, CompileReport::LINK));
+  auto &dylib =
+      llvm::cantFail(jit->lljit->createJITDylib(specialization->dylib));
+  dylib.addToLinkOrder(*jit->lljit->getJITDylibByName(dylibName()));
+  dylib.addToLinkOrder(jit->lljit->getMainJITDylib());
+  llvm::cantFail(jit->lljit->addIRModule(
+      dylib,
+      llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+  specialization->batch =
+      llvm::cantFail(jit->lljit->lookup(dylib, batch_function_name.str()))
+          .toPtr<BatchFunction>();
+  timer.reset();
+  timer.reset(new CompileReport::Timer(jit->report, CompileReport::INITIALISE));
+  llvm::cantFail(jit->lljit->initialize(dylib));
+  chromosome_specializations[chromosome] = specialization.get();
+  return specialization.get();
 }
 
-bamql::CompiledPredicate::CompiledPredicate(std::shared_ptr<JIT> &jit_,
-                                            std::string name_,
-                                            bamql::FilterFunction filter_,
-                                            bamql::IndexFunction index_)
-    : jit(jit_), name(name_), filter(filter_), index(index_) {}
-bamql::CompiledPredicate::~CompiledPredicate() {
-  auto dylib = jit->lljit->getJITDylibByName(name);
-  llvm::cantFail(jit->lljit->deinitialize(*dylib));
-  llvm::cantFail(jit->lljit->getExecutionSession().removeJITDylib(*dylib));
+void bamql::CompiledPredicate::unloadSpecializations() {
+  std::lock_guard<std::mutex> lock(specialization_mutex);
+  for (auto &specialization : specializations) {
+    auto dylib = jit->lljit->getJITDylibByName(specialization.second->dylib);
+    llvm::cantFail(jit->lljit->deinitialize(*dylib));
+    llvm::cantFail(jit->lljit->getExecutionSession().removeJITDylib(*dylib));
+  }
+  specializations.clear();
+  chromosome_specializations.clear();
+}
+
+void bamql::CompiledPredicate::reload() {
+  for (auto &probe : probes) {
+    if (probe.second.handler) {
+      probe.second.handler(probe.first);
+    }
+  }
+  load(node, debug_scope, profiling & ~PROFILE_TERMS);
+}
+
+void bamql::CompiledPredicate::writeProfileHeader(std::ostream &output) {
+  output << "query\tline\tcolumn\truns\ttrue\tfalse\tcycles" << std::endl;
+}
+
+void bamql::CompiledPredicate::writeProfile(std::ostream &output) {
+  auto totals = node_profile;
+  addNodeProfile(totals, probes);
+  // Nodes can share a position, so they are sorted by position and then by
+  // when they were first seen.
+  std::vector<const NodeProfile *> rows;
+  for (auto &total : totals) {
+    rows.push_back(&total.second);
+  }
+  std::sort(rows.begin(), rows.end(),
+            [](const NodeProfile *a, const NodeProfile *b) {
+              return std::tie(a->line, a->column, a->order) <
+                     std::tie(b->line, b->column, b->order);
+            });
+  for (auto row : rows) {
+    output << name << "\t" << row->line << "\t" << row->column;
+    for (auto &counter : row->counters) {
+      output << "\t" << counter;
+    }
+    output << std::endl;
+  }
+}
+
+void bamql::CompiledPredicate::explain(std::ostream &output) {
+  QueryPlan plan;
+  node->explain(plan);
+  output << "Query " << name << ":" << std::endl;
+  plan.write(output);
+  output << "Index: "
+         << (node->usesIndex()
+                 ? "whole chromosomes that cannot match are skipped"
+                 : "not used")
+         << std::endl;
+  output << "Header: "
+         << (file != nullptr ? "files that cannot match are skipped"
+                             : "not used")
+         << std::endl;
+  output << "Undecoded reads: "
+         << (raw != nullptr ? "checked using the fixed-size fields"
+                            : "not checked")
+         << std::endl;
+  output << "Versions for each chromosome: "
+         << (specializable ? "compiled as chromosomes are seen" : "not used")
+         << std::endl;
 }
 
 struct ErrorHolder {
   std::function<void(const char *)> error_handler;
 };
+bool bamql::CompiledPredicate::wantFile(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::function<void(const char *)> error_handler) {
+  if (file == nullptr) {
+    return true;
+  }
+  ErrorHolder h{ error_handler };
+  return file(
+      header.get(),
+      [](const char *message, void *v) {
+        ((ErrorHolder *)v)->error_handler(message);
+      },
+      &h);
+}
 bool bamql::CompiledPredicate::wantChromosome(
     std::shared_ptr<bam_hdr_t> &header,
     uint32_t tid,
@@ -174,10 +620,64 @@ bool bamql::CompiledPredicate::wantRead(
     std::function<void(const char *)> error_handler) {
   ErrorHolder h{ error_handler };
 
-  return filter(
+  auto result = filter(
       header.get(), read.get(),
       [](const char *message, void *v) {
         ((ErrorHolder *)v)->error_handler(message);
       },
       &h);
+  if (samples_remaining > 0 && --samples_remaining == 0) {
+    reload();
+  }
+  return result;
+}
+bool bamql::CompiledPredicate::wantRawRead(std::shared_ptr<bam_hdr_t> &header,
+                                           const uint8_t *record) {
+  // Only the fixed-size fields are checked, which cannot cause errors.
+  return raw == nullptr || raw(header.get(), record, nullptr, nullptr);
+}
+bool bamql::CompiledPredicate::isThreadSafe() const {
+  return profiling == 0 && samples_remaining == 0;
+}
+void bamql::CompiledPredicate::wantReads(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count,
+    uint8_t *matches,
+    std::function<void(const char *)> error_handler) {
+  if (batch == nullptr) {
+    for (size_t it = 0; it < count; it++) {
+      matches[it] = wantRead(header, reads[it], error_handler);
+    }
+    return;
+  }
+  std::vector<bam1_t *> batch_reads(count);
+  for (size_t it = 0; it < count; it++) {
+    batch_reads[it] = reads[it].get();
+  }
+  ErrorHolder h{ error_handler };
+  ErrorHandler handler = [](const char *message, void *v) {
+    ((ErrorHolder *)v)->error_handler(message);
+  };
+  if (!specializable) {
+    batch(header.get(), batch_reads.data(), matches, count, handler, &h);
+    return;
+  }
+  // Give each run of reads on the same chromosome to the version of the query
+  // for that chromosome.
+  size_t start = 0;
+  while (start < count) {
+    auto tid = reads[start]->core.tid;
+    auto end = start + 1;
+    while (end < count && reads[end]->core.tid == tid) {
+      end++;
+    }
+    auto specialization = tid >= 0 && tid < header->n_targets
+                              ? specialize(header->target_name[tid])
+                              : nullptr;
+    (specialization == nullptr ? batch : specialization->batch)(
+        header.get(), batch_reads.data() + start, matches + start,
+        end - start, handler, &h);
+    start = end;
+  }
 }
@@ -15,22 +15,94 @@
  */
 
 #include "bamql-jit.hpp"
+#include <htslib/hts_endian.h>
 #include <sstream>
 
 bamql::CompileIterator::CompileIterator(
     std::shared_ptr<CompiledPredicate> &predicate_)
     : predicate(predicate_) {}
 
+bool bamql::CompileIterator::wantFile(std::shared_ptr<bam_hdr_t> &header) {
+  return predicate->wantFile(
+      header, [&](const char *message) { this->reportError(message); });
+}
+
 bool bamql::CompileIterator::wantChromosome(std::shared_ptr<bam_hdr_t> &header,
                                             uint32_t tid) {
-  return predicate->wantChromosome(
-      header, tid, [&](const char *message) { this->handleError(message); });
+  // Each chromosome is only checked the first time it is asked about while
+  // the header is in use, since the check may match its name against a
+  // pattern and there may be millions of chromosomes.
+  if (chromosome_header != header.get()) {
+    chromosome_header = header.get();
+    chromosomes.assign(header->n_targets, -1);
+  }
+  if (tid >= chromosomes.size()) {
+    return false;
+  }
+  if (chromosomes[tid] < 0) {
+    chromosomes[tid] = predicate->wantChromosome(
+        header, tid, [&](const char *message) { this->reportError(message); });
+  }
+  return chromosomes[tid];
+}
+
+bool bamql::CompileIterator::wantRawRead(std::shared_ptr<bam_hdr_t> &header,
+                                         const uint8_t *record) {
+  auto tid = le_to_i32(record);
+  if (tid >= 0 && tid < header->n_targets && !wantChromosome(header, tid)) {
+    return false;
+  }
+  return predicate->wantRawRead(header, record);
 }
 
 void bamql::CompileIterator::processRead(std::shared_ptr<bam_hdr_t> &header,
                                          std::shared_ptr<bam1_t> &read) {
-  readMatch(predicate->wantRead(
-                header, read,
-                [&](const char *message) { this->handleError(message); }),
-            header, read);
+  bool matches;
+  {
+    Metrics::Timer timer(metrics, Metrics::FILTER);
+    matches = predicate->wantRead(
+        header, read, [&](const char *message) { this->reportError(message); });
+  }
+  readMatch(matches, header, read);
+}
+
+void bamql::CompileIterator::processBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count) {
+  matches.resize(count);
+  {
+    Metrics::Timer timer(metrics, Metrics::FILTER);
+    filterBatch(header, reads, count, matches.data());
+  }
+  processFiltered(header, reads, count, matches.data());
+}
+
+bool bamql::CompileIterator::canFilterConcurrently() {
+  return predicate->isThreadSafe();
+}
+
+void bamql::CompileIterator::filterBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count,
+    uint8_t *matches) {
+  predicate->wantReads(
+      header, reads, count, matches,
+      [&](const char *message) { this->reportError(message); });
+}
+
+void bamql::CompileIterator::processFiltered(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count,
+    const uint8_t *matches) {
+  for (size_t it = 0; it < count; it++) {
+    readMatch(matches[it], header, reads[it]);
+  }
+}
+
+void bamql::CompileIterator::reportError(const char *message) {
+  std::lock_guard<std::mutex> lock(error_mutex);
+  handleError(message);
 }
@@ -21,12 +21,15 @@ extern "C" {
 #include <stdbool.h>
 #include <htslib/sam.h>
 
-#define BAMQL_RUNTIME_API_VERSION 2
+#define BAMQL_RUNTIME_API_VERSION 10
 
 	typedef void (*bamql_error_handler) (const char *str, void *context);
 
 /*
  * This file contains the runtime library for BAMQL.
+ *
+ * Reads may be views into a decompressed BAM block, so the functions must
+ * not modify or keep them and must not assume the CIGAR string is aligned.
  */
 	bool bamql_aux_fp(bam1_t *read, char group1, char group2, double *out);
 	bool bamql_aux_int(bam1_t *read, char group1, char group2,
@@ -45,17 +48,28 @@ extern "C" {
 	const char *bamql_chr(bam_hdr_t *header, bam1_t *read, bool mate);
 	uint32_t bamql_flags(bam1_t *read);
 	const char *bamql_header(bam1_t *read);
+	bool bamql_header_chromosome(bam_hdr_t *header, const char *pattern);
+	bool bamql_header_read_group(bam_hdr_t *header, const char *pattern);
+	bool bamql_header_read_group_id(bam_hdr_t *header, const char *id);
 	bool bamql_insert_reversed(bam1_t *read);
 	uint32_t bamql_insert_size(bam1_t *read, bamql_error_handler error_fn,
 				   void *error_ctx);
 	uint32_t bamql_mate_position_begin(bam_hdr_t *header, bam1_t *read,
 					   bamql_error_handler error_fn,
 					   void *error_ctx);
+	void bamql_memo_free(char **memo);
+	const char *bamql_memo_new(void);
+	bool bamql_name_set_contains(const char *name_set, const char *input);
+	const char *bamql_name_set_load(const char *file_name);
+	void bamql_name_set_free(char **name_set);
 	bool bamql_position_begin(bam_hdr_t *header, bam1_t *read,
 				  uint32_t * out);
 	bool bamql_position_end(bam_hdr_t *header, bam1_t *read,
 				uint32_t * out);
-	bool bamql_randomly(double probability);
+	void bamql_random_seed(uint64_t seed);
+	bool bamql_randomly(bam1_t *read, double probability, uint32_t site);
+	bool bamql_randomly_by_name(bam1_t *read, double probability,
+				    uint32_t seed);
 	bool bamql_re_bind(const char *pattern, uint32_t count,
 			   bamql_error_handler error_fn, void *error_ctx,
 			   const char *input, ...);
@@ -63,6 +77,11 @@ extern "C" {
 				     uint32_t count);
 	void bamql_re_free(char **pattern);
 	bool bamql_re_match(const char *pattern, const char *input);
+	bool bamql_re_match_memo(const char *pattern, const char *memo,
+				 const char *input);
+	uint64_t bamql_scratch_mark(void);
+	void bamql_scratch_release(uint64_t mark);
+	uint32_t bamql_str_hash(const char *str, uint32_t seed);
 	int bamql_strcmp(const char *left, const char *right);
 #ifdef __cplusplus
 }
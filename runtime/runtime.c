@@ -213,6 +213,77 @@ const char *bamql_header(bam1_t *read)
 	return bam_get_qname(read);
 }
 
+bool bamql_header_chromosome(bam_hdr_t *header, const char *pattern)
+{
+	int32_t tid;
+	for (tid = 0; tid < header->n_targets; tid++) {
+		if (bamql_re_match(pattern, header->target_name[tid])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Check the ID of every @RG line in the header text against a pattern or an
+ * exact string. A header without any read groups says nothing about the
+ * read groups of its reads, so it always passes.
+ */
+static bool check_read_groups(bam_hdr_t *header,
+			      const char *pattern, const char *id)
+{
+	const char *line;
+	const char *end;
+	const char *eol;
+	const char *field;
+	const char *next;
+	bool found = false;
+	if (header->text == NULL) {
+		return true;
+	}
+	end = header->text + header->l_text;
+	for (line = header->text; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL) {
+			eol = end;
+		}
+		if (eol - line < 3 || strncmp(line, "@RG", 3) != 0) {
+			continue;
+		}
+		for (field = line + 3; field < eol && *field == '\t';
+		     field = next) {
+			field++;
+			next = memchr(field, '\t', eol - field);
+			if (next == NULL) {
+				next = eol;
+			}
+			if (next - field < 3 || strncmp(field, "ID:", 3) != 0) {
+				continue;
+			}
+			found = true;
+			field += 3;
+			if (pattern != NULL ?
+			    pcre_exec((const pcre *)pattern, NULL, field,
+				      next - field, 0, 0, NULL, 0) >= 0 :
+			    strlen(id) == (size_t) (next - field)
+			    && strncmp(id, field, next - field) == 0) {
+				return true;
+			}
+		}
+	}
+	return !found;
+}
+
+bool bamql_header_read_group(bam_hdr_t *header, const char *pattern)
+{
+	return check_read_groups(header, pattern, NULL);
+}
+
+bool bamql_header_read_group_id(bam_hdr_t *header, const char *id)
+{
+	return check_read_groups(header, NULL, id);
+}
+
 bool bamql_insert_reversed(bam1_t *read)
 {
 	return *((int32_t *) & read->core.isize) < 0;
@@ -244,6 +315,182 @@ uint32_t bamql_mate_position_begin(bam_hdr_t *header,
 	return read->core.mpos + 1;
 }
 
+/*
+ * A set of names is an open-addressing hash table. All the names are stored
+ * in a single buffer (the file, with the line breaks replaced by nulls) and
+ * each slot holds the hash of the name and its offset in the buffer, so a
+ * lookup is one hash of the input and, usually, one string comparison.
+ */
+#define NAME_SET_EMPTY ((size_t) -1)
+struct name_set_slot {
+	uint64_t hash;
+	size_t offset;
+};
+struct name_set {
+	size_t mask;
+	struct name_set_slot *slots;
+	char *names;
+};
+
+static uint64_t name_set_hash(const char *str)
+{
+	/* 64-bit FNV-1a */
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *str != '\0'; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+const char *bamql_name_set_load(const char *file_name)
+{
+	FILE *file = fopen(file_name, "r");
+	struct name_set *set;
+	size_t length = 0;
+	size_t capacity = 4096;
+	size_t count = 0;
+	size_t start;
+	size_t it;
+	size_t read_size;
+
+	/*
+	 * The compiler checks that the file can be opened, but a query using a
+	 * partial list would give wrong answers, so any failure here is fatal.
+	 */
+	if (file == NULL) {
+		perror(file_name);
+		abort();
+	}
+	set = malloc(sizeof(struct name_set));
+	set->names = malloc(capacity);
+	while ((read_size =
+		fread(set->names + length, 1, capacity - length - 1, file)) > 0) {
+		length += read_size;
+		if (length + 1 == capacity) {
+			capacity *= 2;
+			set->names = realloc(set->names, capacity);
+		}
+	}
+	if (ferror(file)) {
+		perror(file_name);
+		abort();
+	}
+	fclose(file);
+	set->names[length] = '\0';
+
+	for (it = 0; it < length; it++) {
+		if (set->names[it] == '\n') {
+			count++;
+		}
+	}
+	/* Keep the table at most half full. */
+	set->mask = 15;
+	while (set->mask < 2 * count + 1) {
+		set->mask = (set->mask << 1) | 1;
+	}
+	set->slots = malloc(sizeof(struct name_set_slot) * (set->mask + 1));
+	for (it = 0; it <= set->mask; it++) {
+		set->slots[it].offset = NAME_SET_EMPTY;
+	}
+
+	for (start = 0; start < length; start = it + 1) {
+		uint64_t hash;
+		size_t index;
+		for (it = start; it < length && set->names[it] != '\n'; it++) ;
+		set->names[it] = '\0';
+		if (it > start && set->names[it - 1] == '\r') {
+			set->names[it - 1] = '\0';
+		}
+		if (set->names[start] == '\0') {
+			continue;
+		}
+		hash = name_set_hash(set->names + start);
+		for (index = hash & set->mask;
+		     set->slots[index].offset != NAME_SET_EMPTY;
+		     index = (index + 1) & set->mask) {
+			if (set->slots[index].hash == hash
+			    && strcmp(set->names + set->slots[index].offset,
+				      set->names + start) == 0) {
+				break;
+			}
+		}
+		set->slots[index].hash = hash;
+		set->slots[index].offset = start;
+	}
+	return (const char *)set;
+}
+
+/*
+ * A memo holds the results of a string predicate, such as a regular
+ * expression, for the strings it has seen. Fields like the read group take
+ * only a few distinct values across a whole file, so nearly every lookup
+ * finds the answer without running the predicate again.
+ *
+ * The table is direct-mapped. Each slot is filled once, with a copy of the
+ * string and its result, and never replaced, so threads sharing a memo can
+ * read entries without locking. A string whose slot holds a different string
+ * is not remembered.
+ */
+#define MEMO_SIZE 256
+struct memo_entry {
+	bool result;
+	char str[];
+};
+struct memo {
+	struct memo_entry *slots[MEMO_SIZE];
+};
+
+const char *bamql_memo_new(void)
+{
+	return (const char *)calloc(1, sizeof(struct memo));
+}
+
+void bamql_memo_free(char **memo)
+{
+	struct memo *table = (struct memo *)*memo;
+	size_t it;
+	if (table != NULL) {
+		for (it = 0; it < MEMO_SIZE; it++) {
+			free(table->slots[it]);
+		}
+		free(table);
+		*memo = NULL;
+	}
+}
+
+bool bamql_name_set_contains(const char *name_set, const char *input)
+{
+	const struct name_set *set = (const struct name_set *)name_set;
+	uint64_t hash;
+	size_t index;
+	if (input == NULL) {
+		return false;
+	}
+	hash = name_set_hash(input);
+	for (index = hash & set->mask;
+	     set->slots[index].offset != NAME_SET_EMPTY;
+	     index = (index + 1) & set->mask) {
+		if (set->slots[index].hash == hash
+		    && strcmp(set->names + set->slots[index].offset,
+			      input) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void bamql_name_set_free(char **name_set)
+{
+	struct name_set *set = (struct name_set *)*name_set;
+	if (set != NULL) {
+		free(set->slots);
+		free(set->names);
+		free(set);
+		*name_set = NULL;
+	}
+}
+
 bool bamql_position_begin(bam_hdr_t *header, bam1_t *read, uint32_t *out)
 {
 	if (read->core.tid >= header->n_targets) {
@@ -264,9 +511,109 @@ bool bamql_position_end(bam_hdr_t *header, bam1_t *read, uint32_t *out)
 	return true;
 }
 
-bool bamql_randomly(double probability)
+/*
+ * Random sampling draws each number from the seed given to
+ * `bamql_random_seed`, the fixed fields of the read, and the place in the
+ * query that asked, mixed with splitmix64. Nothing depends on the order of
+ * the reads, so the same seed gives the same sample however the reads are
+ * divided between threads, and each use of `random` in a query chooses
+ * independently.
+ */
+static uint64_t random_seed;
+
+static uint64_t random_mix(uint64_t value)
+{
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+static double random_to_double(uint64_t value)
+{
+	/* Use the top 53 bits to get a uniform value in [0, 1). */
+	return (value >> 11) * (1.0 / (1ULL << 53));
+}
+
+void bamql_random_seed(uint64_t seed)
+{
+	__atomic_store_n(&random_seed, seed, __ATOMIC_RELAXED);
+}
+
+bool bamql_randomly(bam1_t *read, double probability, uint32_t site)
+{
+	uint64_t value =
+	    random_mix(__atomic_load_n(&random_seed, __ATOMIC_RELAXED) ^ site);
+	value = random_mix(value ^ name_set_hash(bam_get_qname(read)));
+	value =
+	    random_mix(value ^ ((uint64_t)read->core.flag << 32 |
+				(uint32_t)read->core.tid));
+	value = random_mix(value ^ (uint64_t)read->core.pos);
+	value = random_mix(value ^ (uint64_t)read->core.mpos);
+	return probability >= random_to_double(value);
+}
+
+bool bamql_randomly_by_name(bam1_t *read, double probability, uint32_t seed)
+{
+	/* Both reads in a pair have the same name, so they are kept or
+	 * dropped together, and the result does not depend on the order of
+	 * the reads. */
+	uint64_t hash = name_set_hash(bam_get_qname(read));
+	return probability >=
+	    random_to_double(random_mix(hash ^ random_mix(seed)));
+}
+
+/*
+ * Captured strings are copied into a per-thread scratch arena instead of
+ * being allocated one at a time. The arena is a list of chunks, each twice as
+ * large as the last, that are kept for the life of the thread; space is
+ * handed out in order and given back by returning to an earlier mark, so
+ * nested bindings release their strings in the reverse of the order they
+ * took them.
+ *
+ * A mark holds the chunk number in the upper half and the offset in the
+ * lower half.
+ */
+#define SCRATCH_CHUNKS 32
+#define SCRATCH_FIRST_SIZE 4096
+static __thread char *scratch_chunks[SCRATCH_CHUNKS];
+static __thread uint32_t scratch_chunk;
+static __thread uint32_t scratch_used;
+
+static char *scratch_alloc(size_t size)
+{
+	while (scratch_chunks[scratch_chunk] == NULL
+	       || scratch_used + size >
+	       ((size_t)SCRATCH_FIRST_SIZE << scratch_chunk)) {
+		if (scratch_chunks[scratch_chunk] != NULL) {
+			if (scratch_chunk + 1 == SCRATCH_CHUNKS) {
+				fprintf(stderr, "Scratch space exhausted.\n");
+				abort();
+			}
+			scratch_chunk++;
+			scratch_used = 0;
+		}
+		if (scratch_chunks[scratch_chunk] == NULL) {
+			scratch_chunks[scratch_chunk] =
+			    malloc((size_t)SCRATCH_FIRST_SIZE << scratch_chunk);
+			if (scratch_chunks[scratch_chunk] == NULL) {
+				perror("scratch");
+				abort();
+			}
+		}
+	}
+	scratch_used += size;
+	return scratch_chunks[scratch_chunk] + scratch_used - size;
+}
+
+uint64_t bamql_scratch_mark(void)
 {
-	return probability >= drand48();
+	return ((uint64_t)scratch_chunk << 32) | scratch_used;
+}
+
+void bamql_scratch_release(uint64_t mark)
+{
+	scratch_chunk = mark >> 32;
+	scratch_used = mark & UINT32_MAX;
 }
 
 bool bamql_re_bind(const char *pattern,
@@ -291,17 +638,32 @@ bool bamql_re_bind(const char *pattern,
 		int number = va_arg(args, uint32_t);
 		const char *error_text = va_arg(args, const char *);
 		const char *result = NULL;
+		uint64_t mark = bamql_scratch_mark();
+		int length = 0;
 		const char **out_str;
 		double *out_fp;
 		int32_t *out_int;
 		char *end;
 
-		if (pcre_get_substring(input, vect, strnum, number, &result) < 0
-		    || result == NULL) {
+		/* Copy the capture out of the input using the offsets PCRE
+		 * gives rather than pcre_get_substring, which allocates. An
+		 * unset group has offsets of -1 and is the empty string. */
+		if (number >= strnum) {
 			error_fn(error_text, error_ctx);
+		} else if (vect[2 * number] < 0) {
+			result = "";
+		} else {
+			char *copy;
+			length = vect[2 * number + 1] - vect[2 * number];
+			copy = scratch_alloc(length + 1);
+			memcpy(copy, input + vect[2 * number], length);
+			copy[length] = '\0';
+			result = copy;
 		}
 		switch (va_arg(args, uint32_t)) {
 		case 0:
+			/* The caller releases the scratch space once it is done
+			 * with the string. */
 			out_str = va_arg(args, const char **);
 			*out_str = result;
 			break;
@@ -316,8 +678,8 @@ bool bamql_re_bind(const char *pattern,
 					*out_fp = NAN;
 					error_fn(error_text, error_ctx);
 				}
-				pcre_free_substring(result);
 			}
+			bamql_scratch_release(mark);
 			break;
 
 		case 2:
@@ -330,16 +692,14 @@ bool bamql_re_bind(const char *pattern,
 					*out_int = 0;
 					error_fn(error_text, error_ctx);
 				}
-				pcre_free_substring(result);
 			}
+			bamql_scratch_release(mark);
 			break;
 
 		case 3:
 			out_int = va_arg(args, int32_t *);
 			*out_int = result == NULL ? 0 : *result;
-			if (result != NULL) {
-				pcre_free_substring(result);
-			}
+			bamql_scratch_release(mark);
 			break;
 		default:
 			abort();
@@ -391,6 +751,58 @@ bool bamql_re_match(const char *pattern, const char *input)
 			 0, NULL, 0) >= 0;
 }
 
+bool bamql_re_match_memo(const char *pattern, const char *memo,
+			 const char *input)
+{
+	struct memo *table = (struct memo *)memo;
+	struct memo_entry *entry;
+	struct memo_entry *empty = NULL;
+	size_t length;
+	size_t it;
+	bool result;
+	if (input == NULL) {
+		return false;
+	}
+	it = name_set_hash(input) % MEMO_SIZE;
+	entry = __atomic_load_n(&table->slots[it], __ATOMIC_ACQUIRE);
+	if (entry != NULL && strcmp(entry->str, input) == 0) {
+		return entry->result;
+	}
+	result = bamql_re_match(pattern, input);
+	if (entry == NULL) {
+		length = strlen(input);
+		entry = malloc(sizeof(struct memo_entry) + length + 1);
+		if (entry != NULL) {
+			entry->result = result;
+			memcpy(entry->str, input, length + 1);
+			if (!__atomic_compare_exchange_n
+			    (&table->slots[it], &empty, entry, false,
+			     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				free(entry);
+			}
+		}
+	}
+	return result;
+}
+
+uint32_t bamql_str_hash(const char *str, uint32_t seed)
+{
+	/* 32-bit FNV-1a with a seeded offset. The compiler uses the same function
+	 * to build perfect hash tables, so the two must not diverge. */
+	uint32_t hash = 2166136261U ^ seed;
+	if (str != NULL) {
+		for (; *str != '\0'; str++) {
+			hash ^= (unsigned char)*str;
+			hash *= 16777619U;
+		}
+	}
+	/* The table index is taken from the low bits, so mix in the high ones. */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	return hash;
+}
+
 int bamql_strcmp(const char *left, const char *right)
 {
 	if (left == right) {
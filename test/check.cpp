@@ -16,6 +16,9 @@
 
 #include "bamql-compiler.hpp"
 #include "bamql-jit.hpp"
+#include "bamql-runtime.h"
+#include <algorithm>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <set>
@@ -53,6 +56,7 @@ std::vector<std::pair<std::string, std::set<std::string>>> queries = {
   { "chr(1*)", { "A", "B", "C", "D", "E", "F", "G", "H", "J" } },
   { "mate_chr(1)", { "A", "B", "E", "G" } },
   { "header ~ /A/", { "A" } },
+  { "header ~ /A/ | chr(2)", { "A", "I" } },
   { "read_group ~ /C3BUK.1/ then chr(2) else chr(12)", { "F", "G", "H" } },
   { "read_group ~ /C3BUK.1/ then chr(1) else chr(2)", { "A", "I" } },
   { "!chr(1)", { "F", "G", "H", "I", "J" } },
@@ -65,16 +69,46 @@ std::vector<std::pair<std::string, std::set<std::string>>> queries = {
   { "all x = 3, 4 in x == 3", {} },
   { "any x = 3, 4 in x < 3", {} },
   { "!(all x = 3, 4 in x > 1)", {} },
+  { "any x = 97, 147, 161 in flags == x", { "A", "E", "G", "H" } },
+  { "all x = 65, 99 in x != flags", { "A", "B", "E", "G", "H" } },
+  { "any g = \"A\", \"B\", \"H\" in header == g", { "A", "B", "H" } },
+  { "all g = \"C\", \"D\" in g != header",
+    { "A", "B", "E", "F", "G", "H", "I", "J" } },
+  { "header == \"C\"", { "C" } },
   { "bind read_group using /C3BUK(?<x_d>\\.\\d)/ in x_d < 0.15", { "A", "J" } },
   { "bind read_group using /C3BUK\\.(?<x_i>\\d)/ in x_i == 1", { "A", "J" } },
   { "bind header using /(?<x_c>.)/ in x_c == 'A", { "A" } },
+  { "bind read_group using /^(?<x>C3\\w+)\\./ in x == \"C3C1A\"",
+    { "B", "C", "D", "H", "I" } },
   { "header ~ /a/i", { "A" } },
+  { "header ~ /^B$/", { "B" } },
+  { "read_group ~ /^c3buk/i", { "A", "E", "F", "G", "J" } },
+  { "read_group ~ /^C3(BUK|C1A)\\.[12]$/",
+    { "A", "B", "C", "D", "E", "F", "H", "I", "J" } },
+  { "header ~ /^[a-c]$/i", { "A", "B", "C" } },
+  { "header ~ /[^a]/i", { "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
+  { "header ~ /[^A-Z]/i", {} },
+  { "read_group ~ /\\.1$/", { "A", "B", "C", "D", "H", "I", "J" } },
+  { "header ~ /^A$/ | header ~ /^[BC]$/ | header ~ /D/",
+    { "A", "B", "C", "D" } },
+  { "read_group ~ /^C3BUK/ & read_group ~ /\\.[12]$/",
+    { "A", "E", "F", "J" } },
+  { "read_group ~ /^(?!C3BUK)C3/", { "B", "C", "D", "H", "I" } },
+  { "read_group != \"C3C1A.1\"", { "A", "E", "F", "G", "J" } },
+  { "header in_file(\"test/names.txt\")", { "B", "D", "H" } },
+  { "random_by_name(0.5)", { "B", "E", "F", "G", "H" } },
+  { "random_by_name(0.5, 7)", { "B", "F", "J" } },
   { "max(3,4,5) == 5", { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
   { "min (3.1 , 4.0 , 5.2 ) < 3.5",
     { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
   { "min(read_group, header) == header", { "A", "B", "C" } },
   { "insert_size == 49", { "H", "I" } },
   { "mate_begin == 11439", { "J" } },
+  { "paired? & !read2? & read_group ~ /^C3BUK/", { "A", "F", "J" } },
+  { "mapping_quality(0.5) | header == \"G\"", { "E", "F", "G" } },
+  { "read_group == \"SAMPLE_X\"", {} },
+  { "chr(Y) & read_group ~ /^C3/", {} },
+  { "chr(Y) | read_group ~ /^C3C1A/", { "B", "C", "D", "H", "I" } },
 };
 
 class Checker final : public bamql::CompileIterator {
@@ -93,21 +127,75 @@ public:
                 << std::endl;
       correct = false;
     }
+    if (matches) {
+      matched.push_back(bam_get_qname(read));
+    }
   }
   void handleError(const char *message) {}
   bool isCorrect() { return correct; }
+  /**
+   * Was each matching read seen exactly once? Reads that cannot match may be
+   * skipped entirely.
+   */
+  bool matchedOnce() {
+    std::sort(matched.begin(), matched.end());
+    return std::vector<std::string>(queries[index].second.begin(),
+                                    queries[index].second.end()) == matched;
+  }
 
 private:
   bool correct;
   int index;
+  std::vector<std::string> matched;
+};
+
+/*
+ * Count the reads examined and matched, to compare ways of reading a file.
+ */
+class Counter final : public bamql::CompileIterator {
+public:
+  Counter(std::shared_ptr<bamql::CompiledPredicate> predicate)
+      : bamql::CompileIterator::CompileIterator(predicate) {}
+  void ingestHeader(std::shared_ptr<bam_hdr_t> &header) {}
+  void readMatch(bool matches,
+                 std::shared_ptr<bam_hdr_t> &header,
+                 std::shared_ptr<bam1_t> &read) {
+    seen++;
+    if (matches) {
+      matched++;
+      names.insert(bam_get_qname(read));
+    }
+  }
+  void handleError(const char *message) {}
+  size_t seen = 0;
+  size_t matched = 0;
+  std::set<std::string> names;
 };
 
+/*
+ * test.bam holds the reads in test.sam, sorted and indexed, all in one
+ * compressed block. Each way of reading it must give the same answers.
+ */
+bool checkBinary(const std::string &query,
+                 const std::string &description,
+                 std::function<bool(Checker &)> process,
+                 std::shared_ptr<bamql::CompiledPredicate> &predicate,
+                 int index) {
+  Checker checker(predicate, index);
+  bool test_success =
+      process(checker) && checker.isCorrect() && checker.matchedOnce();
+  std::cerr << std::setw(2) << index << " " << (test_success ? "----" : "FAIL")
+            << " " << query << " (" << description << ")" << std::endl;
+  return test_success;
+}
+
 int main(int argc, char *const *argv) {
   bool success = true;
   auto jit = bamql::JIT::create();
 
   auto predicates = bamql::getDefaultPredicates();
-  std::vector<Checker> checkers;
+  std::vector<std::shared_ptr<bamql::CompiledPredicate>> compiled;
+  std::vector<std::shared_ptr<Checker>> checkers;
   for (size_t index = 0; index < queries.size(); index++) {
     auto ast =
         bamql::AstNode::parseWithLogging(queries[index].first, predicates);
@@ -119,17 +207,223 @@ int main(int argc, char *const *argv) {
     }
     std::stringstream name;
     name << "test" << index;
-    checkers.emplace_back(bamql::JIT::compile(jit, ast, name.str()), index);
+    compiled.push_back(bamql::JIT::compile(jit, ast, name.str()));
+    checkers.push_back(std::make_shared<Checker>(compiled.back(), index));
   }
 
   for (size_t index = 0; index < queries.size(); index++) {
     bool test_success =
-        checkers[index].processFile("test/test.sam", false, false) &&
-        checkers[index].isCorrect();
+        checkers[index]->processFile("test/test.sam", false, false) &&
+        checkers[index]->isCorrect();
     std::cerr << std::setw(2) << index << " "
               << (test_success ? "----" : "FAIL") << " " << queries[index].first
               << std::endl;
     success &= test_success;
   }
+
+  for (size_t index = 0; index < queries.size(); index++) {
+    auto &query = queries[index].first;
+    auto &predicate = compiled[index];
+    success &= checkBinary(query, "BAM with index",
+                           [](Checker &checker) {
+                             return checker.processFile("test/test.bam", true,
+                                                        false);
+                           },
+                           predicate, index);
+    success &= checkBinary(query, "BAM on 4 threads",
+                           [](Checker &checker) {
+                             checker.setThreads(4);
+                             return checker.processFile("test/test.bam", true,
+                                                        true);
+                           },
+                           predicate, index);
+    success &= checkBinary(query, "BAM without copying",
+                           [](Checker &checker) {
+                             checker.setZeroCopy(true);
+                             return checker.processFile("test/test.bam", true,
+                                                        true);
+                           },
+                           predicate, index);
+    for (size_t count = 1; count <= 4; count++) {
+      std::stringstream description;
+      description << "BAM in " << count << " parts";
+      success &= checkBinary(query, description.str(),
+                             [count](Checker &checker) {
+                               for (size_t part = 0; part < count; part++) {
+                                 checker.setShard(part, count);
+                                 if (!checker.processFile("test/test.bam", true,
+                                                          false)) {
+                                   return false;
+                                 }
+                               }
+                               return true;
+                             },
+                             predicate, index);
+    }
+  }
+
+  // unplaced.bam also has a read without a position. Splitting the file must
+  // not change which reads are examined, including when the query rules out
+  // some chromosomes and the unplaced read is skipped.
+  std::vector<std::string> unplaced_queries = { "true", "chr(1)", "chr(1*)",
+                                                "!chr(2)" };
+  for (size_t index = 0; index < unplaced_queries.size(); index++) {
+    auto &query = unplaced_queries[index];
+    auto ast = bamql::AstNode::parse(query, predicates);
+    std::stringstream name;
+    name << "unplaced" << index;
+    auto predicate = bamql::JIT::compile(jit, ast, name.str());
+    Counter whole(predicate);
+    bool test_success = whole.processFile("test/unplaced.bam", true, false);
+    for (size_t count = 2; count <= 4; count++) {
+      Counter parts(predicate);
+      for (size_t part = 0; part < count; part++) {
+        parts.setShard(part, count);
+        test_success &= parts.processFile("test/unplaced.bam", true, false);
+      }
+      test_success &=
+          parts.seen == whole.seen && parts.matched == whole.matched;
+    }
+    std::cerr << "   " << (test_success ? "----" : "FAIL") << " " << query
+              << " (unplaced reads in parts)" << std::endl;
+    success &= test_success;
+  }
+
+  // A seeded sample depends only on the reads, not on how they are divided
+  // between threads.
+  bamql_random_seed(42);
+  auto random_ast =
+      bamql::AstNode::parse("random(0.5) | random(0.5)", predicates);
+  auto random_predicate = bamql::JIT::compile(jit, random_ast, "random");
+  Counter serial(random_predicate);
+  Counter threaded(random_predicate);
+  threaded.setThreads(4);
+  bool random_success =
+      serial.processFile("test/test.sam", false, false) &&
+      threaded.processFile("test/test.bam", true, true) &&
+      serial.names == threaded.names;
+  std::cerr << "   " << (random_success ? "----" : "FAIL")
+            << " seeded random sample on 4 threads" << std::endl;
+  success &= random_success;
+
+  // Queries that check the chromosome use a version compiled for each
+  // chromosome. Profiling turns those off, so the general version must give
+  // the same answers.
+  for (size_t index = 0; index < queries.size(); index++) {
+    if (queries[index].first.find("chr(") == std::string::npos) {
+      continue;
+    }
+    auto ast = bamql::AstNode::parse(queries[index].first, predicates);
+    std::stringstream name;
+    name << "general" << index;
+    Checker general(bamql::JIT::compile(jit, ast, name.str(), nullptr,
+                                        bamql::PROFILE_NODES),
+                    index);
+    bool test_success = general.processFile("test/test.sam", false, false) &&
+                        general.isCorrect();
+    std::cerr << std::setw(2) << index << " "
+              << (test_success ? "----" : "FAIL") << " " << queries[index].first
+              << " (general version)" << std::endl;
+    success &= test_success;
+  }
+
+  // Adaptive queries are recompiled part way through the file, after three
+  // reads, and must give the same answers before and after.
+  for (size_t index = 0; index < queries.size(); index++) {
+    auto ast = bamql::AstNode::parse(queries[index].first, predicates);
+    std::stringstream name;
+    name << "adaptive" << index;
+    Checker adaptive(
+        bamql::JIT::compileAdaptive(jit, ast, name.str(), nullptr, 0, 3),
+        index);
+    bool test_success = adaptive.processFile("test/test.sam", false, false) &&
+                        adaptive.isCorrect();
+    std::cerr << std::setw(2) << index << " "
+              << (test_success ? "----" : "FAIL") << " " << queries[index].first
+              << " (adaptive)" << std::endl;
+    success &= test_success;
+  }
+
+  // The profile has a row for each term, identified by where it starts in
+  // the query, with the same columns as the header.
+  size_t profiled_index = 0;
+  while (queries[profiled_index].first != "header ~ /A/ | chr(2)") {
+    profiled_index++;
+  }
+  auto profiled_ast =
+      bamql::AstNode::parse(queries[profiled_index].first, predicates);
+  auto profiled_predicate = bamql::JIT::compile(
+      jit, profiled_ast, "profiled", nullptr, bamql::PROFILE_NODES);
+  Checker profiled(profiled_predicate, profiled_index);
+  std::stringstream profile;
+  bamql::CompiledPredicate::writeProfileHeader(profile);
+  bool profile_success =
+      profiled.processFile("test/test.sam", false, false) &&
+      profiled.isCorrect();
+  profiled_predicate->writeProfile(profile);
+  std::string row;
+  size_t rows = 0;
+  while (std::getline(profile, row)) {
+    profile_success &= std::count(row.begin(), row.end(), '\t') == 6 &&
+                       (rows == 0 || row.compare(0, 9, "profiled\t") == 0);
+    rows++;
+  }
+  // The header, the read name, the pattern, and the chromosome.
+  profile_success &= rows == 4;
+  std::cerr << "   " << (profile_success ? "----" : "FAIL") << " profile"
+            << std::endl;
+  success &= profile_success;
+
+  // Name lists are checked when the query is parsed, so a missing file is a
+  // parse error rather than a failure when the query is loaded.
+  bool missing_success = false;
+  try {
+    bamql::AstNode::parse("header in_file(\"test/missing.txt\")", predicates);
+  } catch (bamql::ParseError &e) {
+    missing_success = true;
+  }
+  std::cerr << "   " << (missing_success ? "----" : "FAIL")
+            << " missing name list" << std::endl;
+  success &= missing_success;
+
+  // The plan shows which terms the index can use and what must be decoded.
+  auto explained =
+      bamql::AstNode::parse("chr(2) & header ~ /^[AB]/", predicates);
+  auto explained_predicate = bamql::JIT::compile(jit, explained, "explained");
+  std::stringstream plan;
+  explained_predicate->explain(plan);
+  Checker explainer(explained_predicate, 0);
+  bool plan_success =
+      explainer.explainFile("test/test.sam", false, false, plan) &&
+      plan.str().find("chr /^(chr)?2$/i (decided once per chromosome) "
+                      "[index]") != std::string::npos &&
+      plan.str().find("read name") != std::string::npos;
+  std::cerr << "   " << (plan_success ? "----" : "FAIL") << " explain"
+            << std::endl;
+  if (!plan_success) {
+    std::cerr << plan.str();
+  }
+  success &= plan_success;
+
+  // The compile report counts the code generated for each function and the
+  // patterns compiled when the query is loaded.
+  auto compile_report = std::make_shared<bamql::CompileReport>();
+  auto reported_jit = bamql::JIT::create(false, compile_report);
+  auto reported = bamql::AstNode::parse("header ~ /(A+)\\1/", predicates);
+  auto reported_predicate =
+      bamql::JIT::compile(reported_jit, reported, "reported");
+  std::stringstream report;
+  compile_report->write(report);
+  bool report_success =
+      report.str().find("\nreported\t") != std::string::npos &&
+      report.str().find("optimise IR\t") != std::string::npos &&
+      report.str().find("Regular expressions compiled when loaded: 0") ==
+          std::string::npos;
+  std::cerr << "   " << (report_success ? "----" : "FAIL") << " compile report"
+            << std::endl;
+  if (!report_success) {
+    std::cerr << report.str();
+  }
+  success &= report_success;
   return success ? 0 : 1;
 }
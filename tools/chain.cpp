@@ -16,11 +16,18 @@
 
 #include "bamql-compiler.hpp"
 #include "bamql-jit.hpp"
+#include "bamql-runtime.h"
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <sys/stat.h>
 #include <unistd.h>
 
+/**
+ * The number of seconds between updates to the metrics file.
+ */
+#define METRICS_INTERVAL 10
+
 /**
  * A type for a chaining behaviour. This is a bitfield where the lowest bit is
  * whether to accept the read on no-match and the next bit is whether to accept
@@ -62,11 +69,20 @@ public:
    * make use of it _if_ it will see it upon failure (otherwise, its behaviour
    * is determined by ours.
    */
+  bool wantFile(std::shared_ptr<bam_hdr_t> &header) {
+    return CompileIterator::wantFile(header) ||
+           (next && checkChain(chain, false) && next->wantFile(header));
+  }
   bool wantChromosome(std::shared_ptr<bam_hdr_t> &header, uint32_t tid) {
     return CompileIterator::wantChromosome(header, tid) ||
            (next && checkChain(chain, false) &&
             next->wantChromosome(header, tid));
   }
+  bool wantRawRead(std::shared_ptr<bam_hdr_t> &header, const uint8_t *record) {
+    return CompileIterator::wantRawRead(header, record) ||
+           (next && checkChain(chain, false) &&
+            next->wantRawRead(header, record));
+  }
 
   void ingestHeader(std::shared_ptr<bam_hdr_t> &header) {
     auto version = bamql::version();
@@ -81,7 +97,7 @@ public:
     }
 
     auto id_str = bamql::makeUuid();
-    auto copy = bamql::appendProgramToHeader(header.get(), name.str(), id_str,
+    auto copy = bamql::appendProgramToHeader(header, name.str(), id_str,
                                              version, query);
     if (output_file) {
       if (sam_hdr_write(output_file.get(), copy.get()) == -1) {
@@ -104,6 +120,7 @@ public:
     if (matches) {
       count++;
       if (output_file) {
+        bamql::Metrics::Timer timer(metrics, bamql::Metrics::WRITE);
         if (sam_write1(output_file.get(), header.get(), read.get()) == -1) {
           std::cerr << "Error writing to output BAM. Giving up on file."
                     << std::endl;
@@ -146,14 +163,23 @@ private:
  */
 int main(int argc, char *const *argv) {
   const char *input_filename = nullptr;
+  const char *profile_filename = nullptr;
+  std::shared_ptr<bamql::Metrics> metrics;
+  std::shared_ptr<bamql::CompileReport> compile_report;
+  unsigned int profiling = 0;
+  bool adaptive = false;
   bool binary = false;
   ChainPattern chain = known_chains["parallel"];
   bool help = false;
   bool ignore_index = false;
+  bool perf_events = false;
   int c;
 
-  while ((c = getopt(argc, argv, "bc:f:hI")) != -1) {
+  while ((c = getopt(argc, argv, "abc:f:ghIm:p:P:s:T")) != -1) {
     switch (c) {
+    case 'a':
+      adaptive = true;
+      break;
     case 'b':
       binary = true;
       break;
@@ -165,6 +191,9 @@ int main(int argc, char *const *argv) {
         chain = known_chains[optarg];
       }
       break;
+    case 'g':
+      perf_events = true;
+      break;
     case 'h':
       help = true;
       break;
@@ -174,6 +203,30 @@ int main(int argc, char *const *argv) {
     case 'f':
       input_filename = optarg;
       break;
+    case 'm':
+      metrics = std::make_shared<bamql::Metrics>(optarg, METRICS_INTERVAL);
+      break;
+    case 'p':
+    case 'P':
+      profile_filename = optarg;
+      profiling = bamql::PROFILE_NODES;
+      if (c == 'P') {
+        profiling |= bamql::PROFILE_CYCLES;
+      }
+      break;
+    case 's': {
+      char *end = nullptr;
+      auto seed = strtoull(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0') {
+        std::cerr << "Seed must be a number: " << optarg << std::endl;
+        return 1;
+      }
+      bamql_random_seed(seed);
+      break;
+    }
+    case 'T':
+      compile_report = std::make_shared<bamql::CompileReport>();
+      break;
     case '?':
       fprintf(stderr, "Option -%c is not valid.\n", optopt);
       return 1;
@@ -183,17 +236,32 @@ int main(int argc, char *const *argv) {
   }
   if (help) {
     std::cout << argv[0]
-              << " [-b] [-c] [-I] [-v] -f input.bam "
+              << " [-a] [-b] [-c] [-I] [-m metrics.json] [-p profile.tsv | "
+                 "-P profile.tsv] [-s seed] [-T] [-v] -f input.bam "
                  " query1 output1.bam ..."
               << std::endl;
     std::cout << "Filter a BAM/SAM file based on the provided query. For "
                  "details, see the man page."
               << std::endl;
+    std::cout << "\t-a\tReorder the queries based on the first reads seen."
+              << std::endl;
     std::cout << "\t-b\tThe input file is binary (BAM) not text (SAM)."
               << std::endl;
     std::cout << "\t-c\tChain the queries, rather than use them independently."
               << std::endl;
+    std::cout << "\t-g\tMake the compiled queries visible to perf(1)."
+              << std::endl;
     std::cout << "\t-I\tDo not use the index, even if it exists." << std::endl;
+    std::cout << "\t-m\tPeriodically write throughput information to a file."
+              << std::endl;
+    std::cout << "\t-p\tWrite how often each part of the queries ran to a file."
+              << std::endl;
+    std::cout << "\t-P\tLike -p, but also measure the time spent in each part."
+              << std::endl;
+    std::cout << "\t-s\tThe seed for random sampling." << std::endl;
+    std::cout << "\t-T\tReport the time and memory used to compile the queries "
+                 "and the size of the code generated."
+              << std::endl;
     std::cout << "\t-v\tPrint some information along the way." << std::endl;
     return 0;
   }
@@ -210,10 +278,11 @@ int main(int argc, char *const *argv) {
     std::cout << "An input file is required." << std::endl;
     return 1;
   }
-  auto jit = bamql::JIT::create();
+  auto jit = bamql::JIT::create(perf_events, compile_report);
 
   // Prepare a chain of wranglers.
   std::shared_ptr<OutputWrangler> output;
+  std::vector<std::shared_ptr<bamql::CompiledPredicate>> compiled;
   auto errors = std::make_shared<std::map<const char *, size_t>>();
   for (auto it = argc - 2; it >= optind; it -= 2) {
     // Prepare the output file.
@@ -229,7 +298,12 @@ int main(int argc, char *const *argv) {
     // Parse the input query.
     std::string query(argv[it]);
     bamql::PredicateMap predicates = bamql::getDefaultPredicates();
-    auto ast = bamql::AstNode::parseWithLogging(query, predicates);
+    std::shared_ptr<bamql::AstNode> ast;
+    {
+      bamql::CompileReport::Timer timer(compile_report,
+                                        bamql::CompileReport::PARSE);
+      ast = bamql::AstNode::parseWithLogging(query, predicates);
+    }
     if (!ast) {
       return 1;
     }
@@ -237,16 +311,38 @@ int main(int argc, char *const *argv) {
     // Add the link to the chain.
     std::stringstream function_name;
     function_name << "filter" << it;
-    output = std::make_shared<OutputWrangler>(
-        bamql::JIT::compile(jit, ast, function_name.str()), query, chain,
-        std::string(argv[it + 1]), output_file, output, errors);
+    auto predicate =
+        adaptive ? bamql::JIT::compileAdaptive(jit, ast, function_name.str(),
+                                               nullptr, profiling)
+                 : bamql::JIT::compile(jit, ast, function_name.str(), nullptr,
+                                       profiling);
+    compiled.insert(compiled.begin(), predicate);
+    output = std::make_shared<OutputWrangler>(predicate, query, chain,
+                                              std::string(argv[it + 1]),
+                                              output_file, output, errors);
+    output->setMetrics(metrics);
+  }
+  if (compile_report) {
+    compile_report->write(std::cerr);
   }
 
   // Run the chain.
+  output->setZeroCopy(true);
   int exitcode;
   if (output->processFile(input_filename, binary, ignore_index)) {
     output->write_summary();
     exitcode = 0;
+    if (profile_filename != nullptr) {
+      std::ofstream profile_file(profile_filename);
+      bamql::CompiledPredicate::writeProfileHeader(profile_file);
+      for (auto &predicate : compiled) {
+        predicate->writeProfile(profile_file);
+      }
+      if (!profile_file) {
+        std::cerr << profile_filename << ": " << strerror(errno) << std::endl;
+        exitcode = 1;
+      }
+    }
   } else {
     exitcode = 1;
   }
@@ -86,6 +86,9 @@ public:
   bool usesIndex() { return true; }
   bamql::ExprType type() { return bamql::BOOL; }
   void writeDebug(bamql::GenerateState &state) {}
+  void explain(bamql::QueryPlan &plan) {
+    plan.add(this, main->getName().str(), 4);
+  }
 
 private:
   llvm::Function *main;
@@ -77,8 +77,8 @@ public:
     auto id_str = bamql::makeUuid();
 
     std::string name("bamql-pairs");
-    auto copy = bamql::appendProgramToHeader(header.get(), name, id_str,
-                                             version, query);
+    auto copy =
+        bamql::appendProgramToHeader(header, name, id_str, version, query);
     if (sam_hdr_write(output.get(), copy.get()) == -1) {
       std::cerr << "Error writing to output BAM. Giving up on file."
                 << std::endl;
@@ -221,11 +221,13 @@ int main(int argc, char *const *argv) {
 
   PairCollector collectNames(bamql::JIT::compile(jit, ast, "matched"), matched,
                              matched_tids);
+  collectNames.setZeroCopy(true);
   if (!collectNames.processFile(bam_filename, binary, ignore_index)) {
     return 1;
   }
   collectNames.writeSummary();
   OutputPairs matchNames(matched, matched_tids, query_content, output);
+  matchNames.setZeroCopy(true);
   if (!matchNames.processFile(bam_filename, binary, ignore_index)) {
     return 1;
   }
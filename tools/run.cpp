@@ -16,12 +16,24 @@
 
 #include "bamql-compiler.hpp"
 #include "bamql-jit.hpp"
+#include "bamql-runtime.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <fstream>
+#include <glob.h>
 #include <iostream>
 #include <map>
+#include <set>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 
+/**
+ * The number of seconds between updates to the metrics file.
+ */
+#define METRICS_INTERVAL 10
+
 /**
  * Handler for output collection. Shunts reads into appropriate files and tracks
  * stats.
@@ -41,8 +53,8 @@ public:
 
     if (accept) {
       std::string name("bamql-accept");
-      auto copy = bamql::appendProgramToHeader(header.get(), name, id_str,
-                                               version, query);
+      auto copy =
+          bamql::appendProgramToHeader(header, name, id_str, version, query);
       if (sam_hdr_write(accept.get(), copy.get()) == -1) {
         std::cerr << "Error writing to output BAM. Giving up on file."
                   << std::endl;
@@ -51,8 +63,8 @@ public:
     }
     if (reject) {
       std::string name("bamql-reject");
-      auto copy = bamql::appendProgramToHeader(header.get(), name, id_str,
-                                               version, query);
+      auto copy =
+          bamql::appendProgramToHeader(header, name, id_str, version, query);
       if (sam_hdr_write(reject.get(), copy.get()) == -1) {
         std::cerr << "Error writing to output BAM. Giving up on file."
                   << std::endl;
@@ -60,12 +72,31 @@ public:
       }
     }
   }
+  /**
+   * A file where nothing can match must still be read if the rejected reads
+   * are being written out.
+   */
+  bool wantFile(std::shared_ptr<bam_hdr_t> &header) {
+    return reject || CompileIterator::wantFile(header);
+  }
+  /**
+   * Rejected reads must still be decoded if they are being written out, but
+   * otherwise they only need to be counted.
+   */
+  bool wantRawRead(std::shared_ptr<bam_hdr_t> &header, const uint8_t *record) {
+    if (reject || CompileIterator::wantRawRead(header, record)) {
+      return true;
+    }
+    skipped_count++;
+    return false;
+  }
   void readMatch(bool matches,
                  std::shared_ptr<bam_hdr_t> &header,
                  std::shared_ptr<bam1_t> &read) {
     (matches ? accept_count : reject_count)++;
     std::shared_ptr<htsFile> &chosen = matches ? accept : reject;
     if (chosen) {
+      bamql::Metrics::Timer timer(metrics, bamql::Metrics::WRITE);
       if (sam_write1(chosen.get(), header.get(), read.get()) == -1) {
         std::cerr << "Error writing to output BAM. Giving up on file."
                   << std::endl;
@@ -74,9 +105,16 @@ public:
     }
     if (verbose && (accept_count + reject_count) % 1000000 == 0) {
       std::cout << "So far, Accepted: " << accept_count
-                << " Rejected: " << reject_count << std::endl;
+                << " Rejected: " << reject_count + skipped_count << std::endl;
     }
   }
+  /**
+   * Close the output files.
+   */
+  void releaseOutputs() {
+    accept = nullptr;
+    reject = nullptr;
+  }
   void handleError(const char *message) {
     if (errors.count(message)) {
       errors[message]++;
@@ -84,12 +122,12 @@ public:
       errors[message] = 1;
     }
   }
-  void writeSummary() {
-    std::cout << "Accepted: " << accept_count << std::endl
-              << "Rejected: " << reject_count << std::endl;
+  void writeSummary(std::ostream &output) {
+    output << "Accepted: " << accept_count << std::endl
+           << "Rejected: " << reject_count + skipped_count << std::endl;
     for (auto it = errors.begin(); it != errors.end(); it++) {
-      std::cout << it->first << " (Occurred " << it->second << " times)"
-                << std::endl;
+      output << it->first << " (Occurred " << it->second << " times)"
+             << std::endl;
     }
   }
 
@@ -100,9 +138,171 @@ private:
   std::string query;
   std::shared_ptr<htsFile> reject;
   size_t reject_count = 0;
+  // Reads rejected before being decoded, which may happen on another thread.
+  std::atomic<size_t> skipped_count{ 0 };
   bool verbose;
 };
 
+/**
+ * Add up the summaries written by several runs, such as the shards of one
+ * file, and write the total in the same format.
+ */
+static bool sumSummaries(const std::vector<std::string> &file_names) {
+  size_t accept_count = 0;
+  size_t reject_count = 0;
+  std::map<std::string, size_t> errors;
+  const std::string accepted("Accepted: ");
+  const std::string rejected("Rejected: ");
+  const std::string occurred(" (Occurred ");
+  for (auto &file_name : file_names) {
+    std::ifstream input(file_name);
+    if (!input) {
+      std::cerr << file_name << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    std::string line;
+    while (std::getline(input, line)) {
+      auto occurred_pos = line.rfind(occurred);
+      if (line.compare(0, accepted.length(), accepted) == 0) {
+        accept_count += std::stoull(line.substr(accepted.length()));
+      } else if (line.compare(0, rejected.length(), rejected) == 0) {
+        reject_count += std::stoull(line.substr(rejected.length()));
+      } else if (occurred_pos != std::string::npos) {
+        errors[line.substr(0, occurred_pos)] +=
+            std::stoull(line.substr(occurred_pos + occurred.length()));
+      }
+    }
+  }
+  std::cout << "Accepted: " << accept_count << std::endl
+            << "Rejected: " << reject_count << std::endl;
+  for (auto &error : errors) {
+    std::cout << error.first << " (Occurred " << error.second << " times)"
+              << std::endl;
+  }
+  return true;
+}
+
+/**
+ * Fill in the name of an output for an input in batch mode: every `%s` is
+ * replaced by the input's file name, without its directory or extension.
+ */
+static std::string fillPattern(const std::string &pattern,
+                               const std::string &input) {
+  auto name = input.substr(input.rfind('/') + 1);
+  auto dot = name.rfind('.');
+  if (dot != std::string::npos && dot > 0) {
+    name.erase(dot);
+  }
+  std::string result;
+  size_t start = 0;
+  size_t found;
+  while ((found = pattern.find("%s", start)) != std::string::npos) {
+    result.append(pattern, start, found - start).append(name);
+    start = found + 2;
+  }
+  return result.append(pattern, start, std::string::npos);
+}
+
+/**
+ * Read the list of inputs for batch mode. Each line is a file name or a
+ * shell pattern matching several.
+ */
+static bool readInputList(const char *list_filename,
+                          std::vector<std::string> &inputs) {
+  std::ifstream list(list_filename);
+  if (!list) {
+    std::cerr << list_filename << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(list, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    glob_t matches;
+    if (glob(line.c_str(), 0, nullptr, &matches) != 0) {
+      std::cerr << list_filename << ": No files match " << line << std::endl;
+      globfree(&matches);
+      return false;
+    }
+    for (size_t it = 0; it < matches.gl_pathc; it++) {
+      inputs.push_back(matches.gl_pathv[it]);
+    }
+    globfree(&matches);
+  }
+  return true;
+}
+
+/**
+ * Filter one input of a batch, writing its summary last, through a temporary
+ * file, so that a summary is only present once the input is complete.
+ */
+static bool processBatchInput(
+    std::shared_ptr<bamql::CompiledPredicate> &predicate,
+    std::string &query,
+    bool verbose,
+    const std::string &input,
+    const char *accept_pattern,
+    const char *reject_pattern,
+    const char *summary_pattern,
+    bool binary,
+    bool ignore_index,
+    size_t threads) {
+  auto summary_filename = fillPattern(summary_pattern, input);
+  struct stat info;
+  if (stat(summary_filename.c_str(), &info) == 0) {
+    if (verbose) {
+      std::cout << input << ": Already done." << std::endl;
+    }
+    return true;
+  }
+  std::shared_ptr<htsFile> accept;
+  std::shared_ptr<htsFile> reject;
+  if (accept_pattern != nullptr) {
+    auto accept_filename = fillPattern(accept_pattern, input);
+    accept = bamql::open(accept_filename.c_str(), "wb");
+    if (!accept) {
+      perror(accept_filename.c_str());
+      return false;
+    }
+  }
+  if (reject_pattern != nullptr) {
+    auto reject_filename = fillPattern(reject_pattern, input);
+    reject = bamql::open(reject_filename.c_str(), "wb");
+    if (!reject) {
+      perror(reject_filename.c_str());
+      return false;
+    }
+  }
+  DataCollector stats(predicate, query, false, accept, reject);
+  stats.setZeroCopy(true);
+  stats.setThreads(threads);
+  if (!stats.processFile(input.c_str(), binary, ignore_index)) {
+    return false;
+  }
+  // Close the outputs before the summary marks them complete.
+  accept = nullptr;
+  reject = nullptr;
+  stats.releaseOutputs();
+  auto temporary_filename = summary_filename + ".tmp";
+  {
+    std::ofstream summary(temporary_filename);
+    stats.writeSummary(summary);
+    if (!summary) {
+      std::cerr << temporary_filename << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+  }
+  if (rename(temporary_filename.c_str(), summary_filename.c_str()) != 0) {
+    perror(summary_filename.c_str());
+    return false;
+  }
+  if (verbose) {
+    std::cout << input << ": Done." << std::endl;
+  }
+  return true;
+}
+
 /**
  * Use LLVM to compile a query, JIT it, and run it over a BAM file.
  */
@@ -111,41 +311,88 @@ int main(int argc, char *const *argv) {
                                    // will be placed.
   std::shared_ptr<htsFile> reject; // The file where reads not matching the
                                    // query will be placed.
+  char *accept_filename = nullptr;
+  char *reject_filename = nullptr;
+  char *list_filename = nullptr;
+  char *batch_summary_pattern = nullptr;
+  size_t jobs = 1;
   char *bam_filename = nullptr;
   char *query_filename = nullptr;
+  char *profile_filename = nullptr;
+  char *merge_filename = nullptr;
+  std::vector<std::string> summary_filenames;
+  std::shared_ptr<bamql::Metrics> metrics;
+  std::shared_ptr<bamql::CompileReport> compile_report;
+  unsigned int profiling = 0;
+  bool adaptive = false;
   bool binary = false;
   bool help = false;
   bool verbose = false;
+  bool explain = false;
   bool ignore_index = false;
+  bool perf_events = false;
+  size_t threads = 1;
+  size_t shard_index = 0;
+  size_t shard_count = 1;
   int c;
 
-  while ((c = getopt(argc, argv, "bhf:Io:O:q:v")) != -1) {
+  while ((c = getopt(argc, argv, "abf:F:ghIj:m:M:o:O:p:P:q:r:s:S:t:TU:vx")) !=
+         -1) {
     switch (c) {
+    case 'a':
+      adaptive = true;
+      break;
     case 'b':
       binary = true;
       break;
+    case 'g':
+      perf_events = true;
+      break;
     case 'h':
       help = true;
       break;
     case 'f':
       bam_filename = optarg;
       break;
+    case 'F':
+      list_filename = optarg;
+      break;
     case 'I':
       ignore_index = true;
       break;
-    case 'o':
-      accept = bamql::open(optarg, "wb");
-      if (!accept) {
-        perror(optarg);
+    case 'j': {
+      char *end = nullptr;
+      jobs = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || jobs == 0) {
+        std::cerr << "Job count must be a positive number: " << optarg
+                  << std::endl;
         return 1;
       }
       break;
+    }
+    case 'm':
+      metrics = std::make_shared<bamql::Metrics>(optarg, METRICS_INTERVAL);
+      break;
+    case 'M':
+      merge_filename = optarg;
+      break;
+    case 'o':
+      accept_filename = optarg;
+      break;
     case 'O':
-      reject = bamql::open(optarg, "wb");
-      if (!reject) {
-        perror(optarg);
+      reject_filename = optarg;
+      break;
+    case 'p':
+    case 'P':
+      profile_filename = optarg;
+      profiling = bamql::PROFILE_NODES;
+      if (c == 'P') {
+        profiling |= bamql::PROFILE_CYCLES;
       }
       break;
+    case 'r':
+      batch_summary_pattern = optarg;
+      break;
     case 'q':
       if (query_filename != nullptr) {
         std::cerr << "Query file already specified." << std::endl;
@@ -156,6 +403,50 @@ int main(int argc, char *const *argv) {
     case 'v':
       verbose = true;
       break;
+    case 'x':
+      explain = true;
+      break;
+    case 's': {
+      char *end = nullptr;
+      auto seed = strtoull(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0') {
+        std::cerr << "Seed must be a number: " << optarg << std::endl;
+        return 1;
+      }
+      bamql_random_seed(seed);
+      break;
+    }
+    case 'S': {
+      char *end = nullptr;
+      shard_index = strtoul(optarg, &end, 10);
+      if (*end == '/') {
+        shard_count = strtoul(end + 1, &end, 10);
+      }
+      if (*end != '\0' || shard_index < 1 || shard_index > shard_count) {
+        std::cerr << "Shard must be a part number and a number of parts, as "
+                     "1/4: "
+                  << optarg << std::endl;
+        return 1;
+      }
+      shard_index--;
+      break;
+    }
+    case 't': {
+      char *end = nullptr;
+      threads = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || threads == 0) {
+        std::cerr << "Thread count must be a positive number: " << optarg
+                  << std::endl;
+        return 1;
+      }
+      break;
+    }
+    case 'T':
+      compile_report = std::make_shared<bamql::CompileReport>();
+      break;
+    case 'U':
+      summary_filenames.push_back(optarg);
+      break;
     case '?':
       fprintf(stderr, "Option -%c is not valid.\n", optopt);
       return 1;
@@ -166,27 +457,91 @@ int main(int argc, char *const *argv) {
   if (help) {
     std::cout
         << argv[0]
-        << " [-b] [-I] [-o accepted_reads.bam] [-O "
-           "rejected_reads.bam] [-v] -f input.bam {query | -q query.bamql}"
+        << " [-a] [-b] [-I] [-m metrics.json] [-o accepted_reads.bam] [-O "
+           "rejected_reads.bam] [-p profile.tsv | -P profile.tsv] [-s seed] "
+           "[-S part/parts] [-t threads] [-T] [-v] [-x] -f input.bam {query | "
+           "-q query.bamql}"
         << std::endl;
+    std::cout << argv[0]
+              << " [-a] [-b] [-I] [-j jobs] [-o %s.accepted.bam] [-O "
+                 "%s.rejected.bam] [-t threads] [-T] [-v] [-x] -F inputs.txt "
+                 "-r %s.summary.txt {query | -q query.bamql}"
+              << std::endl;
+    std::cout << argv[0]
+              << " [-M merged.bam part.bam...] [-U summary.txt...]"
+              << std::endl;
     std::cout << "Filter a BAM/SAM file based on the provided query. For "
                  "details, see the man page."
               << std::endl;
+    std::cout << "\t-a\tReorder the query based on the first reads seen."
+              << std::endl;
     std::cout << "\t-b\tThe input file is binary (BAM) not text (SAM)."
               << std::endl;
     std::cout << "\t-f\tThe input file to read." << std::endl;
+    std::cout << "\t-F\tA file listing input files or patterns matching them, "
+                 "one per line."
+              << std::endl;
+    std::cout << "\t-g\tMake the compiled query visible to perf(1)."
+              << std::endl;
     std::cout << "\t-I\tDo not use the index, even if it exists." << std::endl;
+    std::cout << "\t-j\tThe number of input files from a list to process at "
+                 "once."
+              << std::endl;
+    std::cout << "\t-m\tPeriodically write throughput information to a file."
+              << std::endl;
+    std::cout << "\t-M\tJoin the BAM files from each part of a file split "
+                 "with -S."
+              << std::endl;
     std::cout << "\t-o\tThe output file for reads that pass the query."
               << std::endl;
     std::cout << "\t-O\tThe output file for reads that fail the query."
               << std::endl;
+    std::cout << "\t-p\tWrite how often each part of the query ran to a file."
+              << std::endl;
+    std::cout << "\t-P\tLike -p, but also measure the time spent in each part."
+              << std::endl;
     std::cout << "\t-q\tA file containing the query, instead of providing it "
                  "on the command line."
               << std::endl;
+    std::cout << "\t-r\tThe summary file for each input file from a list."
+              << std::endl;
+    std::cout << "\t-s\tThe seed for random sampling." << std::endl;
+    std::cout << "\t-S\tOnly process one part of an indexed file, numbered from "
+                 "one."
+              << std::endl;
+    std::cout << "\t-t\tThe number of threads filtering unindexed input."
+              << std::endl;
+    std::cout << "\t-T\tReport the time and memory used to compile the query "
+                 "and the size of the code generated."
+              << std::endl;
+    std::cout << "\t-U\tAdd up the summaries printed for each part of a file "
+                 "split with -S."
+              << std::endl;
     std::cout << "\t-v\tPrint some information along the way." << std::endl;
+    std::cout << "\t-x\tDescribe how the query and input files would be "
+                 "processed, without reading any reads."
+              << std::endl;
     return 0;
   }
 
+  if (merge_filename != nullptr || !summary_filenames.empty()) {
+    std::vector<std::string> inputs(argv + optind, argv + argc);
+    if (merge_filename != nullptr) {
+      if (inputs.empty()) {
+        std::cout << "Need files to merge." << std::endl;
+        return 1;
+      }
+      if (!bamql::concatenate(inputs, merge_filename)) {
+        return 1;
+      }
+    } else if (!inputs.empty()) {
+      std::cout << "Files can only be provided when merging." << std::endl;
+      return 1;
+    }
+    return summary_filenames.empty() || sumSummaries(summary_filenames) ? 0
+                                                                        : 1;
+  }
+
   if (query_filename == nullptr) {
     if (argc - optind != 1) {
       std::cout << "Need a query." << std::endl;
@@ -199,9 +554,53 @@ int main(int argc, char *const *argv) {
       return 1;
     }
   }
-  if (bam_filename == nullptr) {
+  std::vector<std::string> batch_inputs;
+  if (list_filename != nullptr) {
+    if (bam_filename != nullptr || batch_summary_pattern == nullptr) {
+      std::cout << "A list of input files needs a summary file name and no "
+                   "other input file."
+                << std::endl;
+      return 1;
+    }
+    if (metrics || profiling != 0 || shard_count > 1) {
+      std::cout << "Metrics, profiling, and splitting the input cannot be "
+                   "used with a list of input files."
+                << std::endl;
+      return 1;
+    }
+    if (!readInputList(list_filename, batch_inputs)) {
+      return 1;
+    }
+    // Every input needs outputs of its own.
+    std::set<std::string> outputs;
+    for (auto pattern :
+         { accept_filename, reject_filename, batch_summary_pattern }) {
+      for (auto &input : batch_inputs) {
+        if (pattern != nullptr &&
+            !outputs.insert(fillPattern(pattern, input)).second) {
+          std::cout << "More than one input would write to "
+                    << fillPattern(pattern, input) << std::endl;
+          return 1;
+        }
+      }
+    }
+  } else if (bam_filename == nullptr) {
     std::cout << "Need an input file." << std::endl;
     return 1;
+  } else if (!explain) {
+    if (accept_filename != nullptr) {
+      accept = bamql::open(accept_filename, "wb");
+      if (!accept) {
+        perror(accept_filename);
+        return 1;
+      }
+    }
+    if (reject_filename != nullptr) {
+      reject = bamql::open(reject_filename, "wb");
+      if (!reject) {
+        perror(reject_filename);
+      }
+    }
   }
 
   std::string query_content;
@@ -218,19 +617,99 @@ int main(int argc, char *const *argv) {
   }
   // Parse the input query.
   bamql::PredicateMap predicates = bamql::getDefaultPredicates();
-  auto ast = bamql::AstNode::parseWithLogging(query_content, predicates);
+  std::shared_ptr<bamql::AstNode> ast;
+  {
+    bamql::CompileReport::Timer timer(compile_report,
+                                      bamql::CompileReport::PARSE);
+    ast = bamql::AstNode::parseWithLogging(query_content, predicates);
+  }
   if (!ast) {
     return 1;
   }
 
-  auto jit = bamql::JIT::create();
+  auto jit = bamql::JIT::create(perf_events, compile_report);
+
+  auto predicate =
+      adaptive
+          ? bamql::JIT::compileAdaptive(jit, ast, "filter", nullptr, profiling)
+          : bamql::JIT::compile(jit, ast, "filter", nullptr, profiling);
+  if (compile_report) {
+    compile_report->write(std::cerr);
+  }
+
+  // Describe the plan rather than carrying it out. The output files are not
+  // opened, so the plan is for reading without them.
+  if (explain) {
+    predicate->explain(std::cout);
+    if (list_filename == nullptr) {
+      batch_inputs.push_back(bam_filename);
+    }
+    std::shared_ptr<htsFile> no_output;
+    DataCollector stats(predicate, query_content, false, no_output,
+                        no_output);
+    stats.setShard(shard_index, shard_count);
+    for (auto &input : batch_inputs) {
+      if (!stats.explainFile(input.c_str(), binary, ignore_index,
+                             std::cout)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  // Process the list of input files, sharing the compiled query between a
+  // pool of workers.
+  if (list_filename != nullptr) {
+    if (jobs > 1 && !predicate->isThreadSafe()) {
+      std::cout << "An adaptive query cannot be used with more than one job."
+                << std::endl;
+      return 1;
+    }
+    std::atomic<size_t> next{ 0 };
+    std::atomic<size_t> failures{ 0 };
+    std::vector<std::thread> workers;
+    for (size_t it = 0; it < std::min(jobs, batch_inputs.size()); it++) {
+      workers.emplace_back([&] {
+        size_t input;
+        while ((input = next++) < batch_inputs.size()) {
+          if (!processBatchInput(predicate, query_content, verbose,
+                                 batch_inputs[input], accept_filename,
+                                 reject_filename, batch_summary_pattern,
+                                 binary, ignore_index, threads)) {
+            failures++;
+          }
+        }
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    if (failures > 0) {
+      std::cerr << failures << " of " << batch_inputs.size()
+                << " input files failed." << std::endl;
+      return 1;
+    }
+    return 0;
+  }
 
   // Process the input file.
-  DataCollector stats(bamql::JIT::compile(jit, ast, "filter"), query_content,
-                      verbose, accept, reject);
+  DataCollector stats(predicate, query_content, verbose, accept, reject);
+  stats.setMetrics(metrics);
+  stats.setZeroCopy(true);
+  stats.setThreads(threads);
+  stats.setShard(shard_index, shard_count);
 
   if (stats.processFile(bam_filename, binary, ignore_index)) {
-    stats.writeSummary();
+    stats.writeSummary(std::cout);
+    if (profile_filename != nullptr) {
+      std::ofstream profile_file(profile_filename);
+      bamql::CompiledPredicate::writeProfileHeader(profile_file);
+      predicate->writeProfile(profile_file);
+      if (!profile_file) {
+        std::cerr << profile_filename << ": " << strerror(errno) << std::endl;
+        return 1;
+      }
+    }
     return 0;
   } else {
     return 1;